@@ -0,0 +1,232 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+
+#pragma once
+
+#include <cassert>
+#include <intrin.h>
+#include <windows.h>
+
+//
+// WinBase.h defines Yield() as an empty macro.
+//
+
+#undef Yield
+
+#include "UScheduler.h"
+#include "UThread.h"
+
+//
+// An actor processing messages of type Msg, which must be default-constructible 
+// and copyable, one at a time, in the order each sender sent them. Messages are 
+// posted to a lock-free mailbox from any operating system thread. The actor is 
+// only scheduled while its mailbox holds messages: the first message posted to 
+// an idle actor creates a user thread on the actor's scheduler, which handles 
+// up to a batch of messages before yielding, and exits, releasing its stack, 
+// once the mailbox is empty. An idle actor costs only its instance, so a process 
+// can hold millions of them.
+//
+// Derived classes implement Receive(). An actor must not be destroyed while it 
+// is active.
+//
+
+template <class Msg>
+class Actor
+{
+    //
+    // A mailbox node. The mailbox is Dmitry Vyukov's non-intrusive MPSC queue: 
+    // producers exchange the tail and then link the previous tail to their node, 
+    // while the consumer follows the links from a stub node, the last one it 
+    // consumed, which it frees when it consumes the next.
+    //
+
+    struct Node
+    {
+        Node * volatile Next;
+        Msg Message;
+    };
+
+    //
+    // The last node posted, written by the senders.
+    //
+
+    Node * volatile m_pTail;
+
+    //
+    // The stub node, written by the activation.
+    //
+
+    Node *m_pHead;
+
+    //
+    // Set while a user thread is scheduled to process messages.
+    //
+
+    volatile long m_active;
+
+    //
+    // The scheduler that runs the activations, the maximum number of messages 
+    // handled by an activation before yielding and the creation flags of its 
+    // user threads.
+    //
+
+    UScheduler *m_pScheduler;
+    int m_batchSize;
+    unsigned m_flags;
+
+public:
+
+    //
+    // Creates an idle actor run by the specified scheduler, which handles up to 
+    // batchSize messages before yielding to other threads. The flags are those 
+    // passed to UThread::Create() for its activations.
+    //
+
+    explicit Actor(UScheduler &scheduler, int batchSize = 16, unsigned flags = 0)
+        : m_pTail(new Node()),
+          m_active(0),
+          m_pScheduler(&scheduler),
+          m_batchSize(batchSize),
+          m_flags(flags)
+    {
+        m_pTail->Next = NULL;
+        m_pHead = m_pTail;
+    }
+
+    virtual ~Actor()
+    {
+        assert(m_active == 0);
+
+        while (m_pHead != NULL) {
+            Node *node = m_pHead;
+            m_pHead = node->Next;
+            delete node;
+        }
+    }
+
+    //
+    // Posts a message to the actor, scheduling it if it is idle. Can be called 
+    // from any operating system thread, including from Receive().
+    //
+
+    void Send(const Msg &message)
+    {
+        Node *node = new Node();
+
+        node->Next = NULL;
+        node->Message = message;
+
+        Node *previous = (Node *) InterlockedExchangePointer((PVOID volatile *) &m_pTail, node);
+        previous->Next = node;
+
+        if (m_active == 0 && _InterlockedExchange(&m_active, 1) == 0) {
+            UThread::Create(*m_pScheduler, activation, this, m_flags);
+        }
+    }
+
+    //
+    // Returns whether the actor has no messages and no user thread scheduled.
+    //
+
+    bool IsIdle() const
+    {
+        return m_active == 0;
+    }
+
+protected:
+
+    //
+    // Handles a message. Called on the actor's user thread, never concurrently.
+    //
+
+    virtual void Receive(Msg &message) = 0;
+
+private:
+
+    //
+    // Removes the oldest message from the mailbox. Returns false if the mailbox 
+    // is empty, or if the next sender has exchanged the tail but not yet linked 
+    // its node.
+    //
+
+    bool try_take(Msg &message)
+    {
+        Node *head = m_pHead;
+        Node *next = head->Next;
+
+        if (next == NULL) {
+            return false;
+        }
+
+        message = next->Message;
+        m_pHead = next;
+        delete head;
+        return true;
+    }
+
+    //
+    // Returns whether no sender has posted a message the activation has not taken.
+    //
+
+    bool empty() const
+    {
+        return m_pTail == m_pHead;
+    }
+
+    //
+    // The function run by an activation. Handles batches of messages, yielding 
+    // between them, until the mailbox is empty. The actor then becomes idle, 
+    // unless a message arrived meanwhile and the activation claims it back 
+    // before any sender schedules a new one.
+    //
+
+    static void activation(UThread::Argument arg)
+    {
+        Actor *actor = (Actor *) arg;
+        Msg message;
+
+        for (;;) {
+            int handled = 0;
+
+            while (handled < actor->m_batchSize && actor->try_take(message)) {
+                actor->Receive(message);
+                ++handled;
+            }
+
+            if (!actor->empty()) {
+                UThread::Yield();
+                continue;
+            }
+
+            //
+            // A new activation must not run, and possibly let the actor be 
+            // destroyed, before this one last reads it.
+            //
+
+            PreemptionGuard guard;
+
+            _InterlockedExchange(&actor->m_active, 0);
+
+            if (actor->empty() || _InterlockedExchange(&actor->m_active, 1) != 0) {
+                return;
+            }
+        }
+    }
+
+    Actor(const Actor &);
+    Actor & operator =(const Actor &);
+};
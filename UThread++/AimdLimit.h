@@ -0,0 +1,110 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+
+#pragma once
+
+#include <climits>
+
+//
+// How an AimdLimit adapts: the bounds of the limit, the latency above which a 
+// sample counts as congestion, in microseconds, the amount added after a full 
+// window of good samples and the percentage removed on congestion.
+//
+
+struct AimdPolicy
+{
+    int Minimum;
+    int Maximum;
+    __int64 TargetLatency;
+    int Increase;
+    int DecreasePercent;
+
+    AimdPolicy()
+        : Minimum(1),
+          Maximum(INT_MAX),
+          TargetLatency(_I64_MAX),
+          Increase(1),
+          DecreasePercent(25)
+    { }
+};
+
+//
+// A limit adjusted by additive increase and multiplicative decrease from the 
+// latencies observed downstream. After as many good samples as the limit, it 
+// grows by Increase; a sample above TargetLatency shrinks it by DecreasePercent, 
+// at most once per window of as many samples as the new limit, since the calls 
+// started before a decrease still report the congestion that caused it. The 
+// limit is an integer, as threads without VectorState must not use floating point.
+//
+
+class AimdLimit
+{
+    AimdPolicy m_policy;
+    int m_limit;
+    int m_goodSamples;
+    int m_holdOff;
+
+public:
+
+    AimdLimit(int initial, const AimdPolicy &policy)
+        : m_policy(policy),
+          m_limit(initial),
+          m_goodSamples(0),
+          m_holdOff(0)
+    { }
+
+    //
+    // Returns the current limit.
+    //
+
+    int Current() const
+    {
+        return m_limit;
+    }
+
+    //
+    // Accounts for a call that took the specified time. Returns true if the limit 
+    // changed.
+    //
+
+    bool Sample(__int64 latencyMicroseconds)
+    {
+        int previous = m_limit;
+
+        if (m_holdOff > 0) {
+            m_holdOff -= 1;
+        }
+
+        if (latencyMicroseconds > m_policy.TargetLatency) {
+            m_goodSamples = 0;
+            if (m_holdOff == 0) {
+                int decrease = (int) ((__int64) m_limit * m_policy.DecreasePercent / 100);
+                m_limit = m_limit - (decrease > 0 ? decrease : 1);
+                if (m_limit < m_policy.Minimum) {
+                    m_limit = m_policy.Minimum;
+                }
+                m_holdOff = m_limit;
+            }
+        } else if (++m_goodSamples >= m_limit) {
+            m_goodSamples = 0;
+            m_limit = m_limit > m_policy.Maximum - m_policy.Increase 
+                    ? m_policy.Maximum : m_limit + m_policy.Increase;
+        }
+
+        return m_limit != previous;
+    }
+};
@@ -0,0 +1,220 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+#pragma once
+
+#include <intrin.h>
+#include "CacheLine.h"
+#include "EventCount.h"
+
+//
+// A bounded multiple-producer, multiple-consumer queue (Dmitry Vyukov's 
+// design). Each cell carries a sequence number that tells producers and 
+// consumers whether it is free or holds an item for their position, so an 
+// operation costs a single CAS on the uncontended path.
+//
+
+template <class T>
+class BoundedQueue
+{
+    struct Cell
+    {
+        volatile long Sequence;
+        T Value;
+    };
+
+    //
+    // The positions written by producers and consumers are kept in different 
+    // cache lines, away from the read-only fields.
+    //
+
+    char m_pad0[CACHE_LINE_SIZE];
+    Cell *m_pCells;
+    long m_mask;
+    char m_pad1[CACHE_LINE_SIZE - sizeof(Cell *) - sizeof(long)];
+    volatile long m_enqueuePosition;
+    char m_pad2[CACHE_LINE_SIZE - sizeof(long)];
+    volatile long m_dequeuePosition;
+    char m_pad3[CACHE_LINE_SIZE - sizeof(long)];
+
+public:
+
+    //
+    // Creates a queue with the specified capacity, which must be a power of two.
+    //
+
+    explicit BoundedQueue(long capacity)
+        : m_pCells(new Cell[capacity]),
+          m_mask(capacity - 1),
+          m_enqueuePosition(0),
+          m_dequeuePosition(0)
+    {
+        for (long i = 0; i < capacity; ++i) {
+            m_pCells[i].Sequence = i;
+        }
+    }
+
+    ~BoundedQueue()
+    {
+        delete[] m_pCells;
+    }
+
+    //
+    // Adds an item to the queue. Returns false if the queue is full.
+    //
+
+    bool TryEnqueue(const T &value)
+    {
+        Cell *cell;
+        long position = m_enqueuePosition;
+
+        for (;;) {
+            cell = &m_pCells[position & m_mask];
+            long difference = cell->Sequence - position;
+
+            if (difference == 0) {
+                long observed = _InterlockedCompareExchange(&m_enqueuePosition, position + 1, position);
+                if (observed == position) {
+                    break;
+                }
+                position = observed;
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = m_enqueuePosition;
+            }
+        }
+
+        cell->Value = value;
+        cell->Sequence = position + 1;
+        return true;
+    }
+
+    //
+    // Removes an item from the queue. Returns false if the queue is empty.
+    //
+
+    bool TryDequeue(T &value)
+    {
+        Cell *cell;
+        long position = m_dequeuePosition;
+
+        for (;;) {
+            cell = &m_pCells[position & m_mask];
+            long difference = cell->Sequence - (position + 1);
+
+            if (difference == 0) {
+                long observed = _InterlockedCompareExchange(&m_dequeuePosition, position + 1, position);
+                if (observed == position) {
+                    break;
+                }
+                position = observed;
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = m_dequeuePosition;
+            }
+        }
+
+        value = cell->Value;
+        cell->Sequence = position + m_mask + 1;
+        return true;
+    }
+
+private:
+
+    BoundedQueue(const BoundedQueue &);
+    BoundedQueue & operator =(const BoundedQueue &);
+};
+
+//
+// A bounded queue whose producers park while it is full and whose consumers park 
+// while it is empty. Operations only enter the scheduler in those cases.
+//
+
+template <class T>
+class BlockingBoundedQueue
+{
+    BoundedQueue<T> m_queue;
+    EventCount m_notFull;
+    EventCount m_notEmpty;
+
+public:
+
+    explicit BlockingBoundedQueue(long capacity)
+        : m_queue(capacity)
+    { }
+
+    bool TryEnqueue(const T &value)
+    {
+        if (!m_queue.TryEnqueue(value)) {
+            return false;
+        }
+
+        m_notEmpty.NotifyOne();
+        return true;
+    }
+
+    bool TryDequeue(T &value)
+    {
+        if (!m_queue.TryDequeue(value)) {
+            return false;
+        }
+
+        m_notFull.NotifyOne();
+        return true;
+    }
+
+    //
+    // Adds an item to the queue, parking the current user thread while it is full.
+    //
+
+    void Enqueue(const T &value)
+    {
+        while (!TryEnqueue(value)) {
+            long key = m_notFull.PrepareWait();
+
+            if (TryEnqueue(value)) {
+                m_notFull.CancelWait();
+                return;
+            }
+
+            m_notFull.Wait(key);
+        }
+    }
+
+    //
+    // Removes an item from the queue, parking the current user thread while it is empty.
+    //
+
+    T Dequeue()
+    {
+        T value;
+
+        while (!TryDequeue(value)) {
+            long key = m_notEmpty.PrepareWait();
+
+            if (TryDequeue(value)) {
+                m_notEmpty.CancelWait();
+                return value;
+            }
+
+            m_notEmpty.Wait(key);
+        }
+
+        return value;
+    }
+};
@@ -0,0 +1,335 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+
+#include <cassert>
+#include <winsock2.h>
+#include <windows.h>
+
+//
+// WinBase.h defines Yield() as an empty macro.
+//
+
+#undef Yield
+
+#include "BufferPool.h"
+
+#pragma comment(lib, "ws2_32.lib")
+
+//
+// Returns the size of the buffer.
+//
+
+int Buffer::Capacity() const
+{
+    return m_pPool->m_bufferSize;
+}
+
+//
+// Drops a reference, returning the buffer to its pool with the last one.
+//
+
+void Buffer::Release()
+{
+    assert(m_refCount > 0);
+
+    if (_InterlockedDecrement(&m_refCount) == 0) {
+        m_pPool->release(this);
+    }
+}
+
+//
+// Creates a pool. The buffers are laid out a whole number of cache lines apart, 
+// so buffers in use by different operating system threads share no cache line, 
+// in a region committed up front. Throws bad_alloc if the region cannot be 
+// allocated.
+//
+
+BufferPool::BufferPool(UScheduler &scheduler, int bufferSize, int numBuffers)
+    : m_pScheduler(&scheduler),
+      m_bufferSize(bufferSize),
+      m_numBuffers(numBuffers),
+      m_pFreeList(NULL),
+      m_pRemoteFreeList(NULL)
+{
+    assert(bufferSize > 0 && numBuffers > 0);
+
+    size_t stride = ((size_t) bufferSize + CACHE_LINE_SIZE - 1) & ~(size_t) (CACHE_LINE_SIZE - 1);
+
+    if ((size_t) numBuffers > (size_t) -1 / stride) {
+        throw bad_alloc();
+    }
+
+    m_regionSize = stride * numBuffers;
+    m_pBuffers = new Buffer[numBuffers];
+    m_pRegion = (unsigned char *) VirtualAlloc(NULL, m_regionSize, MEM_RESERVE | MEM_COMMIT, 
+                                               PAGE_READWRITE);
+    if (m_pRegion == NULL) {
+        delete[] m_pBuffers;
+        throw bad_alloc();
+    }
+
+    //
+    // Link the buffers in address order, so the first ones allocated are adjacent.
+    //
+
+    for (int i = numBuffers - 1; i >= 0; --i) {
+        Buffer *buffer = &m_pBuffers[i];
+
+        buffer->m_pPool = this;
+        buffer->m_pData = m_pRegion + i * stride;
+        buffer->m_refCount = 0;
+        buffer->m_length = 0;
+        buffer->m_pNextFree = m_pFreeList;
+        m_pFreeList = buffer;
+    }
+}
+
+//
+// The BufferPool destructor.
+//
+
+BufferPool::~BufferPool()
+{
+    for (int i = 0; i < m_numBuffers; ++i) {
+        assert(m_pBuffers[i].m_refCount == 0);
+    }
+
+    delete[] m_pBuffers;
+    VirtualFree(m_pRegion, 0, MEM_RELEASE);
+}
+
+//
+// Takes a buffer from the free list, taking over the buffers released remotely 
+// when it is empty.
+//
+
+Buffer * BufferPool::TryAllocate()
+{
+    PreemptionGuard guard;
+
+    assert(m_pScheduler->m_ownerThreadId == GetCurrentThreadId());
+
+    if (m_pFreeList == NULL) {
+        if (m_pRemoteFreeList == NULL) {
+            return NULL;
+        }
+        m_pFreeList = (Buffer *) InterlockedExchangePointer((PVOID volatile *) &m_pRemoteFreeList, NULL);
+    }
+
+    Buffer *buffer = m_pFreeList;
+
+    m_pFreeList = buffer->m_pNextFree;
+    buffer->m_refCount = 1;
+    buffer->m_length = 0;
+    return buffer;
+}
+
+//
+// Takes a buffer, parking while there is none.
+//
+
+Buffer * BufferPool::Allocate()
+{
+    Buffer *buffer;
+
+    while ((buffer = TryAllocate()) == NULL) {
+        long key = m_released.PrepareWait();
+
+        if ((buffer = TryAllocate()) != NULL) {
+            m_released.CancelWait();
+            return buffer;
+        }
+
+        m_released.Wait(key);
+    }
+
+    return buffer;
+}
+
+//
+// Returns a buffer to the pool. On the owning scheduler, it goes to the free list; 
+// elsewhere, it is pushed onto the remote list, which the owner only ever takes 
+// whole, so the push is safe from ABA.
+//
+
+void BufferPool::release(Buffer *buffer)
+{
+    if (m_pScheduler->m_ownerThreadId == GetCurrentThreadId()) {
+        PreemptionGuard guard;
+
+        buffer->m_pNextFree = m_pFreeList;
+        m_pFreeList = buffer;
+    } else {
+        Buffer *head;
+
+        do {
+            head = m_pRemoteFreeList;
+            buffer->m_pNextFree = head;
+        } while (InterlockedCompareExchangePointer((PVOID volatile *) &m_pRemoteFreeList, 
+                                                   buffer, head) != head);
+    }
+
+    m_released.NotifyOne();
+}
+
+//
+// Offloads a call on the buffers and returns its result.
+//
+
+int BufferIo::Receive(size_t socket, Buffer *buffers[], int count)
+{
+    if (count < 1 || count > m_maxBuffers) {
+        WSASetLastError(WSAEINVAL);
+        return -1;
+    }
+
+    Request request = { socket, buffers, count, -1 };
+
+    UScheduler::Offload(receive_buffers, &request);
+    return request.Result;
+}
+
+int BufferIo::Send(size_t socket, Buffer *buffers[], int count)
+{
+    if (count < 1 || count > m_maxBuffers) {
+        WSASetLastError(WSAEINVAL);
+        return -1;
+    }
+
+    Request request = { socket, buffers, count, -1 };
+
+    UScheduler::Offload(send_buffers, &request);
+    return request.Result;
+}
+
+int BufferIo::Read(void *file, Buffer *buffer)
+{
+    Request request = { (size_t) file, &buffer, 1, -1 };
+
+    UScheduler::Offload(read_buffer, &request);
+    return request.Result;
+}
+
+int BufferIo::Write(void *file, Buffer *buffers[], int count)
+{
+    Request request = { (size_t) file, buffers, count, -1 };
+
+    UScheduler::Offload(write_buffers, &request);
+    return request.Result;
+}
+
+//
+// Receives into the buffers with a single WSARecv(), which fills them in order, 
+// and spreads the byte count over their lengths.
+//
+
+void * BufferIo::receive_buffers(void *argument)
+{
+    Request *request = (Request *) argument;
+    WSABUF wsaBuffers[m_maxBuffers];
+    DWORD received;
+    DWORD flags = 0;
+
+    assert(request->Count <= m_maxBuffers);
+
+    for (int i = 0; i < request->Count; ++i) {
+        wsaBuffers[i].buf = (char *) request->Buffers[i]->Data();
+        wsaBuffers[i].len = request->Buffers[i]->Capacity();
+    }
+
+    if (WSARecv((SOCKET) request->Handle, wsaBuffers, request->Count, &received, &flags, 
+                NULL, NULL) == SOCKET_ERROR) {
+        return NULL;
+    }
+
+    request->Result = received;
+
+    for (int i = 0; i < request->Count; ++i) {
+        int length = received < wsaBuffers[i].len ? received : wsaBuffers[i].len;
+        request->Buffers[i]->SetLength(length);
+        received -= length;
+    }
+
+    return NULL;
+}
+
+//
+// Sends the bytes in use of the buffers with a single WSASend().
+//
+
+void * BufferIo::send_buffers(void *argument)
+{
+    Request *request = (Request *) argument;
+    WSABUF wsaBuffers[m_maxBuffers];
+    DWORD sent;
+
+    assert(request->Count <= m_maxBuffers);
+
+    for (int i = 0; i < request->Count; ++i) {
+        wsaBuffers[i].buf = (char *) request->Buffers[i]->Data();
+        wsaBuffers[i].len = request->Buffers[i]->Length();
+    }
+
+    if (WSASend((SOCKET) request->Handle, wsaBuffers, request->Count, &sent, 0, 
+                NULL, NULL) != SOCKET_ERROR) {
+        request->Result = sent;
+    }
+
+    return NULL;
+}
+
+//
+// Reads into the buffer.
+//
+
+void * BufferIo::read_buffer(void *argument)
+{
+    Request *request = (Request *) argument;
+    Buffer *buffer = request->Buffers[0];
+    DWORD read;
+
+    if (ReadFile((HANDLE) request->Handle, buffer->Data(), buffer->Capacity(), &read, NULL)) {
+        buffer->SetLength(read);
+        request->Result = read;
+    }
+
+    return NULL;
+}
+
+//
+// Writes the buffers one after the other. WriteFileGather() would need page-sized 
+// buffers and an unbuffered, overlapped file.
+//
+
+void * BufferIo::write_buffers(void *argument)
+{
+    Request *request = (Request *) argument;
+    int total = 0;
+
+    for (int i = 0; i < request->Count; ++i) {
+        Buffer *buffer = request->Buffers[i];
+        DWORD written;
+
+        if (!WriteFile((HANDLE) request->Handle, buffer->Data(), buffer->Length(), &written, NULL)) {
+            return NULL;
+        }
+        total += written;
+    }
+
+    request->Result = total;
+    return NULL;
+}
@@ -0,0 +1,262 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+
+#pragma once
+
+#include <cstddef>
+#include <intrin.h>
+#include "CacheLine.h"
+#include "EventCount.h"
+#include "UScheduler.h"
+
+class BufferPool;
+
+//
+// A fixed-size buffer of a BufferPool. Buffers are passed by pointer through 
+// queues and mailboxes instead of being copied, and are reference counted: the 
+// last Release() returns the buffer to its pool, from any operating system thread.
+//
+
+class Buffer
+{
+    BufferPool *m_pPool;
+    unsigned char *m_pData;
+    volatile long m_refCount;
+    int m_length;
+
+    //
+    // The link used while the buffer is free.
+    //
+
+    Buffer *m_pNextFree;
+
+    friend class BufferPool;
+
+public:
+
+    unsigned char * Data() const
+    {
+        return m_pData;
+    }
+
+    //
+    // Returns the size of the buffer, which is the pool's buffer size.
+    //
+
+    int Capacity() const;
+
+    //
+    // Returns and sets the number of bytes of the buffer in use.
+    //
+
+    int Length() const
+    {
+        return m_length;
+    }
+
+    void SetLength(int length)
+    {
+        m_length = length;
+    }
+
+    //
+    // Adds a reference, for a new holder of the buffer.
+    //
+
+    void AddRef()
+    {
+        _InterlockedIncrement(&m_refCount);
+    }
+
+    //
+    // Drops a reference. The last one returns the buffer to its pool.
+    //
+
+    void Release();
+};
+
+//
+// A pool of fixed-size buffers owned by a scheduler. The buffers are slabs of a 
+// single page-aligned region, which can be registered with the operating system 
+// for I/O, while their headers live apart. Buffers are allocated by the threads 
+// of the owning scheduler, from a free list that needs no interlocked operations, 
+// and can be released anywhere: buffers released on other operating system threads 
+// go to a lock-free list that the owner takes over in one exchange.
+//
+
+class BufferPool
+{
+    UScheduler *m_pScheduler;
+    int m_bufferSize;
+    int m_numBuffers;
+    unsigned char *m_pRegion;
+    size_t m_regionSize;
+    Buffer *m_pBuffers;
+
+    //
+    // The buffers released on the owning scheduler.
+    //
+
+    Buffer *m_pFreeList;
+
+    //
+    // The buffers released on other operating system threads, in their own cache line.
+    //
+
+    CACHE_ALIGNED Buffer * volatile m_pRemoteFreeList;
+
+    //
+    // Notified when buffers are released, for the threads parked in Allocate().
+    //
+
+    EventCount m_released;
+
+public:
+
+    //
+    // Creates a pool of numBuffers buffers of bufferSize bytes for the threads of 
+    // the specified scheduler. Throws bad_alloc if the buffers cannot be allocated.
+    //
+
+    BufferPool(UScheduler &scheduler, int bufferSize, int numBuffers);
+
+    //
+    // The BufferPool destructor. All buffers must have been released.
+    //
+
+    ~BufferPool();
+
+    //
+    // Returns a free buffer, holding one reference and with no bytes in use, or 
+    // NULL if all buffers are in use. Must be called from a thread of the owning 
+    // scheduler.
+    //
+
+    Buffer * TryAllocate();
+
+    //
+    // Returns a free buffer, parking while all buffers are in use. Must be called 
+    // from a thread of the owning scheduler.
+    //
+
+    Buffer * Allocate();
+
+    int GetBufferSize() const
+    {
+        return m_bufferSize;
+    }
+
+    //
+    // Returns the region holding the buffers, for registering it with the operating 
+    // system, as with VirtualLock() or Registered I/O.
+    //
+
+    void * GetRegion() const
+    {
+        return m_pRegion;
+    }
+
+    size_t GetRegionSize() const
+    {
+        return m_regionSize;
+    }
+
+private:
+
+    //
+    // Returns a buffer to the pool. Called by the last Buffer::Release().
+    //
+
+    void release(Buffer *buffer);
+
+    BufferPool(const BufferPool &);
+    BufferPool & operator =(const BufferPool &);
+
+    friend class Buffer;
+};
+
+//
+// Scatter/gather I/O on pool buffers for user threads. The calls are offloaded 
+// to a helper thread, parking the calling thread meanwhile, and transfer directly 
+// to and from the buffers. Sockets are SOCKET values and files are HANDLEs.
+//
+
+class BufferIo
+{
+    //
+    // The maximum number of buffers in one call.
+    //
+
+    static const int m_maxBuffers = 16;
+
+public:
+
+    //
+    // Receives into the buffers, filling each before the next, and sets their 
+    // lengths. Returns the number of bytes received, 0 if the connection was 
+    // closed, or -1 on failure, which includes passing more than m_maxBuffers 
+    // buffers.
+    //
+
+    static int Receive(size_t socket, Buffer *buffers[], int count);
+
+    //
+    // Sends the bytes in use of the buffers, in order. Returns the number of bytes 
+    // sent, or -1 on failure, which includes passing more than m_maxBuffers buffers.
+    //
+
+    static int Send(size_t socket, Buffer *buffers[], int count);
+
+    //
+    // Reads into the buffer and sets its length. Returns the number of bytes read, 
+    // 0 at the end of the file, or -1 on failure.
+    //
+
+    static int Read(void *file, Buffer *buffer);
+
+    //
+    // Writes the bytes in use of the buffers, in order. Returns the number of bytes 
+    // written, or -1 on failure.
+    //
+
+    static int Write(void *file, Buffer *buffers[], int count);
+
+private:
+
+    //
+    // The arguments and result of an offloaded call.
+    //
+
+    struct Request
+    {
+        size_t Handle;
+        Buffer **Buffers;
+        int Count;
+        int Result;
+    };
+
+    //
+    // The functions run by the helper thread.
+    //
+
+    static void * receive_buffers(void *argument);
+    static void * send_buffers(void *argument);
+    static void * read_buffer(void *argument);
+    static void * write_buffers(void *argument);
+
+    BufferIo();
+};
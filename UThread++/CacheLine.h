@@ -0,0 +1,68 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+#pragma once
+
+#include <malloc.h>
+#include <new>
+
+//
+// The size of a cache line on the processors the library runs on.
+//
+
+#define CACHE_LINE_SIZE 64
+
+//
+// Aligns a type, or a member within its class, to the start of a cache line.
+//
+
+#define CACHE_ALIGNED __declspec(align(CACHE_LINE_SIZE))
+
+//
+// A base for cache-line aligned classes. The global operator new only honors 
+// the default alignment, so these allocate their instances aligned themselves.
+//
+
+class CacheAligned
+{
+public:
+
+    static void * operator new(size_t size)
+    {
+        void *memory = _aligned_malloc(size, CACHE_LINE_SIZE);
+        if (memory == NULL) {
+            throw std::bad_alloc();
+        }
+        return memory;
+    }
+
+    static void operator delete(void *memory)
+    {
+        _aligned_free(memory);
+    }
+
+    //
+    // Declaring the allocation functions above hides the placement form.
+    //
+
+    static void * operator new(size_t, void *place)
+    {
+        return place;
+    }
+
+    static void operator delete(void *, void *)
+    { }
+};
@@ -0,0 +1,152 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+
+#include <cassert>
+#include "ConcurrencyLimit.h"
+
+//
+// Returns a policy that keeps the limit where it is.
+//
+
+static AimdPolicy fixed_policy(int limit)
+{
+    AimdPolicy policy;
+
+    policy.Minimum = limit;
+    policy.Maximum = limit;
+    return policy;
+}
+
+//
+// Creates a gate with a fixed limit.
+//
+
+ConcurrencyLimit::ConcurrencyLimit(int limit)
+    : m_inFlight(0),
+      m_limit(limit, fixed_policy(limit)),
+      m_waitList()
+{ }
+
+//
+// Creates a gate with an adaptive limit.
+//
+
+ConcurrencyLimit::ConcurrencyLimit(int initial, const AimdPolicy &policy)
+    : m_inFlight(0),
+      m_limit(initial, policy),
+      m_waitList()
+{ }
+
+//
+// The ConcurrencyLimit destructor.
+//
+
+ConcurrencyLimit::~ConcurrencyLimit()
+{
+    assert(m_waitList.empty());
+}
+
+//
+// Starts a call, or waits in line. A completing call counts the thread in flight 
+// and removes it from the wait list. A pending park permit may wake the thread 
+// earlier, so it parks again while it is still waiting.
+//
+
+bool ConcurrencyLimit::Acquire()
+{
+    PreemptionGuard guard;
+    UThread &currentThread = UThread::Current();
+
+    if (m_waitList.empty() && m_inFlight < m_limit.Current()) {
+        m_inFlight += 1;
+        return true;
+    }
+
+    if (currentThread.IsCancelled()) {
+        return false;
+    }
+
+    m_waitList.push_back(&currentThread);
+
+    while (UThread::WaitList::linked(&currentThread)) {
+        if (!UThread::Park() && UThread::WaitList::linked(&currentThread)) {
+            m_waitList.remove(&currentThread);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//
+// Starts a call if the limit is not reached and no thread is waiting.
+//
+
+bool ConcurrencyLimit::TryAcquire()
+{
+    PreemptionGuard guard;
+
+    if (m_waitList.empty() && m_inFlight < m_limit.Current()) {
+        m_inFlight += 1;
+        return true;
+    }
+
+    return false;
+}
+
+//
+// Completes a call.
+//
+
+void ConcurrencyLimit::Release()
+{
+    PreemptionGuard guard;
+
+    assert(m_inFlight > 0);
+
+    m_inFlight -= 1;
+    admit_waiters();
+}
+
+//
+// Completes a call and samples its latency. When the limit grows, more than one 
+// waiting thread may be let in.
+//
+
+void ConcurrencyLimit::Release(__int64 latencyMicroseconds)
+{
+    PreemptionGuard guard;
+
+    assert(m_inFlight > 0);
+
+    m_inFlight -= 1;
+    m_limit.Sample(latencyMicroseconds);
+    admit_waiters();
+}
+
+//
+// Lets waiting threads start calls, in order, while the limit allows. When the 
+// limit shrinks, calls in flight drain below it before anyone is let in.
+//
+
+void ConcurrencyLimit::admit_waiters()
+{
+    while (!m_waitList.empty() && m_inFlight < m_limit.Current()) {
+        m_inFlight += 1;
+        m_waitList.pop_front()->Unpark();
+    }
+}
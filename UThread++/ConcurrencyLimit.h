@@ -0,0 +1,118 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+
+#pragma once
+
+#include "AimdLimit.h"
+#include "UThread.h"
+
+//
+// Caps the number of calls in flight to a downstream service. Threads over the 
+// limit wait in FIFO order for a call to complete. The limit is fixed, or adapts 
+// through an AimdLimit to the latencies reported when calls complete. Like Mutex 
+// and Semaphore, an instance is used by the threads of one scheduler.
+//
+
+class ConcurrencyLimit
+{
+    //
+    // The number of calls in flight and the limit they are held to.
+    //
+
+    int m_inFlight;
+    AimdLimit m_limit;
+
+    //
+    // The threads waiting to start a call.
+    //
+
+    UThread::WaitList m_waitList;
+
+public:
+
+    //
+    // Creates a gate with a fixed limit.
+    //
+
+    explicit ConcurrencyLimit(int limit);
+
+    //
+    // Creates a gate whose limit starts at initial and adapts as the policy says.
+    //
+
+    ConcurrencyLimit(int initial, const AimdPolicy &policy);
+
+    //
+    // The ConcurrencyLimit destructor.
+    //
+
+    ~ConcurrencyLimit();
+
+    //
+    // Starts a call, waiting in line while the limit is reached. Returns false, 
+    // without starting a call, if the thread is cancelled.
+    //
+
+    bool Acquire();
+
+    //
+    // Starts a call if the limit is not reached and no thread is waiting.
+    //
+
+    bool TryAcquire();
+
+    //
+    // Completes a call, letting a waiting thread start one.
+    //
+
+    void Release();
+
+    //
+    // Completes a call that took the specified time, adapting the limit.
+    //
+
+    void Release(__int64 latencyMicroseconds);
+
+    //
+    // Returns the current limit.
+    //
+
+    int GetLimit() const
+    {
+        return m_limit.Current();
+    }
+
+    //
+    // Returns the number of calls in flight.
+    //
+
+    int GetInFlight() const
+    {
+        return m_inFlight;
+    }
+
+private:
+
+    //
+    // Lets waiting threads start calls, in order, while the limit allows.
+    //
+
+    void admit_waiters();
+
+    ConcurrencyLimit(const ConcurrencyLimit &);
+    ConcurrencyLimit & operator =(const ConcurrencyLimit &);
+};
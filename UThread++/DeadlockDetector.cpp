@@ -0,0 +1,158 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+#include <cassert>
+#include <cstdio>
+#include <windows.h>
+
+//
+// WinBase.h defines Yield() as an empty macro.
+//
+
+#undef Yield
+
+#include "DeadlockDetector.h"
+#include "Mutex.h"
+#include "UScheduler.h"
+#include "UThread.h"
+
+//
+// Records that the thread is about to block on the specified object, which is a 
+// mutex if mutex is not NULL. Reports a deadlock if the wait closes a cycle.
+//
+
+void DeadlockDetector::waiting(UThread *thread, const void *object, const char *kind, Mutex *mutex)
+{
+    UScheduler *scheduler = thread->m_pScheduler;
+
+    if (!scheduler->m_detectDeadlocks) {
+        return;
+    }
+
+    thread->m_pBlockedOn = object;
+    thread->m_blockedOnKind = kind;
+    thread->m_pBlockedOnMutex = mutex;
+
+    if (mutex == NULL) {
+        return;
+    }
+
+    //
+    // Follow the chain of owners. Cycles that do not include this thread were 
+    // reported when they formed, so the walk is bounded by the number of threads.
+    //
+
+    UThread *owner = mutex->m_pOwner;
+    long steps = scheduler->m_numThreads;
+
+    while (owner != NULL && owner != thread && steps-- > 0) {
+        owner = owner->m_pBlockedOnMutex != NULL ? owner->m_pBlockedOnMutex->m_pOwner : NULL;
+    }
+
+    if (owner != thread) {
+        return;
+    }
+
+    scheduler->m_numDeadlocks += 1;
+
+    fprintf(stderr, "Deadlock detected:\n");
+    owner = thread;
+    do {
+        Mutex *waitedMutex = owner->m_pBlockedOnMutex;
+
+        fprintf(stderr, "  thread %d waits for mutex %p owned by thread %d\n", 
+                owner->m_threadId, waitedMutex, waitedMutex->m_pOwner->m_threadId);
+        owner = waitedMutex->m_pOwner;
+    } while (owner != thread);
+}
+
+//
+// Records that the thread is no longer blocked on an object.
+//
+
+void DeadlockDetector::done(UThread *thread)
+{
+    thread->m_pBlockedOn = NULL;
+    thread->m_blockedOnKind = NULL;
+    thread->m_pBlockedOnMutex = NULL;
+}
+
+//
+// Adds the thread to its scheduler's blocked list, capturing its stack. Called 
+// by UThread::Park() before switching out.
+//
+
+void DeadlockDetector::parking(UThread *thread)
+{
+    thread->m_blockedStackDepth = CaptureStackBackTrace(2, UThread::m_maxBlockedStackDepth, 
+                                                        thread->m_blockedStack, NULL);
+    thread->m_pScheduler->m_blockedList.push_back(thread);
+}
+
+//
+// Removes the thread from its scheduler's blocked list. Called by UThread::Park() 
+// when the thread resumes.
+//
+
+void DeadlockDetector::resumed(UThread *thread)
+{
+    thread->m_pScheduler->m_blockedList.remove(thread);
+}
+
+//
+// Reports the threads still in the scheduler's blocked list. Called by 
+// UScheduler::Run() when there are no more runnable threads. A thread parked 
+// outside any synchronizer may be the victim of a lost wakeup.
+//
+
+void DeadlockDetector::report_stuck(UScheduler *scheduler)
+{
+    int count = 0;
+
+    for (UThread *thread = scheduler->m_blockedList.front(); thread != NULL; 
+         thread = scheduler->m_blockedList.next(thread)) {
+        count += 1;
+    }
+
+    scheduler->m_numStuckThreads = count;
+    if (count == 0) {
+        return;
+    }
+
+    fprintf(stderr, "%d thread(s) still blocked after the scheduler drained:\n", count);
+
+    for (UThread *thread = scheduler->m_blockedList.front(); thread != NULL; 
+         thread = scheduler->m_blockedList.next(thread)) {
+        if (thread->m_blockedOnKind != NULL) {
+            fprintf(stderr, "  thread %d blocked on %s %p\n", 
+                    thread->m_threadId, thread->m_blockedOnKind, thread->m_pBlockedOn);
+        } else {
+            fprintf(stderr, "  thread %d parked (lost wakeup?)\n", thread->m_threadId);
+        }
+        print_stack(thread);
+    }
+}
+
+//
+// Prints the stack captured when the thread blocked.
+//
+
+void DeadlockDetector::print_stack(UThread *thread)
+{
+    for (int i = 0; i < thread->m_blockedStackDepth; ++i) {
+        UThread::print_frame(stderr, thread->m_blockedStack[i]);
+    }
+}
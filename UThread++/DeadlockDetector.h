@@ -0,0 +1,87 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+#pragma once
+
+class Mutex;
+class UScheduler;
+class UThread;
+
+//
+// Keeps track of the blocked threads of the schedulers that detect deadlocks. 
+// Mutexes form the edges of a wait-for graph, from each waiter to the mutex's 
+// owner, which is walked whenever a thread blocks on a mutex to find cycles. 
+// When a scheduler drains, it reports the threads that are still blocked, with 
+// what they are blocked on and the stack captured when they blocked.
+//
+
+class DeadlockDetector
+{
+    //
+    // Private constructor.
+    //
+
+    DeadlockDetector();
+
+    //
+    // Records that the thread is about to block on the specified object, which is a 
+    // mutex if mutex is not NULL. Reports a deadlock if the wait closes a cycle.
+    //
+
+    static void waiting(UThread *thread, const void *object, const char *kind, Mutex *mutex);
+
+    //
+    // Records that the thread is no longer blocked on an object.
+    //
+
+    static void done(UThread *thread);
+
+    //
+    // Adds the thread to its scheduler's blocked list, capturing its stack. Called 
+    // by UThread::Park() before switching out.
+    //
+
+    static void parking(UThread *thread);
+
+    //
+    // Removes the thread from its scheduler's blocked list. Called by UThread::Park() 
+    // when the thread resumes.
+    //
+
+    static void resumed(UThread *thread);
+
+    //
+    // Reports the threads still in the scheduler's blocked list. Called by 
+    // UScheduler::Run() when there are no more runnable threads.
+    //
+
+    static void report_stuck(UScheduler *scheduler);
+
+    //
+    // Prints the stack captured when the thread blocked.
+    //
+
+    static void print_stack(UThread *thread);
+
+    //
+    // The users of the detector.
+    //
+
+    friend class Mutex;
+    friend class Semaphore;
+    friend class UScheduler;
+    friend class UThread;
+};
@@ -0,0 +1,117 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+#include <cassert>
+#include "EventCount.h"
+
+//
+// Parks the current user thread until a notification arrives after the 
+// PrepareWait() call that returned the key.
+//
+
+void EventCount::Wait(long key)
+{
+    Waiter waiter;
+
+    waiter.Thread = &UThread::Current();
+    waiter.Signaled = false;
+    waiter.Released = false;
+
+    {
+        PreemptionGuard guard;
+
+        lock();
+        if (m_epoch != key) {
+
+            //
+            // A notification arrived since PrepareWait().
+            //
+
+            unlock();
+            _InterlockedDecrement(&m_numWaiters);
+            return;
+        }
+        m_waitList.push_back(&waiter);
+        unlock();
+    }
+
+    //
+    // A pending park permit may wake the thread earlier, so park again until 
+    // signaled. The notifier may still be using the waiter and the thread until 
+    // it releases them.
+    //
+
+    while (!waiter.Signaled) {
+        UThread::Park();
+    }
+
+    while (!waiter.Released) {
+        UThread::Yield();
+    }
+}
+
+//
+// The slow path of NotifyOne() and NotifyAll(). Waiters are removed under the 
+// lock and unparked after releasing it.
+//
+
+void EventCount::notify(bool all)
+{
+    PreemptionGuard guard;
+    List<Waiter, &Waiter::Node> woken;
+
+    lock();
+
+    m_epoch += 1;
+
+    if (all) {
+        woken.splice_back(m_waitList);
+    } else if (!m_waitList.empty()) {
+        woken.push_back(m_waitList.pop_front());
+    }
+
+    for (Waiter *waiter = woken.front(); waiter != NULL; waiter = woken.next(waiter)) {
+        _InterlockedDecrement(&m_numWaiters);
+    }
+
+    unlock();
+
+    Waiter *waiter = woken.front();
+    while (waiter != NULL) {
+        Waiter *next = woken.next(waiter);
+        UThread *thread = waiter->Thread;
+
+        waiter->Signaled = true;
+        thread->Unpark();
+        waiter->Released = true;
+
+        waiter = next;
+    }
+}
+
+//
+// Acquires the spin lock. It is only held for a few instructions, with 
+// preemption disabled.
+//
+
+void EventCount::lock()
+{
+    while (_InterlockedExchange(&m_lock, 1) != 0) {
+        while (m_lock != 0) {
+            _mm_pause();
+        }
+    }
+}
@@ -0,0 +1,145 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+#pragma once
+
+#include <intrin.h>
+#include "List.h"
+#include "UThread.h"
+
+//
+// Adds blocking to lock-free containers. A consumer that finds the container 
+// empty calls PrepareWait(), retries, and then either calls CancelWait() or 
+// Wait() with the key PrepareWait() returned. A producer calls NotifyOne() or 
+// NotifyAll() after making an item available, which only costs a fence and a 
+// load while nobody waits. Works across operating system threads.
+//
+
+class EventCount
+{
+    //
+    // A user thread waiting in Wait(). It lives on the thread's stack.
+    //
+
+    struct Waiter
+    {
+        ListNode Node;
+        UThread *Thread;
+        volatile bool Signaled;
+        volatile bool Released;
+    };
+
+    //
+    // Incremented by every notification that finds prepared waiters.
+    //
+
+    volatile long m_epoch;
+
+    //
+    // The number of threads between PrepareWait() and the end of the wait.
+    //
+
+    volatile long m_numWaiters;
+
+    //
+    // The spin lock protecting m_waitList.
+    //
+
+    volatile long m_lock;
+
+    List<Waiter, &Waiter::Node> m_waitList;
+
+public:
+
+    EventCount()
+        : m_epoch(0),
+          m_numWaiters(0),
+          m_lock(0)
+    { }
+
+    //
+    // Announces that the calling thread is about to wait, returning the key to 
+    // pass to Wait(). The caller must recheck the waited-for condition afterwards.
+    //
+
+    long PrepareWait()
+    {
+        _InterlockedIncrement(&m_numWaiters);
+        return m_epoch;
+    }
+
+    //
+    // Withdraws the announcement made by PrepareWait().
+    //
+
+    void CancelWait()
+    {
+        _InterlockedDecrement(&m_numWaiters);
+    }
+
+    //
+    // Parks the current user thread until a notification arrives after the 
+    // PrepareWait() call that returned the key.
+    //
+
+    void Wait(long key);
+
+    //
+    // Wakes one waiting thread, if there is any.
+    //
+
+    void NotifyOne()
+    {
+        _mm_mfence();
+        if (m_numWaiters != 0) {
+            notify(false);
+        }
+    }
+
+    //
+    // Wakes all waiting threads.
+    //
+
+    void NotifyAll()
+    {
+        _mm_mfence();
+        if (m_numWaiters != 0) {
+            notify(true);
+        }
+    }
+
+private:
+
+    //
+    // The slow path of NotifyOne() and NotifyAll().
+    //
+
+    void notify(bool all);
+
+    void lock();
+
+    void unlock()
+    {
+        _InterlockedExchange(&m_lock, 0);
+    }
+
+    //
+    // Event counts cannot be copied.
+    //
+
+    EventCount(const EventCount &);
+    EventCount & operator =(const EventCount &);
+};
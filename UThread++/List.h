@@ -0,0 +1,197 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+#pragma once
+
+#include <cstddef>
+
+//
+// The link embedded in the objects of an intrusive list.
+//
+
+struct ListNode
+{
+    ListNode *Next;
+    ListNode *Prev;
+};
+
+//
+// An intrusive, circular, doubly-linked list of T objects, linked through their 
+// Link member. The list never allocates memory: an object can be in as many 
+// lists as it has ListNode members, and whole lists are spliced in constant time.
+//
+
+template <class T, ListNode T::*Link>
+class List
+{
+    //
+    // The sentinel node. An empty list has it linked to itself.
+    //
+
+    ListNode m_head;
+
+public:
+
+    List()
+    {
+        m_head.Next = m_head.Prev = &m_head;
+    }
+
+    bool empty() const
+    {
+        return m_head.Next == &m_head;
+    }
+
+    //
+    // Returns the first object in the list, or NULL if it is empty.
+    //
+
+    T * front() const
+    {
+        return item(m_head.Next);
+    }
+
+    //
+    // Returns the last object in the list, or NULL if it is empty.
+    //
+
+    T * back() const
+    {
+        return item(m_head.Prev);
+    }
+
+    //
+    // Returns the object after the specified one, or NULL if it is the last.
+    //
+
+    T * next(T *object) const
+    {
+        return item((object->*Link).Next);
+    }
+
+    //
+    // Returns the object before the specified one, or NULL if it is the first.
+    //
+
+    T * prev(T *object) const
+    {
+        return item((object->*Link).Prev);
+    }
+
+    void push_back(T *object)
+    {
+        insert(&(object->*Link), m_head.Prev, &m_head);
+    }
+
+    void push_front(T *object)
+    {
+        insert(&(object->*Link), &m_head, m_head.Next);
+    }
+
+    //
+    // Inserts the object after the specified one, or first if position is NULL.
+    //
+
+    void insert_after(T *position, T *object)
+    {
+        ListNode *prev = position == NULL ? &m_head : &(position->*Link);
+        insert(&(object->*Link), prev, prev->Next);
+    }
+
+    //
+    // Removes and returns the first object in the list, which must not be empty.
+    //
+
+    T * pop_front()
+    {
+        T *object = front();
+        remove(object);
+        return object;
+    }
+
+    //
+    // Removes the specified object, which must be in the list.
+    //
+
+    void remove(T *object)
+    {
+        ListNode *node = &(object->*Link);
+        node->Prev->Next = node->Next;
+        node->Next->Prev = node->Prev;
+        node->Next = node->Prev = NULL;
+    }
+
+    //
+    // Returns whether the object is in a list through its Link member. Relies on 
+    // remove() clearing the node, so nodes must start out cleared too.
+    //
+
+    static bool linked(T *object)
+    {
+        return (object->*Link).Next != NULL;
+    }
+
+    //
+    // Moves all the objects in the other list to the end of this one.
+    //
+
+    void splice_back(List &other)
+    {
+        if (other.empty()) {
+            return;
+        }
+
+        other.m_head.Next->Prev = m_head.Prev;
+        other.m_head.Prev->Next = &m_head;
+        m_head.Prev->Next = other.m_head.Next;
+        m_head.Prev = other.m_head.Prev;
+        other.m_head.Next = other.m_head.Prev = &other.m_head;
+    }
+
+private:
+
+    //
+    // Links node between prev and next.
+    //
+
+    static void insert(ListNode *node, ListNode *prev, ListNode *next)
+    {
+        node->Prev = prev;
+        node->Next = next;
+        prev->Next = node;
+        next->Prev = node;
+    }
+
+    //
+    // Returns the object containing the specified node, or NULL for the sentinel.
+    //
+
+    T * item(ListNode *node) const
+    {
+        if (node == &m_head) {
+            return NULL;
+        }
+
+        return (T *) ((char *) node - (size_t) &(((T *) 0)->*Link));
+    }
+
+    //
+    // Lists cannot be copied.
+    //
+
+    List(const List &);
+    List & operator =(const List &);
+};
@@ -0,0 +1,284 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+#include <cassert>
+#include <list>
+#include <windows.h>
+
+//
+// WinBase.h defines Yield() as an empty macro.
+//
+
+#undef Yield
+
+#include "LoadBalancer.h"
+#include "UScheduler.h"
+#include "UThread.h"
+
+using namespace std;
+
+//
+// The lock that protects the set of running schedulers and their shed requests.
+//
+
+static CRITICAL_SECTION m_lock;
+
+//
+// The running schedulers.
+//
+
+static list<UScheduler *> m_schedulers;
+
+//
+// The balancer thread and the event used to stop it.
+//
+
+static HANDLE m_balancerThread = NULL;
+static HANDLE m_stopEvent = NULL;
+
+//
+// Initializes the lock before main() runs.
+//
+
+static struct LoadBalancerInitializer
+{
+    LoadBalancerInitializer()
+    {
+        InitializeCriticalSection(&m_lock);
+    }
+} m_initializer;
+
+//
+// Starts the background balancer thread, which inspects the schedulers every 
+// intervalMilliseconds.
+//
+
+void LoadBalancer::Start(int intervalMilliseconds)
+{
+    assert(m_balancerThread == NULL);
+
+    m_stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    m_balancerThread = CreateThread(NULL, 0, balancer_thread, 
+                                    (void *) intervalMilliseconds, 0, NULL);
+}
+
+//
+// Stops the background balancer thread.
+//
+
+void LoadBalancer::Stop()
+{
+    assert(m_balancerThread != NULL);
+
+    SetEvent(m_stopEvent);
+    WaitForSingleObject(m_balancerThread, INFINITE);
+
+    CloseHandle(m_balancerThread);
+    CloseHandle(m_stopEvent);
+    m_balancerThread = NULL;
+    m_stopEvent = NULL;
+}
+
+//
+// Adds the scheduler to the set of running schedulers. Called by UScheduler::Run().
+//
+
+void LoadBalancer::register_scheduler(UScheduler *scheduler)
+{
+    EnterCriticalSection(&m_lock);
+    m_schedulers.push_back(scheduler);
+    LeaveCriticalSection(&m_lock);
+}
+
+//
+// Removes the scheduler from the set of running schedulers and cancels the 
+// requests targeting it. Called by UScheduler::Run().
+//
+
+void LoadBalancer::unregister_scheduler(UScheduler *scheduler)
+{
+    EnterCriticalSection(&m_lock);
+
+    m_schedulers.remove(scheduler);
+    scheduler->m_shedCount = 0;
+    scheduler->m_pShedTarget = NULL;
+
+    for (list<UScheduler *>::iterator it = m_schedulers.begin(); it != m_schedulers.end(); ++it) {
+        if ((*it)->m_pShedTarget == scheduler) {
+            (*it)->m_shedCount = 0;
+            (*it)->m_pShedTarget = NULL;
+        }
+    }
+
+    LeaveCriticalSection(&m_lock);
+}
+
+//
+// Moves ready threads from the scheduler's ready queue as requested by the 
+// balancer. Called by the scheduler's own operating system thread.
+//
+
+void LoadBalancer::shed_threads(UScheduler *scheduler)
+{
+    EnterCriticalSection(&m_lock);
+
+    UScheduler *target = scheduler->m_pShedTarget;
+    int count = scheduler->m_shedCount;
+
+    scheduler->m_shedCount = 0;
+    scheduler->m_pShedTarget = NULL;
+
+    if (target == NULL) {
+        LeaveCriticalSection(&m_lock);
+        return;
+    }
+
+    //
+    // Take the threads from the tail of the ready queue, which would run last. 
+    // Threads whose stack resides on the target's NUMA node go first; querying 
+    // the node is a system call, so only a few candidates are examined.
+    //
+
+    UThread *first = NULL;
+    UThread *last = NULL;
+    int moved = 0;
+    int examined = 0;
+
+    for (int pass = 0; pass < 2 && moved < count; ++pass) {
+        UThread *previous = scheduler->m_readyQueue.back();
+        while (moved < count && previous != NULL) {
+            UThread *thread = previous;
+            previous = scheduler->m_readyQueue.prev(thread);
+
+            //
+            // A thread that switched out inside a blocking operation, such as 
+            // Sleep() or Offload(), still uses state of this scheduler when it 
+            // resumes, so it must not be moved.
+            //
+
+            if (thread->m_schedulerBound) {
+                continue;
+            }
+
+            if (pass == 0) {
+                if (target->m_numaNode < 0 || ++examined > 2 * count) {
+                    break;
+                }
+                
+                if (thread->GetStackNode() != target->m_numaNode) {
+                    continue;
+                }
+            }
+
+            scheduler->m_readyQueue.remove(thread);
+            scheduler->m_readyCount -= 1;
+
+            UScheduler::transfer_thread(thread, target);
+
+            //
+            // The remote list is drained in reverse, so chain the threads from 
+            // the tail of the queue to preserve their order.
+            //
+
+            if (first == NULL) {
+                first = thread;
+            } else {
+                last->m_pNextRemoteReady = thread;
+            }
+            last = thread;
+            moved += 1;
+        }
+    }
+
+    if (first != NULL) {
+        target->remote_ready(first, last);
+    }
+
+    LeaveCriticalSection(&m_lock);
+}
+
+//
+// Compares the running schedulers and issues at most one request.
+//
+
+void LoadBalancer::balance()
+{
+    EnterCriticalSection(&m_lock);
+
+    UScheduler *busiest = NULL;
+    for (list<UScheduler *>::iterator it = m_schedulers.begin(); it != m_schedulers.end(); ++it) {
+        if (busiest == NULL || (*it)->m_readyCount > busiest->m_readyCount) {
+            busiest = *it;
+        }
+    }
+
+    if (busiest == NULL || busiest->m_shedCount != 0) {
+        LeaveCriticalSection(&m_lock);
+        return;
+    }
+
+    //
+    // Pick the least loaded scheduler, preferring those on the busiest one's NUMA node.
+    //
+
+    UScheduler *idlest = NULL;
+    UScheduler *idlestLocal = NULL;
+    for (list<UScheduler *>::iterator it = m_schedulers.begin(); it != m_schedulers.end(); ++it) {
+        if (*it == busiest) {
+            continue;
+        }
+
+        if (idlest == NULL || (*it)->m_readyCount < idlest->m_readyCount) {
+            idlest = *it;
+        }
+
+        if ((*it)->m_numaNode == busiest->m_numaNode && 
+            (idlestLocal == NULL || (*it)->m_readyCount < idlestLocal->m_readyCount)) {
+            idlestLocal = *it;
+        }
+    }
+
+    if (idlestLocal != NULL && 
+        busiest->m_readyCount - idlestLocal->m_readyCount >= m_imbalanceThreshold) {
+        idlest = idlestLocal;
+    }
+
+    if (idlest != NULL) {
+        long imbalance = busiest->m_readyCount - idlest->m_readyCount;
+
+        if (imbalance >= m_imbalanceThreshold) {
+            busiest->m_pShedTarget = idlest;
+            busiest->m_shedCount = min(imbalance / 2, (long) m_maxBatchSize);
+        }
+    }
+
+    LeaveCriticalSection(&m_lock);
+}
+
+//
+// The function run by the background balancer thread.
+//
+
+unsigned long __stdcall LoadBalancer::balancer_thread(void *argument)
+{
+    DWORD interval = (DWORD) argument;
+
+    while (WaitForSingleObject(m_stopEvent, interval) == WAIT_TIMEOUT) {
+        balance();
+    }
+
+    return 0;
+}
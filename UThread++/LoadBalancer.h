@@ -0,0 +1,101 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+#pragma once
+
+class UScheduler;
+
+//
+// The load balancer periodically compares the ready queue lengths of the running 
+// schedulers and asks overloaded ones to hand a batch of ready threads over to 
+// idle ones. Schedulers on the same NUMA node as the overloaded one are preferred.
+//
+
+class LoadBalancer
+{
+    //
+    // The maximum number of threads moved by a single request.
+    //
+
+    static const int m_maxBatchSize = 16;
+
+    //
+    // The minimum difference between ready queue lengths that triggers a request.
+    //
+
+    static const int m_imbalanceThreshold = 2;
+
+public:
+
+    //
+    // Starts the background balancer thread, which inspects the schedulers every 
+    // intervalMilliseconds.
+    //
+
+    static void Start(int intervalMilliseconds);
+
+    //
+    // Stops the background balancer thread.
+    //
+
+    static void Stop();
+
+private:
+
+    //
+    // Private constructor.
+    //
+
+    LoadBalancer();
+
+    //
+    // Adds the scheduler to the set of running schedulers. Called by UScheduler::Run().
+    //
+
+    static void register_scheduler(UScheduler *scheduler);
+
+    //
+    // Removes the scheduler from the set of running schedulers and cancels the 
+    // requests targeting it. Called by UScheduler::Run().
+    //
+
+    static void unregister_scheduler(UScheduler *scheduler);
+
+    //
+    // Moves ready threads from the scheduler's ready queue as requested by the 
+    // balancer. Called by the scheduler's own operating system thread.
+    //
+
+    static void shed_threads(UScheduler *scheduler);
+
+    //
+    // Compares the running schedulers and issues at most one request.
+    //
+
+    static void balance();
+
+    //
+    // The function run by the background balancer thread.
+    //
+
+    static unsigned long __stdcall balancer_thread(void *argument);
+
+    //
+    // UScheduler registers itself and sheds threads on request.
+    //
+
+    friend class UScheduler;
+};
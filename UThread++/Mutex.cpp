@@ -16,7 +16,10 @@
 
 #include <cassert>
 
+#include "DeadlockDetector.h"
 #include "Mutex.h"
+#include "Probes.h"
+#include "UScheduler.h"
 
 //
 // The Mutex destructor.
@@ -32,8 +35,9 @@ Mutex::~Mutex()
 // Acquires the specified mutex, blocking the current thread if the mutex is not free.
 //
 
-void Mutex::Acquire()
+bool Mutex::Acquire()
 {
+    PreemptionGuard guard;
     UThread &currentThread = UThread::Current();
 
     if (m_pOwner == &currentThread) {
@@ -53,19 +57,67 @@ void Mutex::Acquire()
         m_recursionCounter = 1;
     } else {
 
+        //
+        // A cancelled thread does not block.
+        //
+
+        if (currentThread.IsCancelled()) {
+            return false;
+        }
+
         //
         // Insert the running thread in the wait list.
         //
 
         m_waitList.push_back(&currentThread);
+        m_numWaiters += 1;
+        DeadlockDetector::waiting(&currentThread, this, "Mutex", this);
+        UTHREAD_PROBE_MUTEX_BLOCK(currentThread.GetId(), this);
 
         //
-        // Park the current thread. When the thread is unparked, it will have ownership of the mutex.
+        // Park the current thread. When the thread is unparked by Release(), it will have 
+        // ownership of the mutex. A pending park permit may wake the thread earlier, so 
+        // park again until ownership was transfered. If the thread was cancelled and 
+        // ownership was not transfered meanwhile, it leaves the wait list by itself.
         //
 
-        UThread::Park();
-        assert(m_pOwner == &currentThread);
+        while (m_pOwner != &currentThread) {
+            if (!UThread::Park() && m_pOwner != &currentThread) {
+                m_waitList.remove(&currentThread);
+                m_numWaiters -= 1;
+                DeadlockDetector::done(&currentThread);
+                return false;
+            }
+        }
+
+        DeadlockDetector::done(&currentThread);
     }
+
+    return true;
+}
+
+//
+// Tries to acquire the specified mutex without blocking. Returns true if the mutex 
+// was free or already owned by the current thread, false otherwise.
+//
+
+bool Mutex::TryAcquire()
+{
+    PreemptionGuard guard;
+    UThread &currentThread = UThread::Current();
+
+    if (m_pOwner == &currentThread) {
+        m_recursionCounter += 1;
+        return true;
+    }
+    
+    if (m_pOwner == NULL) {
+        m_pOwner = &currentThread;
+        m_recursionCounter = 1;
+        return true;
+    }
+
+    return false;
 }
         
 //
@@ -75,6 +127,7 @@ void Mutex::Acquire()
 
 void Mutex::Release()
 {
+    PreemptionGuard guard;
     UThread &currentThread = UThread::Current();
 
     assert(m_pOwner == &currentThread);
@@ -99,14 +152,21 @@ void Mutex::Release()
     }
 
     //
-    // Get the next blocked thread and transfer mutex ownership to it.
+    // Get the next blocked thread, the first unless the scheduler is deterministic, 
+    // and transfer mutex ownership to it.
     //
 
     UThread *thread = m_waitList.front();
-    m_waitList.pop_front();
+    for (unsigned skip = UScheduler::Current().Choose(m_numWaiters); skip > 0; --skip) {
+        thread = m_waitList.next(thread);
+    }
+
+    m_waitList.remove(thread);
+    m_numWaiters -= 1;
 
     m_pOwner = thread;
     m_recursionCounter = 1;
+    UTHREAD_PROBE_MUTEX_WAKE(thread->GetId(), this);
         
     //
     // Unpark the thread.
@@ -16,8 +16,6 @@
 
 #pragma once
 
-#include <list>
-
 #include "UThread.h"
 
 using namespace std;
@@ -40,7 +38,14 @@ class Mutex
     // The wait list containing the blocked threads that are waiting on the mutex.
     //
 
-    list<UThread *> m_waitList;
+    UThread::WaitList m_waitList;
+    unsigned m_numWaiters;
+
+    //
+    // The deadlock detector follows the owners of the mutexes threads wait for.
+    //
+
+    friend class DeadlockDetector;
         
 public:
         
@@ -51,7 +56,8 @@ public:
     Mutex()
         : m_recursionCounter(0),
           m_pOwner(NULL),
-          m_waitList()
+          m_waitList(),
+          m_numWaiters(0)
     { }
 
     //
@@ -61,10 +67,19 @@ public:
     ~Mutex();
 
     //
-    // Acquires the specified mutex, blocking the current thread if the mutex is not free.
+    // Acquires the specified mutex, blocking the current thread if the mutex is not free. 
+    // Returns false, without owning the mutex, if the thread is cancelled before it 
+    // acquires it.
+    //
+
+    bool Acquire();
+
+    //
+    // Tries to acquire the specified mutex without blocking. Returns true if the mutex 
+    // was free or already owned by the current thread, false otherwise.
     //
 
-    void Acquire();
+    bool TryAcquire();
 
     //
     // Releases the specified mutex, eventually unblocking a waiting thread to which the
@@ -0,0 +1,124 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+#include <cassert>
+#include <list>
+#include <windows.h>
+#include "OffloadPool.h"
+
+using namespace std;
+
+//
+// The lock that protects the pool's state.
+//
+
+static CRITICAL_SECTION m_lock;
+
+//
+// The queue of requests waiting for a helper thread.
+//
+
+static list<OffloadRequest *> m_requestQueue;
+
+//
+// Counts the requests in m_requestQueue. Helper threads wait on it.
+//
+
+static HANDLE m_requestsAvailable;
+
+//
+// The number of existing helper threads and how many of them are waiting for requests.
+//
+
+static int m_numThreads = 0;
+static int m_numIdleThreads = 0;
+
+//
+// Initializes the pool's synchronization objects before main() runs, 
+// so that schedulers on any operating system thread can submit requests.
+//
+
+static struct OffloadPoolInitializer
+{
+    OffloadPoolInitializer()
+    {
+        InitializeCriticalSection(&m_lock);
+        m_requestsAvailable = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+    }
+} m_initializer;
+
+//
+// Queues the request to be run by a helper thread. When the function returns, 
+// the helper thread wakes the requesting user thread through its scheduler.
+//
+
+void OffloadPool::Submit(OffloadRequest *request)
+{
+    bool createThread;
+
+    EnterCriticalSection(&m_lock);
+
+    m_requestQueue.push_back(request);
+
+    //
+    // Only create a helper thread if all existing ones are busy.
+    //
+
+    createThread = m_numIdleThreads == 0 && m_numThreads < m_maxThreads;
+    if (createThread) {
+        m_numThreads += 1;
+    }
+
+    LeaveCriticalSection(&m_lock);
+
+    if (createThread) {
+        HANDLE thread = CreateThread(NULL, 0, helper_thread, NULL, 0, NULL);
+        assert(thread != NULL);
+        CloseHandle(thread);
+    }
+
+    ReleaseSemaphore(m_requestsAvailable, 1, NULL);
+}
+
+//
+// The function run by each helper thread.
+//
+
+unsigned long __stdcall OffloadPool::helper_thread(void *)
+{
+    for (;;) {
+        EnterCriticalSection(&m_lock);
+        m_numIdleThreads += 1;
+        LeaveCriticalSection(&m_lock);
+
+        WaitForSingleObject(m_requestsAvailable, INFINITE);
+
+        EnterCriticalSection(&m_lock);
+        m_numIdleThreads -= 1;
+        OffloadRequest *request = m_requestQueue.front();
+        m_requestQueue.pop_front();
+        LeaveCriticalSection(&m_lock);
+
+        request->Result = request->Function(request->Argument);
+
+        //
+        // The request lives on the requesting thread's stack, so it must not be 
+        // touched after it is handed over.
+        //
+
+        UScheduler::remote_wake(request);
+    }
+}
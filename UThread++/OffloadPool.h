@@ -0,0 +1,96 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+#pragma once
+
+#include "UScheduler.h"
+
+class UThread;
+
+//
+// A request to run a blocking function on an operating system helper thread. 
+// The request lives on the stack of the user thread that is parked waiting for it.
+//
+
+struct OffloadRequest
+{
+    UScheduler::BlockingFunction Function;
+    void *Argument;
+    void *Result;
+
+    //
+    // The parked user thread that issued the request.
+    //
+
+    UThread *Thread;
+
+    //
+    // The scheduler of the requesting thread, which completes the request.
+    //
+
+    UScheduler *Scheduler;
+
+    //
+    // The link used while the request is in UScheduler::m_pRemoteWakeList.
+    //
+
+    OffloadRequest *Next;
+
+    //
+    // Set by the scheduler of the requesting thread, once Result is available 
+    // and the helper thread no longer touches the request.
+    //
+
+    volatile bool Completed;
+};
+
+//
+// The bounded pool of operating system helper threads that run blocking functions 
+// on behalf of user threads. Helper threads are created on demand, up to m_maxThreads, 
+// and live until the process exits.
+//
+
+class OffloadPool
+{
+    //
+    // The maximum number of helper threads.
+    //
+
+    static const int m_maxThreads = 4;
+
+public:
+
+    //
+    // Queues the request to be run by a helper thread. When the function returns, 
+    // the helper thread wakes the requesting user thread through its scheduler.
+    //
+
+    static void Submit(OffloadRequest *request);
+
+private:
+
+    //
+    // Private constructor.
+    //
+
+    OffloadPool();
+
+    //
+    // The function run by each helper thread.
+    //
+
+    static unsigned long __stdcall helper_thread(void *argument);
+};
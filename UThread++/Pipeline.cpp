@@ -0,0 +1,274 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+
+#include <cassert>
+#include <windows.h>
+
+//
+// WinBase.h defines Yield() as an empty macro.
+//
+
+#undef Yield
+
+#include "Pipeline.h"
+
+EventCount Pipeline::m_doneEvent;
+
+//
+// Creates an empty pipeline.
+//
+
+Pipeline::Pipeline()
+    : m_itemsPushed(0),
+      m_startTime(0),
+      m_done(0)
+{ }
+
+//
+// The Pipeline destructor. The stages must be done, or never started.
+//
+
+Pipeline::~Pipeline()
+{
+    assert(m_startTime == 0 || m_done != 0);
+
+    for (size_t i = 0; i < m_stages.size(); ++i) {
+        delete m_stages[i]->Queue;
+        delete m_stages[i];
+    }
+}
+
+//
+// Appends a stage and links the previous last stage to it.
+//
+
+Pipeline & Pipeline::AddStage(const char *name, StageFunction function, void *context, 
+                              int numThreads, long capacity, int batchSize)
+{
+    assert(m_startTime == 0 && numThreads > 0 && batchSize > 0);
+
+    Stage *stage = new Stage();
+
+    stage->Name = name;
+    stage->Function = function;
+    stage->Context = context;
+    stage->NumThreads = numThreads;
+    stage->BatchSize = batchSize;
+    stage->Capacity = capacity;
+    stage->Queue = new BlockingBoundedQueue<void *>(capacity);
+    stage->Next = NULL;
+    stage->Owner = this;
+    stage->ItemsIn = 0;
+    stage->ItemsOut = 0;
+    stage->Batches = 0;
+    stage->Stalls = 0;
+    stage->LiveThreads = numThreads;
+
+    if (!m_stages.empty()) {
+        m_stages.back()->Next = stage;
+    }
+    m_stages.push_back(stage);
+    return *this;
+}
+
+//
+// Creates the threads of all stages.
+//
+
+void Pipeline::Start(UScheduler &scheduler)
+{
+    assert(m_startTime == 0 && !m_stages.empty());
+
+    m_startTime = UScheduler::Now();
+
+    for (size_t i = 0; i < m_stages.size(); ++i) {
+        for (int j = 0; j < m_stages[i]->NumThreads; ++j) {
+            UThread::Create(scheduler, stage_thread, m_stages[i]);
+        }
+    }
+}
+
+//
+// Feeds an item to the first stage.
+//
+
+void Pipeline::Push(void *item)
+{
+    assert(item != NULL);
+
+    enqueue(m_stages.front(), item);
+    InterlockedIncrement64(&m_itemsPushed);
+}
+
+//
+// Ends the stream of the first stage. The others are closed in turn by the 
+// last thread of the stage before them.
+//
+
+void Pipeline::Close()
+{
+    close_stage(m_stages.front());
+}
+
+//
+// Parks until the last thread of the last stage exits.
+//
+
+void Pipeline::Wait()
+{
+    while (m_done == 0) {
+        long key = m_doneEvent.PrepareWait();
+
+        if (m_done != 0) {
+            m_doneEvent.CancelWait();
+            break;
+        }
+
+        m_doneEvent.Wait(key);
+    }
+}
+
+//
+// Returns the counters of the stage. The depth of its queue is derived from the 
+// items put into it and taken out, which are counted separately and may briefly 
+// disagree.
+//
+
+StageMetrics Pipeline::GetMetrics(int index) const
+{
+    Stage *stage = m_stages[index];
+    StageMetrics metrics;
+
+    //
+    // Interlocked reads, as 64-bit loads are not atomic on x86.
+    //
+
+    metrics.Name = stage->Name;
+    metrics.ItemsIn = InterlockedCompareExchange64(&stage->ItemsIn, 0, 0);
+    metrics.ItemsOut = InterlockedCompareExchange64(&stage->ItemsOut, 0, 0);
+    metrics.Batches = InterlockedCompareExchange64(&stage->Batches, 0, 0);
+    metrics.Stalls = InterlockedCompareExchange64(&stage->Stalls, 0, 0);
+    metrics.QueueCapacity = stage->Capacity;
+    metrics.ElapsedMicroseconds = m_startTime == 0 ? 0 : UScheduler::Now() - m_startTime;
+
+    __int64 itemsQueued = index == 0 
+                        ? InterlockedCompareExchange64((volatile __int64 *) &m_itemsPushed, 0, 0) 
+                        : InterlockedCompareExchange64(&m_stages[index - 1]->ItemsOut, 0, 0);
+    __int64 depth = itemsQueued - metrics.ItemsIn;
+
+    metrics.QueueDepth = depth < 0 ? 0 : (long) depth;
+    return metrics;
+}
+
+//
+// Hands the emitted items to the next stage's queue and counts them.
+//
+
+void Pipeline::Output::flush()
+{
+    if (m_count == 0) {
+        return;
+    }
+
+    assert(m_pTarget != NULL);
+
+    for (int i = 0; i < m_count; ++i) {
+        enqueue(m_pTarget, m_items[i]);
+    }
+
+    m_count = 0;
+}
+
+//
+// Adds an item to the stage's queue. Only when it is full does the producer 
+// count a stall and park.
+//
+
+void Pipeline::enqueue(Stage *stage, void *item)
+{
+    if (!stage->Queue->TryEnqueue(item)) {
+        InterlockedIncrement64(&stage->Stalls);
+        stage->Queue->Enqueue(item);
+    }
+}
+
+//
+// Adds an end of stream marker for each thread of the stage. They come after 
+// every item, so each thread takes one once the items are all taken.
+//
+
+void Pipeline::close_stage(Stage *stage)
+{
+    for (int i = 0; i < stage->NumThreads; ++i) {
+        stage->Queue->Enqueue(NULL);
+    }
+}
+
+//
+// Takes batches of items from the stage's queue, parking only for the first 
+// item of a batch, and runs the stage function on them, until it takes an end 
+// of stream marker. The last thread of the stage to exit closes the next stage, 
+// or, for the last stage, wakes the threads in Wait().
+//
+
+void Pipeline::stage_thread(UThread::Argument arg)
+{
+    Stage *stage = (Stage *) arg;
+    vector<void *> items(stage->BatchSize);
+    Output output(stage->Next);
+    bool closed = false;
+
+    while (!closed) {
+        int count = 0;
+        void *item = stage->Queue->Dequeue();
+
+        while (item != NULL) {
+            items[count++] = item;
+            if (count == stage->BatchSize || !stage->Queue->TryDequeue(item)) {
+                break;
+            }
+        }
+
+        closed = item == NULL;
+
+        if (count > 0) {
+            InterlockedExchangeAdd64(&stage->ItemsIn, count);
+            InterlockedIncrement64(&stage->Batches);
+
+            stage->Function(stage->Context, &items[0], count, output);
+
+            output.flush();
+            if (output.m_numEmitted != 0) {
+                InterlockedExchangeAdd64(&stage->ItemsOut, output.m_numEmitted);
+                output.m_numEmitted = 0;
+            }
+        }
+    }
+
+    if (InterlockedDecrement(&stage->LiveThreads) == 0) {
+        if (stage->Next != NULL) {
+            close_stage(stage->Next);
+        } else {
+            //
+            // The pipeline may be destroyed once m_done is set.
+            //
+
+            InterlockedExchange(&stage->Owner->m_done, 1);
+            m_doneEvent.NotifyAll();
+        }
+    }
+}
@@ -0,0 +1,227 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+
+#pragma once
+
+#include <vector>
+#include "BoundedQueue.h"
+#include "EventCount.h"
+#include "UScheduler.h"
+
+using namespace std;
+
+//
+// The counters of a pipeline stage: the items it took from its queue and emitted, 
+// the batches it processed, how many times its producers found its queue full and 
+// parked, and the items in its queue. Throughput is ItemsIn per ElapsedMicroseconds, 
+// the time since the pipeline started.
+//
+
+struct StageMetrics
+{
+    const char *Name;
+    __int64 ItemsIn;
+    __int64 ItemsOut;
+    __int64 Batches;
+    __int64 Stalls;
+    long QueueDepth;
+    long QueueCapacity;
+    __int64 ElapsedMicroseconds;
+};
+
+//
+// A chain of stages, each run by a number of user threads that take batches of 
+// items from a bounded queue and emit items to the next stage's queue. Producers 
+// park while a queue is full, so a slow stage holds back the ones before it 
+// instead of letting the queues grow. Items are non-NULL pointers; NULL marks the 
+// end of the stream.
+//
+// Stages are added with AddStage(), before Start() creates their threads. Items 
+// are fed with Push() and, once Close() is called, the stages drain their queues 
+// and exit in order. Wait() parks until the last stage is done. Push(), Close() 
+// and Wait() are called from user threads, on any scheduler.
+//
+
+class Pipeline
+{
+    struct Stage;
+
+public:
+
+    //
+    // Collects the items a stage emits, handing them to the next stage's queue a 
+    // batch at a time. The last stage has no next one and must not emit.
+    //
+
+    class Output
+    {
+        static const int Capacity = 64;
+
+        Stage *m_pTarget;
+        void *m_items[Capacity];
+        int m_count;
+        int m_numEmitted;
+
+        explicit Output(Stage *target)
+            : m_pTarget(target),
+              m_count(0),
+              m_numEmitted(0)
+        { }
+
+        void flush();
+
+        friend class Pipeline;
+
+    public:
+
+        void Emit(void *item)
+        {
+            if (m_count == Capacity) {
+                flush();
+            }
+            m_items[m_count++] = item;
+            m_numEmitted += 1;
+        }
+    };
+
+    //
+    // The function run by a stage on each batch of count items it takes from 
+    // its queue.
+    //
+
+    typedef void (*StageFunction)(void *context, void *items[], int count, Output &output);
+
+    Pipeline();
+
+    ~Pipeline();
+
+    //
+    // Appends a stage run by numThreads user threads, fed by a queue of capacity 
+    // items, a power of two, of which each thread takes up to batchSize at a time.
+    // Returns the pipeline, so stages can be chained.
+    //
+
+    Pipeline & AddStage(const char *name, StageFunction function, void *context, 
+                        int numThreads = 1, long capacity = 256, int batchSize = 16);
+
+    //
+    // Creates the threads of all stages on the specified scheduler.
+    //
+
+    void Start(UScheduler &scheduler);
+
+    //
+    // Feeds an item to the first stage, parking while its queue is full.
+    //
+
+    void Push(void *item);
+
+    //
+    // Ends the stream. Must be called after the last Push().
+    //
+
+    void Close();
+
+    //
+    // Parks until every stage has processed all of its items.
+    //
+
+    void Wait();
+
+    //
+    // Returns the number of stages.
+    //
+
+    int GetStageCount() const
+    {
+        return (int) m_stages.size();
+    }
+
+    //
+    // Returns the counters of the specified stage. Can be called at any time, 
+    // from any operating system thread.
+    //
+
+    StageMetrics GetMetrics(int stage) const;
+
+private:
+
+    //
+    // A stage, with its queue and counters. The counters are updated once per 
+    // batch.
+    //
+
+    struct Stage
+    {
+        const char *Name;
+        StageFunction Function;
+        void *Context;
+        int NumThreads;
+        int BatchSize;
+        long Capacity;
+        BlockingBoundedQueue<void *> *Queue;
+        Stage *Next;
+        Pipeline *Owner;
+
+        volatile __int64 ItemsIn;
+        volatile __int64 ItemsOut;
+        volatile __int64 Batches;
+        volatile __int64 Stalls;
+        volatile long LiveThreads;
+    };
+
+    vector<Stage *> m_stages;
+
+    //
+    // The items fed to the first stage, when the pipeline started and whether 
+    // the last stage is done.
+    //
+
+    volatile __int64 m_itemsPushed;
+    __int64 m_startTime;
+    volatile long m_done;
+
+    //
+    // The event count Wait() parks on, shared by all pipelines. The caller may 
+    // destroy the pipeline as soon as it sees m_done set, so the last thread 
+    // notifies an event count that outlives it. Waiters of other pipelines 
+    // recheck their own m_done and park again.
+    //
+
+    static EventCount m_doneEvent;
+
+    //
+    // Adds an item to the stage's queue, counting a stall if it has to park.
+    //
+
+    static void enqueue(Stage *stage, void *item);
+
+    //
+    // Adds an end of stream marker for each thread of the stage.
+    //
+
+    static void close_stage(Stage *stage);
+
+    //
+    // The function run by the threads of a stage.
+    //
+
+    static void stage_thread(UThread::Argument arg);
+
+    Pipeline(const Pipeline &);
+    Pipeline & operator =(const Pipeline &);
+};
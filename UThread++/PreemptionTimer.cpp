@@ -0,0 +1,288 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+#include <cassert>
+#include <windows.h>
+#include <psapi.h>
+
+//
+// WinBase.h defines Yield() as an empty macro.
+//
+
+#undef Yield
+
+#include "PreemptionTimer.h"
+#include "UScheduler.h"
+#include "UThread.h"
+
+//
+// The code range of the main executable. Threads are only interrupted while 
+// executing there, never inside system or runtime DLLs, whose locks are owned 
+// by the operating system thread and would be reentered by the next user thread. 
+// For the same reason, code of the executable that holds an operating system 
+// lock, such as a CRITICAL_SECTION, or that updates a structure shared by the 
+// user threads of a scheduler without a user-level lock must run under a 
+// PreemptionGuard; a CRITICAL_SECTION is recursive per operating system thread, 
+// so it does not exclude the other user threads.
+//
+
+static unsigned char *m_pImageBase;
+static unsigned long m_imageSize;
+
+//
+// The code range of the switch routines, which run on a half-switched context 
+// and must never be interrupted.
+//
+
+static unsigned char *m_pSwitchCodeBegin;
+static unsigned char *m_pSwitchCodeEnd;
+
+//
+// Returns true if the stack word at the specified address is committed and is 
+// not part of a guard page. A growable stack only grows when its own thread 
+// touches the guard page, so the timer thread must not write there.
+//
+
+static bool committed(void *address)
+{
+    MEMORY_BASIC_INFORMATION info;
+
+    return VirtualQuery(address, &info, sizeof(info)) != 0 && 
+           info.State == MEM_COMMIT && (info.Protect & PAGE_GUARD) == 0;
+}
+
+//
+// Forward declaration of the stub to which interrupted threads are redirected.
+//
+
+void preemption_stub();
+
+//
+// Forward declaration of the markers around the switch routines, in UThread.cpp.
+//
+
+void switch_code_begin();
+void switch_code_end();
+
+//
+// Returns the address of the code of the specified function. Incremental 
+// linking makes function addresses refer to jump thunks, which are followed.
+//
+
+static unsigned char * code_address(void (*function)())
+{
+    unsigned char *code = (unsigned char *) function;
+
+    if (code[0] == 0xE9) {
+        code += 5 + *(long *) (code + 1);
+    }
+    return code;
+}
+
+//
+// Starts the timer thread of the scheduler, which must be running on the 
+// calling operating system thread.
+//
+
+void PreemptionTimer::start(UScheduler *scheduler)
+{
+    if (m_pImageBase == NULL) {
+        MODULEINFO info;
+
+        GetModuleInformation(GetCurrentProcess(), GetModuleHandle(NULL), &info, sizeof(info));
+        m_imageSize = info.SizeOfImage;
+        m_pImageBase = (unsigned char *) info.lpBaseOfDll;
+        m_pSwitchCodeBegin = code_address(switch_code_begin);
+        m_pSwitchCodeEnd = code_address(switch_code_end);
+    }
+
+    DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), 
+                    &scheduler->m_osThread, 
+                    THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_SET_CONTEXT, 
+                    FALSE, 0);
+
+    scheduler->m_preemptionStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    scheduler->m_preemptionTimer = CreateThread(NULL, 0, timer_thread, scheduler, 0, NULL);
+    
+    //
+    // The timer must see the preemption requests of the running thread promptly.
+    //
+
+    SetThreadPriority(scheduler->m_preemptionTimer, THREAD_PRIORITY_TIME_CRITICAL);
+}
+
+//
+// Stops the timer thread of the scheduler.
+//
+
+void PreemptionTimer::stop(UScheduler *scheduler)
+{
+    SetEvent(scheduler->m_preemptionStopEvent);
+    WaitForSingleObject(scheduler->m_preemptionTimer, INFINITE);
+
+    CloseHandle(scheduler->m_preemptionTimer);
+    CloseHandle(scheduler->m_preemptionStopEvent);
+    CloseHandle(scheduler->m_osThread);
+    scheduler->m_preemptionTimer = NULL;
+    scheduler->m_preemptionStopEvent = NULL;
+    scheduler->m_osThread = NULL;
+}
+
+//
+// The function run by the timer thread. A thread exceeded its quantum when 
+// there was no switch during a whole timer period.
+//
+
+unsigned long __stdcall PreemptionTimer::timer_thread(void *argument)
+{
+    UScheduler *scheduler = (UScheduler *) argument;
+    unsigned lastSwitchCount = scheduler->m_switchCount;
+
+    while (WaitForSingleObject(scheduler->m_preemptionStopEvent, 
+                               scheduler->m_quantumMilliseconds) == WAIT_TIMEOUT) {
+        unsigned switchCount = scheduler->m_switchCount;
+
+        if (switchCount != lastSwitchCount) {
+            lastSwitchCount = switchCount;
+            continue;
+        }
+
+        //
+        // Nothing to do if the scheduler is idle or no other thread is ready.
+        //
+
+        if (scheduler->m_pRunningThread == scheduler->m_pMainThread || 
+            scheduler->m_readyCount == 0) {
+            continue;
+        }
+
+        if (scheduler->m_preemptionMode == AsyncPreemption && 
+            interrupt(scheduler, switchCount)) {
+            continue;
+        }
+
+        scheduler->m_preemptRequested = true;
+    }
+
+    return 0;
+}
+
+//
+// Suspends the scheduler's operating system thread and, if the running thread 
+// is still the one that exceeded its quantum and can be preempted, redirects it 
+// to preemption_stub(). Returns true if the thread was redirected.
+//
+
+bool PreemptionTimer::interrupt(UScheduler *scheduler, unsigned switchCount)
+{
+    CONTEXT context;
+    bool redirected = false;
+
+    if (SuspendThread(scheduler->m_osThread) == (DWORD) -1) {
+        return false;
+    }
+
+    //
+    // SuspendThread() is asynchronous; GetThreadContext() waits for the thread 
+    // to actually stop.
+    //
+
+    context.ContextFlags = CONTEXT_CONTROL;
+    if (GetThreadContext(scheduler->m_osThread, &context)) {
+        UThread *thread = scheduler->m_pRunningThread;
+        unsigned char *eip = (unsigned char *) context.Eip;
+        unsigned char *esp = (unsigned char *) context.Esp;
+
+        if (scheduler->m_switchCount == switchCount && 
+            thread != scheduler->m_pMainThread &&
+            thread->m_preemptionDisabled == 0 &&
+            esp - sizeof(DWORD) >= thread->m_pStack && 
+            esp <= thread->m_pStackTop &&
+            eip >= m_pImageBase && eip < m_pImageBase + m_imageSize &&
+            (eip < m_pSwitchCodeBegin || eip >= m_pSwitchCodeEnd) &&
+            (!thread->m_growable || committed(esp - sizeof(DWORD)))) {
+
+            //
+            // Push the interrupted instruction's address, so preemption_stub() 
+            // returns there, and redirect the thread to it.
+            //
+
+            context.Esp -= sizeof(DWORD);
+            *(DWORD *) context.Esp = context.Eip;
+            context.Eip = (DWORD) preemption_stub;
+            redirected = SetThreadContext(scheduler->m_osThread, &context) != FALSE;
+        }
+    }
+
+    ResumeThread(scheduler->m_osThread);
+    return redirected;
+}
+
+//
+// Called by preemption_stub() on the interrupted thread's stack, with its 
+// register state saved, to switch to the next ready thread. The stub restores 
+// the floating point and SIMD registers it saved when the thread resumes, so 
+// no thread's vector state may be left in the registers across the yield.
+//
+
+void PreemptionTimer::preempted()
+{
+    UScheduler::m_pCurrent->release_vector_state();
+    UThread::Yield();
+    UScheduler::m_pCurrent->release_vector_state();
+}
+
+//
+// The address to which interrupted threads are redirected. It saves the complete 
+// register state, including the FPU/SSE state, on the thread's stack, calls 
+// PreemptionTimer::preempted() and resumes the thread where it was interrupted.
+//
+
+__declspec(naked) void preemption_stub()
+{
+    __asm {
+
+        //
+        // The return address, pushed by PreemptionTimer::interrupt(), is atop the stack.
+        //
+
+        pushfd
+        pushad
+
+        //
+        // Save the FPU/SSE state in a 16-byte aligned area, keeping the 
+        // unaligned stack pointer in EBX, which is callee-saved.
+        //
+
+        mov     ebx, esp
+        sub     esp, 512
+        and     esp, 0xfffffff0
+        fxsave  [esp]
+
+        //
+        // The interrupted code may have set the direction flag.
+        //
+
+        cld
+        call    PreemptionTimer::preempted
+
+        fxrstor [esp]
+        mov     esp, ebx
+        popad
+        popfd
+        ret
+    }
+}
@@ -0,0 +1,80 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+#pragma once
+
+class UScheduler;
+
+//
+// The per-scheduler timer that preempts user threads running for longer than the 
+// scheduler's quantum. It runs on its own operating system thread, started and 
+// stopped by UScheduler::Run() when preemption is enabled.
+//
+
+class PreemptionTimer
+{
+    //
+    // Private constructor.
+    //
+
+    PreemptionTimer();
+
+    //
+    // Starts the timer thread of the scheduler, which must be running on the 
+    // calling operating system thread.
+    //
+
+    static void start(UScheduler *scheduler);
+
+    //
+    // Stops the timer thread of the scheduler.
+    //
+
+    static void stop(UScheduler *scheduler);
+
+    //
+    // The function run by the timer thread.
+    //
+
+    static unsigned long __stdcall timer_thread(void *argument);
+
+    //
+    // Suspends the scheduler's operating system thread and, if the running thread 
+    // is still the one that exceeded its quantum and can be preempted, redirects it 
+    // to preemption_stub(). Returns true if the thread was redirected.
+    //
+
+    static bool interrupt(UScheduler *scheduler, unsigned switchCount);
+
+    //
+    // Called by preemption_stub() on the interrupted thread's stack, with its 
+    // register state saved, to switch to the next ready thread.
+    //
+
+    static void preempted();
+
+    //
+    // The address to which interrupted threads are redirected.
+    //
+
+    friend void preemption_stub();
+
+    //
+    // UScheduler starts and stops the timer.
+    //
+
+    friend class UScheduler;
+};
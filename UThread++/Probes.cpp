@@ -0,0 +1,43 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+
+#include "Probes.h"
+
+#if defined(UTHREAD_ETW)
+
+//
+// The TraceLogging provider of the scheduler's probes, registered for the 
+// lifetime of the process. Events written before registration are dropped.
+//
+
+TRACELOGGING_DEFINE_PROVIDER(UThreadTraceProvider, "UThread",
+    (0x8d76c86e, 0x641a, 0x53ec, 0x70, 0x72, 0x80, 0x64, 0x4c, 0x42, 0x58, 0xe7));
+
+static struct ProviderRegistration
+{
+    ProviderRegistration()
+    {
+        TraceLoggingRegister(UThreadTraceProvider);
+    }
+
+    ~ProviderRegistration()
+    {
+        TraceLoggingUnregister(UThreadTraceProvider);
+    }
+} m_providerRegistration;
+
+#endif
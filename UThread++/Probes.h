@@ -0,0 +1,107 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+
+#pragma once
+
+//
+// Static probes on scheduler events, for profilers that attribute samples to 
+// operating system threads and cannot see user threads otherwise. Each probe 
+// carries the ids returned by UThread::GetId(), so the events can be folded into 
+// per-user-thread timelines and off-CPU flame graphs.
+//
+// With UTHREAD_ETW defined, the probes are TraceLogging events of the "UThread" 
+// provider (8d76c86e-641a-53ec-7072-80644c4258e7), which cost a load and a branch 
+// while no session listens. With UTHREAD_USDT defined, where sys/sdt.h exists, 
+// they are USDT probes of the "uthread" provider, which are no-ops until attached. 
+// Otherwise they compile to nothing.
+//
+// Probes:
+//
+//   spawn(thread, parent)      a thread was created, by parent or outside any thread (0)
+//   switch(from, to)           the scheduler switches from one thread to another
+//   park(thread)               a thread blocks
+//   unpark(thread)             a parked thread becomes ready
+//   exit(thread)               a thread ends
+//   mutex_block(thread, mutex) a thread waits for a mutex
+//   mutex_wake(thread, mutex)  a waiting thread is handed a mutex
+//   sem_block(thread, sem)     a thread waits for a semaphore permit
+//   sem_wake(thread, sem)      a waiting thread is handed a permit
+//
+// Must only be included by source files.
+//
+
+#if defined(UTHREAD_ETW)
+
+#include <windows.h>
+#include <TraceLoggingProvider.h>
+
+//
+// WinBase.h defines Yield() as an empty macro.
+//
+
+#undef Yield
+
+TRACELOGGING_DECLARE_PROVIDER(UThreadTraceProvider);
+
+#define UTHREAD_PROBE1(name, n1, a1) \
+    TraceLoggingWrite(UThreadTraceProvider, name, TraceLoggingInt32((int) (a1), n1))
+
+#define UTHREAD_PROBE2(name, n1, a1, n2, a2) \
+    TraceLoggingWrite(UThreadTraceProvider, name, TraceLoggingInt32((int) (a1), n1), \
+                      TraceLoggingInt32((int) (a2), n2))
+
+#define UTHREAD_PROBE_OBJECT(name, a1, object) \
+    TraceLoggingWrite(UThreadTraceProvider, name, TraceLoggingInt32((int) (a1), "Thread"), \
+                      TraceLoggingPointer(object, "Object"))
+
+#define UTHREAD_PROBE_SPAWN(thread, parent)     UTHREAD_PROBE2("Spawn", "Thread", thread, "Parent", parent)
+#define UTHREAD_PROBE_SWITCH(from, to)          UTHREAD_PROBE2("Switch", "From", from, "To", to)
+#define UTHREAD_PROBE_PARK(thread)              UTHREAD_PROBE1("Park", "Thread", thread)
+#define UTHREAD_PROBE_UNPARK(thread)            UTHREAD_PROBE1("Unpark", "Thread", thread)
+#define UTHREAD_PROBE_EXIT(thread)              UTHREAD_PROBE1("Exit", "Thread", thread)
+#define UTHREAD_PROBE_MUTEX_BLOCK(thread, mutex) UTHREAD_PROBE_OBJECT("MutexBlock", thread, mutex)
+#define UTHREAD_PROBE_MUTEX_WAKE(thread, mutex)  UTHREAD_PROBE_OBJECT("MutexWake", thread, mutex)
+#define UTHREAD_PROBE_SEM_BLOCK(thread, sem)     UTHREAD_PROBE_OBJECT("SemaphoreBlock", thread, sem)
+#define UTHREAD_PROBE_SEM_WAKE(thread, sem)      UTHREAD_PROBE_OBJECT("SemaphoreWake", thread, sem)
+
+#elif defined(UTHREAD_USDT)
+
+#include <sys/sdt.h>
+
+#define UTHREAD_PROBE_SPAWN(thread, parent)     DTRACE_PROBE2(uthread, spawn, thread, parent)
+#define UTHREAD_PROBE_SWITCH(from, to)          DTRACE_PROBE2(uthread, switch, from, to)
+#define UTHREAD_PROBE_PARK(thread)              DTRACE_PROBE1(uthread, park, thread)
+#define UTHREAD_PROBE_UNPARK(thread)            DTRACE_PROBE1(uthread, unpark, thread)
+#define UTHREAD_PROBE_EXIT(thread)              DTRACE_PROBE1(uthread, exit, thread)
+#define UTHREAD_PROBE_MUTEX_BLOCK(thread, mutex) DTRACE_PROBE2(uthread, mutex_block, thread, mutex)
+#define UTHREAD_PROBE_MUTEX_WAKE(thread, mutex)  DTRACE_PROBE2(uthread, mutex_wake, thread, mutex)
+#define UTHREAD_PROBE_SEM_BLOCK(thread, sem)     DTRACE_PROBE2(uthread, sem_block, thread, sem)
+#define UTHREAD_PROBE_SEM_WAKE(thread, sem)      DTRACE_PROBE2(uthread, sem_wake, thread, sem)
+
+#else
+
+#define UTHREAD_PROBE_SPAWN(thread, parent)      ((void) 0)
+#define UTHREAD_PROBE_SWITCH(from, to)           ((void) 0)
+#define UTHREAD_PROBE_PARK(thread)               ((void) 0)
+#define UTHREAD_PROBE_UNPARK(thread)             ((void) 0)
+#define UTHREAD_PROBE_EXIT(thread)               ((void) 0)
+#define UTHREAD_PROBE_MUTEX_BLOCK(thread, mutex) ((void) 0)
+#define UTHREAD_PROBE_MUTEX_WAKE(thread, mutex)  ((void) 0)
+#define UTHREAD_PROBE_SEM_BLOCK(thread, sem)     ((void) 0)
+#define UTHREAD_PROBE_SEM_WAKE(thread, sem)      ((void) 0)
+
+#endif
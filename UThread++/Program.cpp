@@ -15,11 +15,33 @@
 // 
 
 #include <cassert>
+#include <cstring>
 #include <iostream>
+#include <list>
+#include <vector>
+#include <windows.h>
+#include <xmmintrin.h>
+
+//
+// WinBase.h defines Yield() as an empty macro.
+//
+
+#undef Yield
+
+#include "Actor.h"
+#include "BufferPool.h"
+#include "ConcurrencyLimit.h"
+#include "LoadBalancer.h"
+#include "Pipeline.h"
+#include "RateLimiter.h"
+#include "Reclaimer.h"
+#include "Runtime.h"
 #include "UScheduler.h"
 #include "UThread.h"
 #include "Mutex.h"
 #include "Semaphore.h"
+#include "BoundedQueue.h"
+#include "WorkStealingDeque.h"
 
 using namespace std;
 
@@ -49,6 +71,8 @@ void test1_thread(UThread::Argument arg)
 }
 
 void test1() {
+    UScheduler scheduler;
+
     cout << endl << ":: Test 1 - BEGIN ::" << endl << endl;
 
     test1_count = 0; 
@@ -57,7 +81,7 @@ void test1() {
         UThread::Create(test1_thread, (UThread::Argument) ('0' + i));
     }
 
-    UScheduler::Run();
+    scheduler.Run();
 
     assert(test1_count == 10);
     cout << endl << ":: Test 1 - END ::" << endl << endl;
@@ -132,6 +156,7 @@ void test2_thread3(UThread::Argument arg) {
 }
 
 void test2() {
+    UScheduler scheduler;
     Mutex mutex;
 
     cout << endl << ":: Test 2 - BEGIN ::" << endl << endl;
@@ -141,7 +166,7 @@ void test2() {
     UThread::Create(test2_thread1, &mutex);
     UThread::Create(test2_thread2, &mutex);
     UThread::Create(test2_thread3, &mutex);
-    UScheduler::Run();
+    scheduler.Run();
     
     cout << endl << ":: Test 2 - END ::" << endl << endl;
     
@@ -310,22 +335,1952 @@ void test3_first_thread(UThread::Argument arg)
 
 void test3() 
 {
+    UScheduler scheduler;
     Mailbox<char> mailbox;
 
     cout << endl << ":: Test 3 - BEGIN ::" << endl << endl;
 
     UThread::Create(test3_first_thread, &mailbox);
-    UScheduler::Run();
+    scheduler.Run();
 
     cout << endl << endl << ":: Test 3 - END ::" << endl;
 }
 
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 4: park permits and non-blocking acquires            //
+//															 //
+///////////////////////////////////////////////////////////////
+
+unsigned int test4_count;
+
+void test4_thread(UThread::Argument arg)
+{
+    Mutex *mutex = (Mutex *) arg;
+    Semaphore semaphore;
+
+    cout << "UThread 2 running" << endl;
+
+    //
+    // The mutex is owned by the first thread and the semaphore has no permits.
+    //
+
+    bool acquired = mutex->TryAcquire();
+    assert(!acquired);
+    acquired = semaphore.TryWait();
+    assert(!acquired);
+
+    semaphore.Post();
+    acquired = semaphore.TryWait();
+    assert(acquired);
+
+    //
+    // An Unpark() that arrives before Park() leaves a permit, so Park() returns 
+    // immediately. Permits do not accumulate.
+    //
+
+    UThread::Current().Unpark();
+    UThread::Current().Unpark();
+    UThread::Park();
+    cout << "UThread 2 consumed its permit" << endl;
+
+    ++test4_count;
+}
+
+void test4_first_thread(UThread::Argument arg)
+{
+    Mutex *mutex = (Mutex *) arg;
+
+    cout << "UThread 1 running" << endl;
+
+    bool acquired = mutex->TryAcquire();
+    assert(acquired);
+    acquired = mutex->TryAcquire();
+    assert(acquired);
+
+    UThread::Create(test4_thread, mutex);
+
+    //
+    // The permit made available while running survives the yield, so the 
+    // following Park() returns immediately.
+    //
+
+    UThread::Current().Unpark();
+    UThread::Yield();
+    UThread::Park();
+
+    while (test4_count != 1) {
+        UThread::Yield();
+    }
+
+    mutex->Release();
+    mutex->Release();
+    cout << "UThread 1 exiting" << endl;
+
+    ++test4_count;
+}
+
+void test4()
+{
+    UScheduler scheduler;
+    Mutex mutex;
+
+    cout << endl << ":: Test 4 - BEGIN ::" << endl << endl;
+
+    test4_count = 0;
+
+    UThread::Create(test4_first_thread, &mutex);
+    scheduler.Run();
+
+    assert(test4_count == 2);
+    cout << endl << ":: Test 4 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 5: offloading a blocking call to a helper thread     //
+//															 //
+///////////////////////////////////////////////////////////////
+
+unsigned int test5_count;
+unsigned int test5_ticks;
+
+void * test5_blocking_call(void *arg)
+{
+    Sleep((DWORD) arg);
+    return (void *) 42;
+}
+
+void test5_offload_thread(UThread::Argument arg)
+{
+    cout << "UThread 1 offloading a blocking call..." << endl;
+    void *result = UScheduler::Offload(test5_blocking_call, (void *) 200);
+    cout << "UThread 1 got " << (int) result << " after " << test5_ticks << " ticks" << endl;
+
+    assert(result == (void *) 42);
+    assert(test5_ticks > 0);
+
+    ++test5_count;
+}
+
+void test5_ticker_thread(UThread::Argument arg)
+{
+    //
+    // Keeps running while the other thread is parked in Offload().
+    //
+
+    while (test5_count == 0) {
+        ++test5_ticks;
+        UThread::Yield();
+    }
+
+    ++test5_count;
+}
+
+void test5()
+{
+    UScheduler scheduler;
+
+    cout << endl << ":: Test 5 - BEGIN ::" << endl << endl;
+
+    test5_count = 0;
+    test5_ticks = 0;
+
+    UThread::Create(test5_offload_thread, NULL);
+    UThread::Create(test5_ticker_thread, NULL);
+    scheduler.Run();
+
+    assert(test5_count == 2);
+    cout << endl << ":: Test 5 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 6: independent schedulers on several OS threads      //
+//															 //
+///////////////////////////////////////////////////////////////
+
+const int test6_num_schedulers = 4;
+
+UScheduler *test6_schedulers[test6_num_schedulers];
+volatile LONG test6_count;
+
+void test6_thread(UThread::Argument arg)
+{
+    UScheduler *scheduler = (UScheduler *) arg;
+
+    for (int i = 0; i < 1000; ++i) {
+        assert(&UScheduler::Current() == scheduler);
+        UThread::Yield();
+    }
+
+    InterlockedIncrement(&test6_count);
+}
+
+DWORD WINAPI test6_os_thread(LPVOID arg)
+{
+    ((UScheduler *) arg)->Run();
+    return 0;
+}
+
+void test6()
+{
+    HANDLE osThreads[test6_num_schedulers];
+
+    cout << endl << ":: Test 6 - BEGIN ::" << endl << endl;
+
+    test6_count = 0;
+
+    for (int i = 0; i < test6_num_schedulers; ++i) {
+        test6_schedulers[i] = new UScheduler();
+
+        for (int j = 0; j < 10; ++j) {
+            UThread::Create(*test6_schedulers[i], test6_thread, test6_schedulers[i]);
+        }
+    }
+
+    for (int i = 0; i < test6_num_schedulers; ++i) {
+        osThreads[i] = CreateThread(NULL, 0, test6_os_thread, test6_schedulers[i], 0, NULL);
+    }
+
+    WaitForMultipleObjects(test6_num_schedulers, osThreads, TRUE, INFINITE);
+
+    for (int i = 0; i < test6_num_schedulers; ++i) {
+        CloseHandle(osThreads[i]);
+        delete test6_schedulers[i];
+    }
+
+    cout << "Ran " << test6_count << " threads on " << test6_num_schedulers << " schedulers" << endl;
+    assert(test6_count == 10 * test6_num_schedulers);
+    cout << endl << ":: Test 6 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 7: migrating threads between schedulers              //
+//															 //
+///////////////////////////////////////////////////////////////
+
+UScheduler *test7_schedulers[2];
+volatile LONG test7_migrated;
+volatile LONG test7_count;
+volatile LONG test7_stolen;
+
+const int test7_num_threads = 20;
+
+void test7_thread(UThread::Argument arg)
+{
+    //
+    // Half of the threads migrate explicitly; the others may be moved by the balancer.
+    //
+
+    if ((int) arg % 2 == 0) {
+        UThread::MigrateTo(*test7_schedulers[1]);
+        assert(&UScheduler::Current() == test7_schedulers[1]);
+        InterlockedIncrement(&test7_migrated);
+
+        for (int i = 0; i < 2000; ++i) {
+            UThread::Yield();
+        }
+    } else {
+
+        //
+        // Keep the first scheduler loaded until the balancer moves one of these 
+        // threads, giving up after five seconds.
+        //
+
+        DWORD start = GetTickCount();
+
+        while (&UScheduler::Current() == test7_schedulers[0] && test7_stolen == 0 && 
+               GetTickCount() - start < 5000) {
+            UThread::Yield();
+        }
+
+        if (&UScheduler::Current() == test7_schedulers[1]) {
+            InterlockedIncrement(&test7_stolen);
+        }
+    }
+
+    InterlockedIncrement(&test7_count);
+}
+
+void test7_keeper_thread(UThread::Argument arg)
+{
+    //
+    // Keeps the second scheduler running until every thread is done.
+    //
+
+    while (test7_count != test7_num_threads) {
+        UThread::Yield();
+    }
+}
+
+DWORD WINAPI test7_os_thread(LPVOID arg)
+{
+    ((UScheduler *) arg)->Run();
+    return 0;
+}
+
+void test7()
+{
+    HANDLE osThreads[2];
+
+    cout << endl << ":: Test 7 - BEGIN ::" << endl << endl;
+
+    test7_migrated = 0;
+    test7_count = 0;
+    test7_stolen = 0;
+
+    test7_schedulers[0] = new UScheduler();
+    test7_schedulers[1] = new UScheduler();
+
+    for (int i = 0; i < test7_num_threads; ++i) {
+        UThread::Create(*test7_schedulers[0], test7_thread, (UThread::Argument) i);
+    }
+    UThread::Create(*test7_schedulers[1], test7_keeper_thread, NULL);
+
+    LoadBalancer::Start(1);
+
+    for (int i = 0; i < 2; ++i) {
+        osThreads[i] = CreateThread(NULL, 0, test7_os_thread, test7_schedulers[i], 0, NULL);
+    }
+
+    WaitForMultipleObjects(2, osThreads, TRUE, INFINITE);
+
+    LoadBalancer::Stop();
+
+    for (int i = 0; i < 2; ++i) {
+        CloseHandle(osThreads[i]);
+        delete test7_schedulers[i];
+    }
+
+    cout << test7_migrated << " threads migrated, " << test7_stolen << " moved by the balancer" << endl;
+    assert(test7_migrated == test7_num_threads / 2);
+    assert(test7_stolen > 0);
+    assert(test7_count == test7_num_threads);
+    cout << endl << ":: Test 7 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 8: a scheduler that stays alive while idle           //
+//															 //
+///////////////////////////////////////////////////////////////
+
+unsigned int test8_count;
+
+void test8_thread(UThread::Argument arg)
+{
+    UScheduler *scheduler = (UScheduler *) arg;
+
+    ++test8_count;
+
+    if (test8_count == 3) {
+        scheduler->Stop();
+    }
+}
+
+DWORD WINAPI test8_os_thread(LPVOID arg)
+{
+    ((UScheduler *) arg)->Run();
+    return 0;
+}
+
+void test8()
+{
+    UScheduler *scheduler = new UScheduler();
+    IdlePolicy policy;
+
+    cout << endl << ":: Test 8 - BEGIN ::" << endl << endl;
+
+    test8_count = 0;
+
+    policy.SpinMicroseconds = 50;
+    policy.YieldMicroseconds = 200;
+    policy.StayAlive = true;
+    scheduler->SetIdlePolicy(policy);
+
+    HANDLE osThread = CreateThread(NULL, 0, test8_os_thread, scheduler, 0, NULL);
+
+    //
+    // Each thread arrives after the scheduler went idle; the last one stops it.
+    //
+
+    for (int i = 0; i < 3; ++i) {
+        Sleep(20);
+        UThread::Create(*scheduler, test8_thread, scheduler);
+    }
+
+    WaitForSingleObject(osThread, INFINITE);
+    CloseHandle(osThread);
+
+    IdleStatistics statistics = scheduler->GetIdleStatistics();
+    cout << "spin: " << statistics.SpinTime << "us/" << statistics.SpinWakeups 
+         << " yield: " << statistics.YieldTime << "us/" << statistics.YieldWakeups 
+         << " block: " << statistics.BlockTime << "us/" << statistics.BlockWakeups << endl;
+
+    delete scheduler;
+
+    assert(test8_count == 3);
+    assert(statistics.SpinWakeups + statistics.YieldWakeups + statistics.BlockWakeups == 3);
+    cout << endl << ":: Test 8 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 9: preemption of threads that never yield            //
+//															 //
+///////////////////////////////////////////////////////////////
+
+volatile bool test9_done;
+
+void test9_runaway_thread(UThread::Argument arg)
+{
+    PreemptionMode mode = (PreemptionMode) (int) arg;
+
+    //
+    // Only the other thread can end the loop, so it must be preempted.
+    //
+
+    while (!test9_done) {
+        if (mode == SafePointPreemption) {
+            UThread::SafePoint();
+        }
+    }
+    cout << "runaway thread preempted" << endl;
+}
+
+void test9_stopper_thread(UThread::Argument arg)
+{
+    test9_done = true;
+}
+
+void test9()
+{
+    PreemptionMode modes[] = { SafePointPreemption, AsyncPreemption };
+
+    cout << endl << ":: Test 9 - BEGIN ::" << endl << endl;
+
+    for (int i = 0; i < 2; ++i) {
+        UScheduler scheduler;
+
+        test9_done = false;
+        scheduler.SetPreemption(modes[i], 10);
+
+        UThread::Create(test9_runaway_thread, (UThread::Argument) modes[i]);
+        UThread::Create(test9_stopper_thread, NULL);
+
+        scheduler.Run();
+
+        assert(test9_done);
+    }
+
+    cout << endl << ":: Test 9 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 10: yielding only once the yield budget expired      //
+//															 //
+///////////////////////////////////////////////////////////////
+
+const int test10_iterations = 1000000;
+int test10_last_runner;
+int test10_switches;
+unsigned int test10_count;
+
+void test10_thread(UThread::Argument arg)
+{
+    int id = (int) arg;
+
+    for (int i = 0; i < test10_iterations; ++i) {
+        if (test10_last_runner != id) {
+            test10_last_runner = id;
+            ++test10_switches;
+        }
+        UThread::MaybeYield();
+    }
+
+    ++test10_count;
+}
+
+void test10()
+{
+    UScheduler scheduler;
+
+    cout << endl << ":: Test 10 - BEGIN ::" << endl << endl;
+
+    test10_last_runner = -1;
+    test10_switches = 0;
+    test10_count = 0;
+
+    scheduler.SetYieldBudget(100);
+
+    UThread::Create(test10_thread, (UThread::Argument) 1);
+    UThread::Create(test10_thread, (UThread::Argument) 2);
+
+    scheduler.Run();
+
+    cout << test10_switches << " switches in " << 2 * test10_iterations << " iterations" << endl;
+    assert(test10_count == 2);
+    assert(test10_switches < test10_iterations / 100);
+    cout << endl << ":: Test 10 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 11: stack high-water marks                           //
+//															 //
+///////////////////////////////////////////////////////////////
+
+int test11_recurse(int depth)
+{
+    volatile char frame[256];
+
+    frame[0] = (char) depth;
+    return depth == 0 ? frame[0] : test11_recurse(depth - 1) + frame[0];
+}
+
+void test11_thread(UThread::Argument arg)
+{
+    int before = UThread::Current().StackHighWater();
+
+    test11_recurse((int) arg);
+
+    assert(UThread::Current().StackHighWater() >= before + (int) arg * 256);
+}
+
+void test11()
+{
+    UScheduler scheduler;
+
+    cout << endl << ":: Test 11 - BEGIN ::" << endl << endl;
+
+    scheduler.SetStackTracking(true);
+
+    for (int depth = 0; depth <= 64; depth += 16) {
+        UThread::Create(test11_thread, (UThread::Argument) depth);
+    }
+
+    scheduler.Run();
+
+    StackStatistics statistics = scheduler.GetStackStatistics();
+    unsigned threads = 0;
+
+    for (int i = 0; i < StackStatistics::NumBuckets; ++i) {
+        cout << "<= " << (512 << i) << " bytes: " << statistics.Threads[i] << endl;
+        threads += statistics.Threads[i];
+    }
+    cout << "max: " << statistics.MaxHighWater << " bytes" << endl;
+
+    assert(threads == 5);
+    assert(statistics.MaxHighWater >= 64 * 256);
+    cout << endl << ":: Test 11 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 12: growable stacks                                  //
+//															 //
+///////////////////////////////////////////////////////////////
+
+UThread *test12_deep;
+unsigned int test12_count;
+
+void test12_deep_thread(UThread::Argument arg)
+{
+    test12_deep = &UThread::Current();
+
+    //
+    // Four times deeper than a fixed stack allows.
+    //
+
+    test11_recurse(1024);
+
+    UThread::Park();
+    ++test12_count;
+}
+
+void test12_waker_thread(UThread::Argument arg)
+{
+    cout << "deep thread used " << test12_deep->StackHighWater() << " bytes" << endl;
+    assert(test12_deep->StackHighWater() >= 1024 * 256);
+
+    test12_deep->Unpark();
+    ++test12_count;
+}
+
+void test12()
+{
+    UScheduler scheduler;
+
+    cout << endl << ":: Test 12 - BEGIN ::" << endl << endl;
+
+    test12_count = 0;
+
+    UThread::Create(test12_deep_thread, NULL, UThread::GrowableStack);
+    UThread::Create(test12_waker_thread, NULL, UThread::GrowableStack);
+
+    scheduler.Run();
+
+    assert(test12_count == 2);
+    cout << endl << ":: Test 12 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 13: creating threads in batches                      //
+//															 //
+///////////////////////////////////////////////////////////////
+
+const int test13_num_threads = 1000;
+int test13_next;
+bool test13_in_order;
+
+void test13_thread(UThread::Argument arg)
+{
+    //
+    // Threads of a batch run in the order of their arguments.
+    //
+
+    if ((int) arg != test13_next) {
+        test13_in_order = false;
+    }
+    ++test13_next;
+
+    UThread::Yield();
+}
+
+void test13()
+{
+    UScheduler scheduler;
+    UThread::Argument arguments[test13_num_threads];
+
+    cout << endl << ":: Test 13 - BEGIN ::" << endl << endl;
+
+    test13_next = 0;
+    test13_in_order = true;
+
+    for (int i = 0; i < test13_num_threads; ++i) {
+        arguments[i] = (UThread::Argument) i;
+    }
+
+    UThread::CreateBatch(test13_thread, arguments, test13_num_threads);
+
+    scheduler.Run();
+
+    assert(test13_next == test13_num_threads);
+    assert(test13_in_order);
+    cout << endl << ":: Test 13 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 14: a bounded queue across operating system threads  //
+//															 //
+///////////////////////////////////////////////////////////////
+
+const int test14_items_per_producer = 100000;
+const int test14_num_producers = 4;
+const int test14_num_consumers = 4;
+
+BlockingBoundedQueue<int> *test14_queue;
+UScheduler *test14_schedulers[2];
+volatile LONGLONG test14_sum;
+volatile LONG test14_producers_left;
+volatile LONG test14_consumers_left;
+
+void test14_producer_thread(UThread::Argument arg)
+{
+    for (int i = 1; i <= test14_items_per_producer; ++i) {
+        test14_queue->Enqueue(i);
+    }
+
+    //
+    // The last producer ends the consumers' streams.
+    //
+
+    if (InterlockedDecrement(&test14_producers_left) == 0) {
+        for (int i = 0; i < test14_num_consumers; ++i) {
+            test14_queue->Enqueue(0);
+        }
+        test14_schedulers[0]->Stop();
+    }
+}
+
+void test14_consumer_thread(UThread::Argument arg)
+{
+    LONGLONG sum = 0;
+    int item;
+
+    //
+    // Zero marks the end of the stream.
+    //
+
+    while ((item = test14_queue->Dequeue()) != 0) {
+        sum += item;
+    }
+
+    InterlockedExchangeAdd64(&test14_sum, sum);
+    if (InterlockedDecrement(&test14_consumers_left) == 0) {
+        test14_schedulers[1]->Stop();
+    }
+}
+
+DWORD WINAPI test14_os_thread(LPVOID arg)
+{
+    ((UScheduler *) arg)->Run();
+    return 0;
+}
+
+void test14()
+{
+    HANDLE osThreads[2];
+    IdlePolicy policy;
+
+    cout << endl << ":: Test 14 - BEGIN ::" << endl << endl;
+
+    test14_queue = new BlockingBoundedQueue<int>(64);
+    test14_sum = 0;
+    test14_producers_left = test14_num_producers;
+    test14_consumers_left = test14_num_consumers;
+
+    //
+    // All the threads of a scheduler may be parked waiting for the other one, so 
+    // both schedulers stay alive until the last of their threads stops them.
+    //
+
+    policy.StayAlive = true;
+    for (int i = 0; i < 2; ++i) {
+        test14_schedulers[i] = new UScheduler();
+        test14_schedulers[i]->SetIdlePolicy(policy);
+    }
+
+    for (int i = 0; i < test14_num_producers; ++i) {
+        UThread::Create(*test14_schedulers[0], test14_producer_thread, NULL);
+    }
+    for (int i = 0; i < test14_num_consumers; ++i) {
+        UThread::Create(*test14_schedulers[1], test14_consumer_thread, NULL);
+    }
+
+    DWORD start = GetTickCount();
+
+    for (int i = 0; i < 2; ++i) {
+        osThreads[i] = CreateThread(NULL, 0, test14_os_thread, test14_schedulers[i], 0, NULL);
+    }
+
+    WaitForMultipleObjects(2, osThreads, TRUE, INFINITE);
+
+    DWORD elapsed = GetTickCount() - start;
+
+    for (int i = 0; i < 2; ++i) {
+        CloseHandle(osThreads[i]);
+        delete test14_schedulers[i];
+    }
+    delete test14_queue;
+
+    cout << test14_num_producers * test14_items_per_producer << " items in " << elapsed << " ms" << endl;
+    assert(test14_sum == (LONGLONG) test14_num_producers * test14_items_per_producer * 
+                         (test14_items_per_producer + 1) / 2);
+    cout << endl << ":: Test 14 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 15: a work-stealing deque across OS threads          //
+//															 //
+///////////////////////////////////////////////////////////////
+
+const int test15_num_items = 100000;
+const int test15_num_thieves = 4;
+
+BlockingWorkStealingDeque<volatile LONG> *test15_deque;
+volatile LONG test15_taken[test15_num_items];
+volatile LONG test15_end;
+volatile LONG test15_thieves_left;
+UScheduler *test15_schedulers[2];
+
+void test15_owner_thread(UThread::Argument arg)
+{
+    for (int i = 0; i < test15_num_items; ++i) {
+        test15_deque->Push(&test15_taken[i]);
+
+        //
+        // The owner keeps some of the work for itself.
+        //
+
+        if (i % 3 == 0) {
+            volatile LONG *item = test15_deque->Pop();
+            if (item != NULL) {
+                InterlockedIncrement(item);
+            }
+        }
+    }
+
+    for (int i = 0; i < test15_num_thieves; ++i) {
+        test15_deque->Push(&test15_end);
+    }
+}
+
+void test15_thief_thread(UThread::Argument arg)
+{
+    volatile LONG *item;
+
+    while ((item = test15_deque->Steal()) != &test15_end) {
+        InterlockedIncrement(item);
+    }
+
+    if (InterlockedDecrement(&test15_thieves_left) == 0) {
+        test15_schedulers[1]->Stop();
+    }
+}
+
+DWORD WINAPI test15_os_thread(LPVOID arg)
+{
+    ((UScheduler *) arg)->Run();
+    return 0;
+}
+
+void test15()
+{
+    HANDLE osThreads[2];
+    IdlePolicy policy;
+
+    cout << endl << ":: Test 15 - BEGIN ::" << endl << endl;
+
+    test15_deque = new BlockingWorkStealingDeque<volatile LONG>(64);
+    test15_thieves_left = test15_num_thieves;
+    for (int i = 0; i < test15_num_items; ++i) {
+        test15_taken[i] = 0;
+    }
+
+    policy.StayAlive = true;
+    for (int i = 0; i < 2; ++i) {
+        test15_schedulers[i] = new UScheduler();
+    }
+    test15_schedulers[1]->SetIdlePolicy(policy);
+
+    UThread::Create(*test15_schedulers[0], test15_owner_thread, NULL);
+    for (int i = 0; i < test15_num_thieves; ++i) {
+        UThread::Create(*test15_schedulers[1], test15_thief_thread, NULL);
+    }
+
+    DWORD start = GetTickCount();
+
+    for (int i = 0; i < 2; ++i) {
+        osThreads[i] = CreateThread(NULL, 0, test15_os_thread, test15_schedulers[i], 0, NULL);
+    }
+    WaitForMultipleObjects(2, osThreads, TRUE, INFINITE);
+
+    DWORD elapsed = GetTickCount() - start;
+
+    for (int i = 0; i < 2; ++i) {
+        CloseHandle(osThreads[i]);
+        delete test15_schedulers[i];
+    }
+    delete test15_deque;
+
+    cout << test15_num_items << " items in " << elapsed << " ms" << endl;
+    for (int i = 0; i < test15_num_items; ++i) {
+        assert(test15_taken[i] == 1);
+    }
+    cout << endl << ":: Test 15 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 16: deterministic interleavings and replay           //
+//															 //
+///////////////////////////////////////////////////////////////
+
+const int test16_num_threads = 4;
+Mutex *test16_mutex;
+int test16_counter;
+vector<int> test16_log;
+
+void test16_thread(UThread::Argument arg)
+{
+    int id = (int) arg;
+
+    for (int i = 0; i < 5; ++i) {
+
+        //
+        // A racy increment: updates get lost depending on the interleaving.
+        //
+
+        int value = test16_counter;
+        UThread::MaybeYield();
+        test16_counter = value + 1;
+        test16_log.push_back(id);
+
+        test16_mutex->Acquire();
+        test16_log.push_back(100 + id);
+        UThread::Yield();
+        test16_mutex->Release();
+    }
+}
+
+//
+// Runs the threads under a deterministic scheduler, replaying the trace if it 
+// is not empty, and returns the log of the steps they took.
+//
+
+vector<int> test16_run(unsigned seed, vector<unsigned> &trace)
+{
+    UScheduler scheduler;
+    Mutex mutex;
+
+    test16_mutex = &mutex;
+    test16_counter = 0;
+    test16_log.clear();
+
+    scheduler.SetReplay(trace, seed);
+
+    for (int i = 0; i < test16_num_threads; ++i) {
+        UThread::Create(test16_thread, (UThread::Argument) i);
+    }
+
+    scheduler.Run();
+
+    trace = scheduler.GetTrace();
+    test16_log.push_back(test16_counter);
+    return test16_log;
+}
+
+void test16()
+{
+    int distinct = 0;
+    vector<int> first;
+
+    cout << endl << ":: Test 16 - BEGIN ::" << endl << endl;
+
+    for (unsigned seed = 1; seed <= 100; ++seed) {
+        vector<unsigned> trace;
+        vector<int> log = test16_run(seed, trace);
+
+        //
+        // Replaying the trace, even with another seed, repeats the run exactly.
+        //
+
+        vector<unsigned> replayed = trace;
+        assert(test16_run(seed + 1000, replayed) == log);
+        assert(replayed == trace);
+
+        if (seed == 1) {
+            first = log;
+        } else if (log != first) {
+            ++distinct;
+        }
+    }
+
+    cout << distinct << " of 99 seeds interleaved differently from the first" << endl;
+    assert(distinct > 0);
+    cout << endl << ":: Test 16 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 17: detecting deadlocks and stuck threads            //
+//															 //
+///////////////////////////////////////////////////////////////
+
+//
+// The synchronizers outlive the test, as the deadlocked threads never leave them.
+//
+
+Mutex *test17_mutexes[2];
+Semaphore *test17_semaphore;
+
+void test17_locking_thread(UThread::Argument arg)
+{
+    int first = (int) arg;
+
+    test17_mutexes[first]->Acquire();
+    UThread::Yield();
+    test17_mutexes[1 - first]->Acquire();
+
+    assert(!"supposed to be here!");
+}
+
+void test17_semaphore_thread(UThread::Argument arg)
+{
+    test17_semaphore->Wait();
+}
+
+void test17_parked_thread(UThread::Argument arg)
+{
+    UThread::Park();
+}
+
+void test17()
+{
+    UScheduler scheduler;
+
+    cout << endl << ":: Test 17 - BEGIN ::" << endl << endl;
+
+    test17_mutexes[0] = new Mutex();
+    test17_mutexes[1] = new Mutex();
+    test17_semaphore = new Semaphore();
+
+    scheduler.SetDeadlockDetection(true);
+
+    UThread::Create(test17_locking_thread, (UThread::Argument) 0);
+    UThread::Create(test17_locking_thread, (UThread::Argument) 1);
+    UThread::Create(test17_semaphore_thread, NULL);
+    UThread::Create(test17_parked_thread, NULL);
+
+    scheduler.Run();
+
+    assert(scheduler.GetDeadlockCount() == 1);
+    assert(scheduler.GetStuckThreadCount() == 4);
+    cout << endl << ":: Test 17 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 18: dumping the scheduler's threads                  //
+//															 //
+///////////////////////////////////////////////////////////////
+
+Mutex *test18_mutex;
+UThread *test18_holder;
+bool test18_done;
+
+void test18_holder_thread(UThread::Argument arg)
+{
+    test18_holder = &UThread::Current();
+    test18_mutex->Acquire();
+    UThread::Park();
+    test18_mutex->Release();
+}
+
+void test18_waiter_thread(UThread::Argument arg)
+{
+    test18_mutex->Acquire();
+    test18_mutex->Release();
+}
+
+void test18_yielding_thread(UThread::Argument arg)
+{
+    while (!test18_done) {
+        UThread::Yield();
+    }
+}
+
+void test18_dumping_thread(UThread::Argument arg)
+{
+    UThread::Yield();
+
+    UScheduler::Current().Dump(stdout);
+
+    test18_done = true;
+    test18_holder->Unpark();
+}
+
+void test18()
+{
+    UScheduler scheduler;
+
+    cout << endl << ":: Test 18 - BEGIN ::" << endl << endl;
+
+    test18_mutex = new Mutex();
+    test18_done = false;
+
+    scheduler.SetDeadlockDetection(true);
+
+    UThread::Create(test18_holder_thread, NULL);
+    UThread::Create(test18_waiter_thread, NULL);
+    UThread::Create(test18_yielding_thread, NULL);
+    UThread::Create(test18_dumping_thread, NULL);
+
+    scheduler.Run();
+
+    delete test18_mutex;
+    cout << endl << ":: Test 18 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 19: cancelling a thread and its descendants          //
+//															 //
+///////////////////////////////////////////////////////////////
+
+Mutex *test19_mutex;
+Semaphore *test19_semaphore;
+UThread *test19_parent;
+int test19_blocked;
+int test19_cancelled;
+
+void test19_grandchild_thread(UThread::Argument arg)
+{
+    test19_blocked += 1;
+    if (!UThread::Park()) {
+        test19_cancelled += 1;
+    }
+}
+
+void test19_child_thread(UThread::Argument arg)
+{
+    UThread::Create(test19_grandchild_thread, NULL);
+
+    test19_blocked += 1;
+    if (!test19_mutex->Acquire()) {
+        test19_cancelled += 1;
+    }
+}
+
+void test19_parent_thread(UThread::Argument arg)
+{
+    test19_parent = &UThread::Current();
+    UThread::Create(test19_child_thread, NULL);
+
+    test19_blocked += 1;
+    if (!test19_semaphore->Wait()) {
+        test19_cancelled += 1;
+    }
+}
+
+void test19_owner_thread(UThread::Argument arg)
+{
+    test19_mutex->Acquire();
+    UThread::Create(test19_parent_thread, NULL);
+
+    while (test19_blocked < 3) {
+        UThread::Yield();
+    }
+
+    test19_parent->Cancel();
+
+    while (test19_cancelled < 3) {
+        UThread::Yield();
+    }
+
+    //
+    // The owner was not cancelled, so the synchronizers still work for it.
+    //
+
+    assert(!UThread::Current().IsCancelled());
+    test19_semaphore->Post();
+    bool acquired = test19_semaphore->Wait();
+    assert(acquired);
+    test19_mutex->Release();
+}
+
+void test19()
+{
+    UScheduler scheduler;
+
+    cout << endl << ":: Test 19 - BEGIN ::" << endl << endl;
+
+    test19_mutex = new Mutex();
+    test19_semaphore = new Semaphore();
+    test19_blocked = 0;
+    test19_cancelled = 0;
+
+    UThread::Create(test19_owner_thread, NULL);
+    scheduler.Run();
+
+    cout << test19_cancelled << " blocked threads cancelled" << endl;
+    assert(test19_cancelled == 3);
+
+    delete test19_semaphore;
+    delete test19_mutex;
+    cout << endl << ":: Test 19 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 20: measuring the cost of a context switch           //
+//															 //
+///////////////////////////////////////////////////////////////
+
+//
+// Each thread yields a fixed number of times, so the switches cycle through all 
+// of them. With many threads their hot state no longer fits in the first level 
+// cache, and the cycles per switch show how many cache lines a switch touches. 
+// Cache misses themselves can be sampled with a hardware event profiler, such 
+// as xperf's PMC sampling, while this test runs.
+//
+
+static const int test20_yields = 1000;
+
+void test20_thread(UThread::Argument arg)
+{
+    for (int i = 0; i < test20_yields; ++i) {
+        UThread::Yield();
+    }
+}
+
+unsigned __int64 test20_cycles_per_switch(int numThreads)
+{
+    UScheduler scheduler;
+
+    for (int i = 0; i < numThreads; ++i) {
+        UThread::Create(test20_thread, NULL);
+    }
+
+    unsigned __int64 start = __rdtsc();
+    scheduler.Run();
+    unsigned __int64 cycles = __rdtsc() - start;
+
+    return cycles / ((unsigned __int64) numThreads * test20_yields);
+}
+
+void test20()
+{
+    cout << endl << ":: Test 20 - BEGIN ::" << endl << endl;
+
+    UScheduler *heapScheduler = new UScheduler();
+    assert(((size_t) heapScheduler & (CACHE_LINE_SIZE - 1)) == 0);
+    delete heapScheduler;
+
+    for (int numThreads = 2; numThreads <= 2048; numThreads *= 4) {
+        cout << numThreads << " threads: " << test20_cycles_per_switch(numThreads) 
+             << " cycles per switch" << endl;
+    }
+
+    cout << endl << ":: Test 20 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 21: preserving floating point and SIMD state         //
+//															 //
+///////////////////////////////////////////////////////////////
+
+//
+// Two vector threads run with different SSE rounding modes, interleaved with an 
+// integer-only thread, and check that their mode survives every switch.
+//
+
+int test21_checks;
+
+void test21_vector_thread(UThread::Argument arg)
+{
+    unsigned roundingMode = (unsigned) arg;
+
+    _MM_SET_ROUNDING_MODE(roundingMode);
+
+    for (int i = 0; i < 100; ++i) {
+        UThread::Yield();
+        assert(_MM_GET_ROUNDING_MODE() == roundingMode);
+        test21_checks += 1;
+    }
+}
+
+void test21_integer_thread(UThread::Argument arg)
+{
+    for (int i = 0; i < 100; ++i) {
+        UThread::Yield();
+    }
+}
+
+void test21()
+{
+    UScheduler scheduler;
+    unsigned mainRoundingMode = _MM_GET_ROUNDING_MODE();
+
+    cout << endl << ":: Test 21 - BEGIN ::" << endl << endl;
+
+    test21_checks = 0;
+
+    UThread::Create(test21_vector_thread, (UThread::Argument) _MM_ROUND_DOWN, UThread::VectorState);
+    UThread::Create(test21_integer_thread, NULL);
+    UThread::Create(test21_vector_thread, (UThread::Argument) _MM_ROUND_TOWARD_ZERO, UThread::VectorState);
+
+    scheduler.Run();
+
+    cout << test21_checks << " rounding mode checks passed" << endl;
+    assert(test21_checks == 200);
+    assert(_MM_GET_ROUNDING_MODE() == mainRoundingMode);
+    cout << endl << ":: Test 21 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 22: submitting tasks between the shards of a runtime //
+//															 //
+///////////////////////////////////////////////////////////////
+
+Runtime *test22_runtime;
+HANDLE test22_done;
+volatile LONG test22_pending;
+volatile LONG test22_sum;
+
+void * test22_square(void *argument)
+{
+    int value = (int) argument;
+    return (void *) (value * value);
+}
+
+//
+// Each client submits its tasks to the next shard and must always be resumed 
+// on its own.
+//
+
+void test22_client_thread(UThread::Argument arg)
+{
+    int home = Runtime::CurrentShard();
+    int target = (home + 1) % test22_runtime->GetShardCount();
+    LONG sum = 0;
+
+    for (int i = 1; i <= 100; ++i) {
+        Future future = test22_runtime->SubmitTo(target, test22_square, (void *) i);
+        sum += (int) future.Get();
+        assert(Runtime::CurrentShard() == home);
+    }
+
+    InterlockedExchangeAdd(&test22_sum, sum);
+    if (InterlockedDecrement(&test22_pending) == 0) {
+        SetEvent(test22_done);
+    }
+}
+
+void test22()
+{
+    static const int numShards = 2;
+
+    cout << endl << ":: Test 22 - BEGIN ::" << endl << endl;
+
+    test22_runtime = new Runtime(numShards);
+    test22_done = CreateEvent(NULL, FALSE, FALSE, NULL);
+    test22_pending = numShards;
+    test22_sum = 0;
+
+    for (int i = 0; i < numShards; ++i) {
+        test22_runtime->Spawn(i, test22_client_thread, NULL);
+    }
+
+    WaitForSingleObject(test22_done, INFINITE);
+    CloseHandle(test22_done);
+    delete test22_runtime;
+
+    cout << "sum of squares: " << test22_sum << endl;
+    assert(test22_sum == numShards * 338350);
+    cout << endl << ":: Test 22 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 23: reclaiming shared objects at quiescent states    //
+//															 //
+///////////////////////////////////////////////////////////////
+
+//
+// A writer on one scheduler keeps replacing a shared object and retiring the 
+// old one, while readers on another scheduler read it. Reclaimed objects are 
+// only marked dead and kept aside, so a reader reaching one would notice.
+//
+
+struct Test23Node
+{
+    volatile bool Alive;
+    Test23Node *NextDead;
+};
+
+const int test23_num_updates = 10000;
+const int test23_num_readers = 4;
+
+Test23Node * volatile test23_current;
+Test23Node * volatile test23_dead;
+volatile LONG test23_reclaimed;
+volatile bool test23_done;
+
+void test23_reclaim(void *object)
+{
+    Test23Node *node = (Test23Node *) object;
+    Test23Node *head;
+
+    node->Alive = false;
+    do {
+        head = test23_dead;
+        node->NextDead = head;
+    } while (InterlockedCompareExchangePointer((PVOID volatile *) &test23_dead, node, head) != head);
+
+    InterlockedIncrement(&test23_reclaimed);
+}
+
+void test23_writer_thread(UThread::Argument arg)
+{
+    for (int i = 0; i < test23_num_updates; ++i) {
+        Test23Node *node = new Test23Node();
+        node->Alive = true;
+
+        Test23Node *old = (Test23Node *) InterlockedExchangePointer((PVOID volatile *) &test23_current, node);
+        Reclaimer::Retire(old, test23_reclaim);
+        UThread::Yield();
+    }
+
+    test23_done = true;
+}
+
+void test23_reader_thread(UThread::Argument arg)
+{
+    while (!test23_done) {
+        Test23Node *node = test23_current;
+        assert(node->Alive);
+        UThread::Yield();
+    }
+}
+
+DWORD WINAPI test23_os_thread(LPVOID arg)
+{
+    ((UScheduler *) arg)->Run();
+    return 0;
+}
+
+void test23()
+{
+    UScheduler *schedulers[2];
+    HANDLE osThreads[2];
+
+    cout << endl << ":: Test 23 - BEGIN ::" << endl << endl;
+
+    test23_current = new Test23Node();
+    test23_current->Alive = true;
+    test23_dead = NULL;
+    test23_reclaimed = 0;
+    test23_done = false;
+
+    for (int i = 0; i < 2; ++i) {
+        schedulers[i] = new UScheduler();
+    }
+
+    UThread::Create(*schedulers[0], test23_writer_thread, NULL);
+    for (int i = 0; i < test23_num_readers; ++i) {
+        UThread::Create(*schedulers[1], test23_reader_thread, NULL);
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        osThreads[i] = CreateThread(NULL, 0, test23_os_thread, schedulers[i], 0, NULL);
+    }
+
+    WaitForMultipleObjects(2, osThreads, TRUE, INFINITE);
+
+    for (int i = 0; i < 2; ++i) {
+        CloseHandle(osThreads[i]);
+        delete schedulers[i];
+    }
+
+    cout << test23_reclaimed << " of " << test23_num_updates << " retired objects reclaimed" << endl;
+    assert(test23_reclaimed > 0);
+
+    while (test23_dead != NULL) {
+        Test23Node *node = test23_dead;
+        test23_dead = node->NextDead;
+        delete node;
+    }
+
+    cout << endl << ":: Test 23 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 24: actors passing messages in a ring                //
+//															 //
+///////////////////////////////////////////////////////////////
+
+//
+// A token carrying a hop count travels a ring of actors, each forwarding it to 
+// the next, while a large number of other actors sits idle after handling a 
+// single message each. Only active actors hold a user thread, so the sender 
+// yields every few messages to let the activations run and exit.
+//
+
+const int test24_ring_size = 1000;
+const int test24_num_hops = 100000;
+const int test24_num_idle = 100000;
+const int test24_send_burst = 100;
+
+class Test24Actor : public Actor<int>
+{
+public:
+    Test24Actor *Next;
+    int Received;
+
+    explicit Test24Actor(UScheduler &scheduler)
+        : Actor<int>(scheduler, 8),
+          Next(NULL),
+          Received(0)
+    { }
+
+protected:
+
+    void Receive(int &hops)
+    {
+        ++Received;
+        if (Next != NULL && hops > 0) {
+            Next->Send(hops - 1);
+        }
+    }
+};
+
+void test24_sender_thread(UThread::Argument arg)
+{
+    vector<Test24Actor *> &actors = *(vector<Test24Actor *> *) arg;
+
+    for (size_t i = 0; i < actors.size(); ++i) {
+        actors[i]->Send(0);
+        if (i % test24_send_burst == test24_send_burst - 1) {
+            UThread::Yield();
+        }
+    }
+}
+
+void test24()
+{
+    UScheduler scheduler;
+    vector<Test24Actor *> ring;
+    vector<Test24Actor *> idle;
+    int received = 0;
+
+    cout << endl << ":: Test 24 - BEGIN ::" << endl << endl;
+
+    for (int i = 0; i < test24_ring_size; ++i) {
+        ring.push_back(new Test24Actor(scheduler));
+    }
+    for (int i = 0; i < test24_ring_size; ++i) {
+        ring[i]->Next = ring[(i + 1) % test24_ring_size];
+    }
+    for (int i = 0; i < test24_num_idle; ++i) {
+        idle.push_back(new Test24Actor(scheduler));
+    }
+
+    ring[0]->Send(test24_num_hops);
+    UThread::Create(scheduler, test24_sender_thread, &idle);
+
+    scheduler.Run();
+
+    for (int i = 0; i < test24_ring_size; ++i) {
+        assert(ring[i]->IsIdle());
+        received += ring[i]->Received;
+        delete ring[i];
+    }
+    assert(received == test24_num_hops + 1);
+
+    for (int i = 0; i < test24_num_idle; ++i) {
+        assert(idle[i]->IsIdle() && idle[i]->Received == 1);
+        delete idle[i];
+    }
+
+    cout << received << " messages passed around the ring, " << test24_num_idle 
+         << " idle actors" << endl;
+    cout << endl << ":: Test 24 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 25: rate limiters and concurrency gates              //
+//															 //
+///////////////////////////////////////////////////////////////
+
+//
+// Threads draw tokens from a token bucket faster than it refills, queue up in a 
+// leaky bucket whose queue overflows, and go through a concurrency gate. The 
+// waiting threads are released by the scheduler's timers.
+//
+
+const int test25_num_threads = 5;
+const int test25_tokens_per_thread = 20;
+
+TokenBucket *test25_bucket;
+LeakyBucket *test25_leaky;
+ConcurrencyLimit *test25_gate;
+vector<int> test25_order;
+int test25_rejected;
+int test25_in_flight;
+int test25_max_in_flight;
+
+void test25_sleep_thread(UThread::Argument arg)
+{
+    bool slept = UThread::Sleep((int) arg);
+    assert(slept);
+}
+
+void test25_bucket_thread(UThread::Argument arg)
+{
+    for (int i = 0; i < test25_tokens_per_thread; ++i) {
+        bool acquired = test25_bucket->Acquire();
+        assert(acquired);
+    }
+}
+
+void test25_leaky_thread(UThread::Argument arg)
+{
+    if (test25_leaky->Acquire()) {
+        test25_order.push_back((int) arg);
+    } else {
+        test25_rejected += 1;
+    }
+}
+
+void test25_gate_thread(UThread::Argument arg)
+{
+    bool acquired = test25_gate->Acquire();
+    assert(acquired);
+
+    __int64 start = UScheduler::Now();
+
+    test25_in_flight += 1;
+    if (test25_in_flight > test25_max_in_flight) {
+        test25_max_in_flight = test25_in_flight;
+    }
+
+    UThread::Sleep(5);
+    test25_in_flight -= 1;
+    test25_gate->Release(UScheduler::Now() - start);
+}
+
+void test25_semaphore_thread(UThread::Argument arg)
+{
+    Semaphore semaphore(0, 1);
+
+    bool posted = semaphore.TryPost();
+    assert(posted);
+    posted = semaphore.TryPost();
+    assert(!posted);
+}
+
+void test25()
+{
+    UScheduler scheduler;
+    __int64 start;
+    int elapsed;
+
+    cout << endl << ":: Test 25 - BEGIN ::" << endl << endl;
+
+    //
+    // Sleeping parks the thread until the scheduler's timer expires.
+    //
+
+    start = UScheduler::Now();
+    UThread::Create(scheduler, test25_sleep_thread, (UThread::Argument) 20);
+    scheduler.Run();
+    elapsed = (int) ((UScheduler::Now() - start) / 1000);
+    cout << "slept for " << elapsed << " ms" << endl;
+    assert(elapsed >= 20);
+
+    //
+    // 1000 tokens per second with a burst of 10: 100 tokens take at least 90 ms.
+    //
+
+    test25_bucket = new TokenBucket(1000, 10);
+    start = UScheduler::Now();
+    for (int i = 0; i < test25_num_threads; ++i) {
+        UThread::Create(scheduler, test25_bucket_thread, NULL);
+    }
+    scheduler.Run();
+    elapsed = (int) ((UScheduler::Now() - start) / 1000);
+    cout << test25_num_threads * test25_tokens_per_thread << " tokens in " << elapsed << " ms" << endl;
+    assert(elapsed >= 89);
+    delete test25_bucket;
+
+    //
+    // The first thread passes, the next three wait in line and are let through in 
+    // order, and the last one finds the queue full.
+    //
+
+    test25_leaky = new LeakyBucket(200, 3);
+    test25_rejected = 0;
+    for (int i = 0; i < test25_num_threads; ++i) {
+        UThread::Create(scheduler, test25_leaky_thread, (UThread::Argument) i);
+    }
+    scheduler.Run();
+    assert(test25_rejected == 1 && test25_order.size() == 4);
+    for (int i = 0; i < 4; ++i) {
+        assert(test25_order[i] == i);
+    }
+    delete test25_leaky;
+
+    //
+    // A fixed gate holds the calls in flight to its limit.
+    //
+
+    test25_gate = new ConcurrencyLimit(2);
+    test25_in_flight = 0;
+    test25_max_in_flight = 0;
+    for (int i = 0; i < test25_num_threads; ++i) {
+        UThread::Create(scheduler, test25_gate_thread, NULL);
+    }
+    scheduler.Run();
+    cout << "at most " << test25_max_in_flight << " calls in flight" << endl;
+    assert(test25_max_in_flight == 2);
+    delete test25_gate;
+
+    //
+    // An adaptive gate backs off when calls are slower than the target latency.
+    //
+
+    AimdPolicy policy;
+    policy.Minimum = 1;
+    policy.Maximum = 10;
+    policy.TargetLatency = 1000;
+
+    test25_gate = new ConcurrencyLimit(8, policy);
+    test25_in_flight = 0;
+    test25_max_in_flight = 0;
+    for (int i = 0; i < test25_num_threads; ++i) {
+        UThread::Create(scheduler, test25_gate_thread, NULL);
+    }
+    scheduler.Run();
+    cout << "adaptive limit backed off to " << test25_gate->GetLimit() << endl;
+    assert(test25_gate->GetLimit() < 8);
+    delete test25_gate;
+
+    //
+    // A bounded semaphore discards the permits over its maximum.
+    //
+
+    UThread::Create(scheduler, test25_semaphore_thread, NULL);
+    scheduler.Run();
+
+    cout << endl << ":: Test 25 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 26: a pipeline of stages with backpressure           //
+//															 //
+///////////////////////////////////////////////////////////////
+
+//
+// A producer feeds numbers to a pipeline that doubles them, keeps the multiples 
+// of three and sums them in a slow last stage. The small queues fill up, so the 
+// earlier stages park instead of running ahead.
+//
+
+const int test26_num_items = 100000;
+
+Pipeline *test26_pipeline;
+LONGLONG test26_sum;
+
+void test26_double(void *context, void *items[], int count, Pipeline::Output &output)
+{
+    for (int i = 0; i < count; ++i) {
+        output.Emit((void *) ((int) items[i] * 2));
+    }
+}
+
+void test26_filter(void *context, void *items[], int count, Pipeline::Output &output)
+{
+    for (int i = 0; i < count; ++i) {
+        if ((int) items[i] % 3 == 0) {
+            output.Emit(items[i]);
+        }
+    }
+}
+
+void test26_sum_items(void *context, void *items[], int count, Pipeline::Output &output)
+{
+    for (int i = 0; i < count; ++i) {
+        test26_sum += (int) items[i];
+    }
+    UThread::Yield();
+}
+
+void test26_producer_thread(UThread::Argument arg)
+{
+    for (int i = 1; i <= test26_num_items; ++i) {
+        test26_pipeline->Push((void *) i);
+    }
+    test26_pipeline->Close();
+    test26_pipeline->Wait();
+}
+
+void test26()
+{
+    UScheduler scheduler;
+    LONGLONG expected = 0;
+
+    cout << endl << ":: Test 26 - BEGIN ::" << endl << endl;
+
+    for (int i = 1; i <= test26_num_items; ++i) {
+        if (i * 2 % 3 == 0) {
+            expected += i * 2;
+        }
+    }
+
+    test26_sum = 0;
+    test26_pipeline = new Pipeline();
+    test26_pipeline->AddStage("double", test26_double, NULL, 2, 64, 16)
+                    .AddStage("filter", test26_filter, NULL, 2, 64, 16)
+                    .AddStage("sum", test26_sum_items, NULL, 1, 16, 8);
+
+    test26_pipeline->Start(scheduler);
+    UThread::Create(scheduler, test26_producer_thread, NULL);
+    scheduler.Run();
+
+    for (int i = 0; i < test26_pipeline->GetStageCount(); ++i) {
+        StageMetrics metrics = test26_pipeline->GetMetrics(i);
+
+        cout << metrics.Name << ": " << metrics.ItemsIn << " in, " << metrics.ItemsOut 
+             << " out, " << metrics.Batches << " batches, " << metrics.Stalls << " stalls, " 
+             << metrics.QueueDepth << "/" << metrics.QueueCapacity << " queued, " 
+             << metrics.ItemsIn * 1000000 / (metrics.ElapsedMicroseconds + 1) << " items/s" << endl;
+        assert(metrics.QueueDepth == 0);
+    }
+
+    assert(test26_pipeline->GetMetrics(0).ItemsIn == test26_num_items);
+    assert(test26_pipeline->GetMetrics(0).Stalls > 0);
+    assert(test26_sum == expected);
+    delete test26_pipeline;
+
+    cout << endl << ":: Test 26 - END ::" << endl;
+}
+
+///////////////////////////////////////////////////////////////
+//															 //
+// Test 27: passing pooled buffers between schedulers        //
+//															 //
+///////////////////////////////////////////////////////////////
+
+//
+// A producer fills buffers from a small pool and passes them by pointer to a 
+// consumer on another scheduler, which releases them back to the pool. With 
+// fewer buffers than messages, the producer parks until buffers come back. The 
+// producer then writes a buffer to a file and reads it back into another one.
+//
+
+const int test27_num_messages = 10000;
+const int test27_num_buffers = 8;
+
+BufferPool *test27_pool;
+BlockingBoundedQueue<Buffer *> *test27_queue;
+UScheduler *test27_schedulers[2];
+volatile LONG test27_received;
+
+void test27_producer_thread(UThread::Argument arg)
+{
+    Buffer *buffers[test27_num_buffers];
+
+    for (int i = 0; i < test27_num_messages; ++i) {
+        Buffer *buffer = test27_pool->Allocate();
+
+        buffer->SetLength(sprintf_s((char *) buffer->Data(), buffer->Capacity(), "message %d", i));
+        test27_queue->Enqueue(buffer);
+    }
+    test27_queue->Enqueue(NULL);
+
+    //
+    // Getting every buffer back means the consumer released them all.
+    //
+
+    for (int i = 0; i < test27_num_buffers; ++i) {
+        buffers[i] = test27_pool->Allocate();
+    }
+
+    HANDLE file = CreateFileA("test27.tmp", GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 
+                              FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    assert(file != INVALID_HANDLE_VALUE);
+
+    buffers[0]->SetLength(sprintf_s((char *) buffers[0]->Data(), buffers[0]->Capacity(), "first "));
+    buffers[1]->SetLength(sprintf_s((char *) buffers[1]->Data(), buffers[1]->Capacity(), "second"));
+
+    int written = BufferIo::Write(file, buffers, 2);
+    assert(written == 12);
+
+    SetFilePointer(file, 0, NULL, FILE_BEGIN);
+    int read = BufferIo::Read(file, buffers[2]);
+    assert(read == 12 && memcmp(buffers[2]->Data(), "first second", 12) == 0);
+    CloseHandle(file);
+
+    for (int i = 0; i < test27_num_buffers; ++i) {
+        buffers[i]->Release();
+    }
+
+    test27_schedulers[0]->Stop();
+}
+
+void test27_consumer_thread(UThread::Argument arg)
+{
+    Buffer *buffer;
+    char expected[64];
+
+    while ((buffer = test27_queue->Dequeue()) != NULL) {
+        int length = sprintf_s(expected, sizeof(expected), "message %d", test27_received);
+
+        assert(buffer->Length() == length && memcmp(buffer->Data(), expected, length) == 0);
+        test27_received += 1;
+        buffer->Release();
+    }
+
+    test27_schedulers[1]->Stop();
+}
+
+DWORD WINAPI test27_os_thread(LPVOID arg)
+{
+    ((UScheduler *) arg)->Run();
+    return 0;
+}
+
+void test27()
+{
+    HANDLE osThreads[2];
+    IdlePolicy policy;
+
+    cout << endl << ":: Test 27 - BEGIN ::" << endl << endl;
+
+    policy.StayAlive = true;
+    for (int i = 0; i < 2; ++i) {
+        test27_schedulers[i] = new UScheduler();
+        test27_schedulers[i]->SetIdlePolicy(policy);
+    }
+
+    test27_pool = new BufferPool(*test27_schedulers[0], 64, test27_num_buffers);
+    test27_queue = new BlockingBoundedQueue<Buffer *>(4);
+    test27_received = 0;
+
+    UThread::Create(*test27_schedulers[0], test27_producer_thread, NULL);
+    UThread::Create(*test27_schedulers[1], test27_consumer_thread, NULL);
+
+    for (int i = 0; i < 2; ++i) {
+        osThreads[i] = CreateThread(NULL, 0, test27_os_thread, test27_schedulers[i], 0, NULL);
+    }
+
+    WaitForMultipleObjects(2, osThreads, TRUE, INFINITE);
+
+    for (int i = 0; i < 2; ++i) {
+        CloseHandle(osThreads[i]);
+        delete test27_schedulers[i];
+    }
+    delete test27_queue;
+    delete test27_pool;
+
+    cout << test27_received << " messages through " << test27_num_buffers << " buffers" << endl;
+    assert(test27_received == test27_num_messages);
+    cout << endl << ":: Test 27 - END ::" << endl;
+}
+
 int main (
     )
 {
     test1();
     test2();
     test3();
+    test4();
+    test5();
+    test6();
+    test7();
+    test8();
+    test9();
+    test10();
+    test11();
+    test12();
+    test13();
+    test14();
+    test15();
+    test16();
+    test17();
+    test18();
+    test19();
+    test20();
+    test21();
+    test22();
+    test23();
+    test24();
+    test25();
+    test26();
+    test27();
 
     getchar();
     return 0;
@@ -0,0 +1,208 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+
+#include <cassert>
+#include "RateLimiter.h"
+
+//
+// Creates a limiter whose bucket starts full.
+//
+
+RateLimiter::RateLimiter(int ratePerSecond, int burst, int maxWaiters, const AimdPolicy *policy)
+    : m_credit((__int64) burst * m_unit),
+      m_maxCredit((__int64) burst * m_unit),
+      m_rate(ratePerSecond),
+      m_lastRefill(UScheduler::Now()),
+      m_waitList(),
+      m_numWaiters(0),
+      m_maxWaiters(maxWaiters),
+      m_pScheduler(NULL),
+      m_adaptive(policy != NULL),
+      m_adaptiveRate(ratePerSecond, policy != NULL ? *policy : AimdPolicy())
+{
+    assert(ratePerSecond > 0 && burst > 0);
+
+    m_timer.Expired = release_waiters;
+    m_timer.Context = this;
+}
+
+//
+// The RateLimiter destructor.
+//
+
+RateLimiter::~RateLimiter()
+{
+    assert(m_waitList.empty());
+}
+
+//
+// Takes a token, or waits in line for one. The thread is released by the timer, 
+// which removes it from the wait list. A pending park permit may wake the thread 
+// earlier, so it parks again while it is still waiting.
+//
+
+bool RateLimiter::Acquire()
+{
+    PreemptionGuard guard;
+    UThread &currentThread = UThread::Current();
+
+    refill(UScheduler::Now());
+
+    if (m_waitList.empty() && m_credit >= m_unit) {
+        m_credit -= m_unit;
+        return true;
+    }
+
+    if (currentThread.IsCancelled() || m_numWaiters >= m_maxWaiters) {
+        return false;
+    }
+
+    m_waitList.push_back(&currentThread);
+    m_numWaiters += 1;
+
+    if (!UScheduler::IsTimerSet(&m_timer)) {
+        set_timer();
+    }
+
+    while (UThread::WaitList::linked(&currentThread)) {
+        if (!UThread::Park() && UThread::WaitList::linked(&currentThread)) {
+            m_waitList.remove(&currentThread);
+            m_numWaiters -= 1;
+            if (m_waitList.empty()) {
+                m_pScheduler->CancelTimer(&m_timer);
+            }
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//
+// Takes a token if one is available and no thread is waiting.
+//
+
+bool RateLimiter::TryAcquire()
+{
+    PreemptionGuard guard;
+
+    refill(UScheduler::Now());
+
+    if (m_waitList.empty() && m_credit >= m_unit) {
+        m_credit -= m_unit;
+        return true;
+    }
+
+    return false;
+}
+
+//
+// Changes the rate. The credit accrued so far is kept, and the timer is set 
+// again for the new rate.
+//
+
+void RateLimiter::SetRate(int ratePerSecond)
+{
+    PreemptionGuard guard;
+
+    assert(ratePerSecond > 0);
+
+    refill(UScheduler::Now());
+    m_rate = ratePerSecond;
+
+    if (UScheduler::IsTimerSet(&m_timer)) {
+        m_pScheduler->CancelTimer(&m_timer);
+        set_timer();
+    }
+}
+
+//
+// Reports the latency of a call, adapting the rate if the limiter is adaptive.
+//
+
+void RateLimiter::Sample(__int64 latencyMicroseconds)
+{
+    if (m_adaptive && m_adaptiveRate.Sample(latencyMicroseconds)) {
+        SetRate(m_adaptiveRate.Current());
+    }
+}
+
+//
+// Adds the credit accrued since the last refill, up to the maximum. Long idle 
+// periods are clamped before multiplying, so the credit cannot overflow.
+//
+
+void RateLimiter::refill(__int64 now)
+{
+    __int64 elapsed = now - m_lastRefill;
+    __int64 missing = m_maxCredit - m_credit;
+
+    m_lastRefill = now;
+
+    if (elapsed <= 0 || missing <= 0) {
+        return;
+    }
+
+    if (elapsed >= missing / m_rate + 1) {
+        m_credit = m_maxCredit;
+    } else {
+        m_credit += elapsed * m_rate;
+        if (m_credit > m_maxCredit) {
+            m_credit = m_maxCredit;
+        }
+    }
+}
+
+//
+// Sets the timer to when the credit reaches a whole token, on the scheduler of 
+// the calling thread.
+//
+
+void RateLimiter::set_timer()
+{
+    UScheduler &scheduler = UScheduler::Current();
+
+    assert(m_pScheduler == NULL || m_pScheduler == &scheduler);
+    m_pScheduler = &scheduler;
+
+    __int64 missing = m_unit - m_credit;
+    __int64 delay = missing <= 0 ? 0 : (missing + m_rate - 1) / m_rate;
+
+    scheduler.SetTimer(&m_timer, m_lastRefill + delay);
+}
+
+//
+// Hands a token to each waiting thread, in order, while there is credit, and 
+// sets the timer again if threads are still waiting.
+//
+
+void RateLimiter::release_waiters(SchedulerTimer *timer)
+{
+    RateLimiter *limiter = (RateLimiter *) timer->Context;
+
+    limiter->refill(UScheduler::Now());
+
+    while (!limiter->m_waitList.empty() && limiter->m_credit >= m_unit) {
+        limiter->m_credit -= m_unit;
+        limiter->m_numWaiters -= 1;
+        limiter->m_waitList.pop_front()->Unpark();
+    }
+
+    if (!limiter->m_waitList.empty()) {
+        limiter->set_timer();
+    }
+}
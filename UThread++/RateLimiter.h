@@ -0,0 +1,184 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+
+#pragma once
+
+#include "AimdLimit.h"
+#include "UScheduler.h"
+#include "UThread.h"
+
+//
+// The base of the rate limiters: a token bucket that accrues rate tokens per 
+// second up to a burst, with a FIFO of the threads waiting for tokens. Waiting 
+// threads are released by a timer of the scheduler set to when the next token 
+// accrues, so no thread polls. Like Mutex and Semaphore, an instance is used by 
+// the threads of one scheduler.
+//
+// When adaptive, the rate follows an AimdLimit fed with the latencies passed to 
+// Sample().
+//
+
+class RateLimiter
+{
+    //
+    // Tokens are counted in millionths, so that accruing rate tokens per second 
+    // adds rate units every microsecond, in integer arithmetic.
+    //
+
+    static const __int64 m_unit = 1000000;
+
+    //
+    // The available credit, its maximum, the rate in tokens per second and when 
+    // credit last accrued.
+    //
+
+    __int64 m_credit;
+    __int64 m_maxCredit;
+    int m_rate;
+    __int64 m_lastRefill;
+
+    //
+    // The threads waiting for tokens, their number and how many may wait.
+    //
+
+    UThread::WaitList m_waitList;
+    int m_numWaiters;
+    int m_maxWaiters;
+
+    //
+    // The timer that releases waiting threads and the scheduler it is set on.
+    //
+
+    SchedulerTimer m_timer;
+    UScheduler *m_pScheduler;
+
+    //
+    // Whether the rate adapts, and the limit it follows.
+    //
+
+    bool m_adaptive;
+    AimdLimit m_adaptiveRate;
+
+public:
+
+    //
+    // Takes a token, waiting in line behind the threads already waiting. Returns 
+    // false, without a token, if the thread is cancelled or too many threads are 
+    // already waiting.
+    //
+
+    bool Acquire();
+
+    //
+    // Takes a token if one is available and no thread is waiting.
+    //
+
+    bool TryAcquire();
+
+    //
+    // Returns the rate, in tokens per second.
+    //
+
+    int GetRate() const
+    {
+        return m_rate;
+    }
+
+    //
+    // Changes the rate, in tokens per second, which must be positive.
+    //
+
+    void SetRate(int ratePerSecond);
+
+    //
+    // Reports the latency of a call made with a token, adapting the rate if the 
+    // limiter is adaptive.
+    //
+
+    void Sample(__int64 latencyMicroseconds);
+
+protected:
+
+    //
+    // Creates a limiter with the specified rate and burst, in tokens, that lets at 
+    // most maxWaiters threads wait. The rate adapts when a policy is specified.
+    //
+
+    RateLimiter(int ratePerSecond, int burst, int maxWaiters, const AimdPolicy *policy);
+
+    ~RateLimiter();
+
+private:
+
+    //
+    // Adds the credit accrued since the last refill.
+    //
+
+    void refill(__int64 now);
+
+    //
+    // Sets the timer to when the first waiting thread gets its token.
+    //
+
+    void set_timer();
+
+    //
+    // The timer callback, which hands the accrued tokens to the waiting threads.
+    //
+
+    static void release_waiters(SchedulerTimer *timer);
+
+    RateLimiter(const RateLimiter &);
+    RateLimiter & operator =(const RateLimiter &);
+};
+
+//
+// A token bucket: calls are let through at the rate on average, in bursts of up 
+// to burst calls after a quiet period. Any number of threads may wait.
+//
+
+class TokenBucket : public RateLimiter
+{
+public:
+
+    TokenBucket(int ratePerSecond, int burst)
+        : RateLimiter(ratePerSecond, burst, INT_MAX, NULL)
+    { }
+
+    TokenBucket(int ratePerSecond, int burst, const AimdPolicy &policy)
+        : RateLimiter(ratePerSecond, burst, INT_MAX, &policy)
+    { }
+};
+
+//
+// A leaky bucket used as a queue: calls are let through evenly spaced at the 
+// rate, with no bursts, and at most capacity threads wait in line. Acquire() 
+// fails at once when the queue is full.
+//
+
+class LeakyBucket : public RateLimiter
+{
+public:
+
+    LeakyBucket(int ratePerSecond, int capacity)
+        : RateLimiter(ratePerSecond, 1, capacity, NULL)
+    { }
+
+    LeakyBucket(int ratePerSecond, int capacity, const AimdPolicy &policy)
+        : RateLimiter(ratePerSecond, 1, capacity, &policy)
+    { }
+};
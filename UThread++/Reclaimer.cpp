@@ -0,0 +1,270 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+#include <cassert>
+#include <windows.h>
+
+//
+// WinBase.h defines Yield() as an empty macro.
+//
+
+#undef Yield
+
+#include "Reclaimer.h"
+#include "UScheduler.h"
+
+//
+// Static members.
+//
+
+Reclaimer::Slot Reclaimer::m_slots[Reclaimer::m_maxSchedulers];
+volatile long Reclaimer::m_globalEpoch = 1;
+RetireBatch * Reclaimer::m_pOrphans = NULL;
+volatile long Reclaimer::m_orphansLock = 0;
+
+//
+// Retires the object in the current scheduler's open batch, sealing the batch 
+// when it fills up.
+//
+
+void Reclaimer::Retire(void *object, Deleter deleter)
+{
+    PreemptionGuard guard;
+    UScheduler *scheduler = &UScheduler::Current();
+    RetireBatch *batch = scheduler->m_pOpenBatch;
+
+    assert(scheduler->m_pEpochSlot != NULL);
+
+    if (batch == NULL) {
+        batch = scheduler->m_pOpenBatch = new RetireBatch;
+        batch->Count = 0;
+    }
+
+    batch->Objects[batch->Count] = object;
+    batch->Deleters[batch->Count] = deleter;
+    batch->Count += 1;
+
+    if (batch->Count == RetireBatch::Capacity) {
+        seal(scheduler);
+        reclaim(scheduler);
+    }
+}
+
+//
+// Takes a free slot and announces the current epoch in it.
+//
+
+void Reclaimer::register_scheduler(UScheduler *scheduler)
+{
+    for (int i = 0; i < m_maxSchedulers; ++i) {
+        if (m_slots[i].InUse == 0 && InterlockedCompareExchange(&m_slots[i].InUse, 1, 0) == 0) {
+            //
+            // Announcing a nonzero epoch is what makes oldest_epoch() count the 
+            // slot, so the store must be visible before any of the scheduler's 
+            // threads reads a shared object.
+            //
+
+            InterlockedExchange(&m_slots[i].Epoch, m_globalEpoch);
+            scheduler->m_pEpochSlot = &m_slots[i].Epoch;
+            scheduler->m_reclaimCountdown = m_reclaimInterval;
+            return;
+        }
+    }
+
+    assert(!"too many schedulers running");
+}
+
+//
+// Seals the open batch and frees the sealed batches that are safe to free. The 
+// remaining ones are handed to the schedulers still running, through the 
+// orphans list, before the slot is released.
+//
+
+void Reclaimer::unregister_scheduler(UScheduler *scheduler)
+{
+    if (scheduler->m_pEpochSlot == NULL) {
+        return;
+    }
+
+    if (scheduler->m_pOpenBatch != NULL) {
+        seal(scheduler);
+    }
+
+    //
+    // The scheduler is quiescent: none of its threads is running.
+    //
+
+    *scheduler->m_pEpochSlot = m_globalEpoch;
+    reclaim(scheduler);
+
+    if (scheduler->m_pSealedBatches != NULL) {
+        while (InterlockedExchange(&m_orphansLock, 1) != 0) {
+            SwitchToThread();
+        }
+
+        scheduler->m_pLastSealedBatch->Next = m_pOrphans;
+        m_pOrphans = scheduler->m_pSealedBatches;
+        InterlockedExchange(&m_orphansLock, 0);
+
+        scheduler->m_pSealedBatches = NULL;
+        scheduler->m_pLastSealedBatch = NULL;
+    }
+
+    Slot *slot = (Slot *) scheduler->m_pEpochSlot;
+    scheduler->m_pEpochSlot = NULL;
+    slot->Epoch = 0;
+    InterlockedExchange(&slot->InUse, 0);
+}
+
+//
+// Announces the current global epoch if it changed, and every m_reclaimInterval 
+// switches tries to free the sealed batches.
+//
+
+void Reclaimer::quiescent(UScheduler *scheduler)
+{
+    long epoch = m_globalEpoch;
+
+    if (*scheduler->m_pEpochSlot != epoch) {
+        *scheduler->m_pEpochSlot = epoch;
+    }
+
+    if ((scheduler->m_pSealedBatches != NULL || m_pOrphans != NULL) && 
+        --scheduler->m_reclaimCountdown <= 0) {
+        reclaim(scheduler);
+    }
+}
+
+//
+// Takes the scheduler offline while it blocks waiting for work. None of its 
+// threads runs meanwhile, so it cannot hold references.
+//
+
+void Reclaimer::offline(UScheduler *scheduler)
+{
+    if (scheduler->m_pEpochSlot != NULL) {
+        *scheduler->m_pEpochSlot = 0;
+    }
+}
+
+//
+// Brings the scheduler back online at the current epoch. The exchange orders 
+// the announcement before any read of shared objects by its threads.
+//
+
+void Reclaimer::online(UScheduler *scheduler)
+{
+    if (scheduler->m_pEpochSlot != NULL) {
+        InterlockedExchange(scheduler->m_pEpochSlot, m_globalEpoch);
+    }
+}
+
+//
+// Seals the open batch by advancing the global epoch: its objects were all 
+// unlinked before the new epoch was published, so a scheduler that announces 
+// it has passed a quiescent state since.
+//
+
+void Reclaimer::seal(UScheduler *scheduler)
+{
+    RetireBatch *batch = scheduler->m_pOpenBatch;
+
+    scheduler->m_pOpenBatch = NULL;
+    batch->Next = NULL;
+    batch->Epoch = InterlockedIncrement(&m_globalEpoch);
+
+    if (scheduler->m_pSealedBatches == NULL) {
+        scheduler->m_pSealedBatches = batch;
+    } else {
+        scheduler->m_pLastSealedBatch->Next = batch;
+    }
+    scheduler->m_pLastSealedBatch = batch;
+}
+
+//
+// Frees the sealed batches whose epoch every online scheduler has reached. 
+// The scheduler's batches are in sealing order, so it stops at the first one 
+// that is not safe yet. Orphaned batches are taken whole when the lock is free.
+//
+
+void Reclaimer::reclaim(UScheduler *scheduler)
+{
+    long oldest = oldest_epoch();
+
+    scheduler->m_reclaimCountdown = m_reclaimInterval;
+
+    while (scheduler->m_pSealedBatches != NULL && scheduler->m_pSealedBatches->Epoch <= oldest) {
+        RetireBatch *batch = scheduler->m_pSealedBatches;
+
+        scheduler->m_pSealedBatches = batch->Next;
+        free_batch(batch);
+    }
+
+    if (scheduler->m_pSealedBatches == NULL) {
+        scheduler->m_pLastSealedBatch = NULL;
+    }
+
+    if (m_pOrphans != NULL && InterlockedExchange(&m_orphansLock, 1) == 0) {
+        RetireBatch **link = &m_pOrphans;
+
+        while (*link != NULL) {
+            RetireBatch *batch = *link;
+
+            if (batch->Epoch <= oldest) {
+                *link = batch->Next;
+                free_batch(batch);
+            } else {
+                link = &batch->Next;
+            }
+        }
+
+        InterlockedExchange(&m_orphansLock, 0);
+    }
+}
+
+//
+// Returns the oldest epoch announced by an online scheduler. A scheduler that 
+// goes online meanwhile announces the current epoch, which is not older than 
+// any sealed batch, so missing it is harmless.
+//
+
+long Reclaimer::oldest_epoch()
+{
+    long oldest = m_globalEpoch;
+
+    for (int i = 0; i < m_maxSchedulers; ++i) {
+        long epoch = m_slots[i].Epoch;
+
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    return oldest;
+}
+
+//
+// Calls the deleters of the batch and frees it.
+//
+
+void Reclaimer::free_batch(RetireBatch *batch)
+{
+    for (int i = 0; i < batch->Count; ++i) {
+        batch->Deleters[i](batch->Objects[i]);
+    }
+
+    delete batch;
+}
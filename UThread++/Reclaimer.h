@@ -0,0 +1,170 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+#pragma once
+
+#include "CacheLine.h"
+
+class UScheduler;
+
+//
+// A batch of retired objects, with the deleter of each. Once sealed, Epoch is 
+// the global epoch its objects were retired before.
+//
+
+struct RetireBatch
+{
+    static const int Capacity = 64;
+
+    RetireBatch *Next;
+    long Epoch;
+    int Count;
+    void *Objects[Capacity];
+    void (*Deleters[Capacity])(void *object);
+};
+
+//
+// Quiescent-state-based reclamation for lock-free structures shared between 
+// schedulers. A user thread must not keep a reference to a shared object across 
+// a switch, so every pass of a scheduler through find_next_thread() is a 
+// quiescent state, where it announces the current global epoch. Objects are 
+// retired in batches; sealing a batch advances the global epoch, and the batch 
+// is freed once every online scheduler has announced that epoch or a later one. 
+// Reading a shared object costs nothing beyond the read itself.
+//
+// Schedulers blocked waiting for work are offline and hold no one back. Under 
+// AsyncPreemption, a thread can be switched out at any point, so the reads of 
+// shared objects must be made with preemption disabled, as by a PreemptionGuard.
+//
+
+class Reclaimer
+{
+public:
+
+    typedef void (*Deleter)(void *object);
+
+    //
+    // Retires an object that was unlinked from a shared structure. The deleter 
+    // is called on it once no scheduler can still hold a reference to it. Must 
+    // be called from a user thread.
+    //
+
+    static void Retire(void *object, Deleter deleter);
+
+private:
+
+    //
+    // The maximum number of schedulers running at the same time.
+    //
+
+    static const int m_maxSchedulers = 64;
+
+    //
+    // The number of switches between attempts to free a scheduler's sealed batches.
+    //
+
+    static const int m_reclaimInterval = 64;
+
+    //
+    // The epoch announced by a scheduler, or zero if it is offline, in its own 
+    // cache line, and whether the slot is taken.
+    //
+
+    struct CACHE_ALIGNED Slot
+    {
+        volatile long Epoch;
+        volatile long InUse;
+    };
+
+    static Slot m_slots[m_maxSchedulers];
+
+    //
+    // The global epoch. It starts at 1, as zero means offline.
+    //
+
+    static volatile long m_globalEpoch;
+
+    //
+    // The sealed batches left behind by schedulers that stopped running, and the 
+    // spin lock protecting them.
+    //
+
+    static RetireBatch *m_pOrphans;
+    static volatile long m_orphansLock;
+
+    //
+    // Private constructor.
+    //
+
+    Reclaimer();
+
+    //
+    // Gives the scheduler a slot and brings it online. Called by UScheduler::Run().
+    //
+
+    static void register_scheduler(UScheduler *scheduler);
+
+    //
+    // Seals the scheduler's open batch, frees what it can, leaves the rest to the 
+    // other schedulers and releases the slot. Called by UScheduler::Run().
+    //
+
+    static void unregister_scheduler(UScheduler *scheduler);
+
+    //
+    // Announces a quiescent state. Called by UScheduler::find_next_thread().
+    //
+
+    static void quiescent(UScheduler *scheduler);
+
+    //
+    // Take the scheduler offline while it blocks waiting for work, and back online.
+    //
+
+    static void offline(UScheduler *scheduler);
+    static void online(UScheduler *scheduler);
+
+    //
+    // Seals the scheduler's open batch and queues it behind the earlier ones.
+    //
+
+    static void seal(UScheduler *scheduler);
+
+    //
+    // Frees the scheduler's sealed batches, and the orphaned ones, whose epoch 
+    // every online scheduler has reached.
+    //
+
+    static void reclaim(UScheduler *scheduler);
+
+    //
+    // Returns the oldest epoch announced by an online scheduler.
+    //
+
+    static long oldest_epoch();
+
+    //
+    // Calls the deleters of the batch and frees it.
+    //
+
+    static void free_batch(RetireBatch *batch);
+
+    //
+    // UScheduler registers itself and announces its quiescent states.
+    //
+
+    friend class UScheduler;
+};
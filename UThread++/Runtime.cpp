@@ -0,0 +1,378 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+#include <cassert>
+#include <new>
+#include <windows.h>
+
+//
+// WinBase.h defines Yield() as an empty macro.
+//
+
+#undef Yield
+
+#include "Runtime.h"
+
+using namespace std;
+
+//
+// The shard running on the calling operating system thread.
+//
+
+__declspec(thread) Runtime::Shard * Runtime::m_pCurrentShard = NULL;
+
+//
+// Starts the shards and waits until all of them are running.
+//
+
+Runtime::Runtime(int numShards)
+    : m_numShards(numShards),
+      m_shards(new Shard[numShards]),
+      m_rings(new Ring *[numShards * numShards])
+{
+    for (int i = 0; i < numShards * numShards; ++i) {
+        m_rings[i] = new Ring();
+    }
+
+    for (int i = 0; i < numShards; ++i) {
+        Shard &shard = m_shards[i];
+
+        shard.Owner = this;
+        shard.Index = i;
+        shard.Scheduler = NULL;
+        shard.Heap = NULL;
+        shard.Poller = NULL;
+        shard.PollerSleeping = 0;
+        shard.Wakers = 0;
+        shard.Stopping = false;
+        shard.StartedEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+        shard.OsThread = CreateThread(NULL, 0, shard_thread, &shard, 0, NULL);
+    }
+
+    for (int i = 0; i < numShards; ++i) {
+        WaitForSingleObject(m_shards[i].StartedEvent, INFINITE);
+        CloseHandle(m_shards[i].StartedEvent);
+    }
+}
+
+//
+// Stops the pollers, which stop their schedulers on the way out, and waits 
+// for the shards' operating system threads to exit.
+//
+
+Runtime::~Runtime()
+{
+    for (int i = 0; i < m_numShards; ++i) {
+        Shard &shard = m_shards[i];
+
+        //
+        // A poller that has not started yet sees Stopping before it first parks.
+        //
+
+        shard.Stopping = true;
+        InterlockedIncrement(&shard.Wakers);
+        if (shard.Poller != NULL && InterlockedExchange(&shard.PollerSleeping, 0) != 0) {
+            shard.Poller->Unpark();
+        }
+        InterlockedDecrement(&shard.Wakers);
+    }
+
+    for (int i = 0; i < m_numShards; ++i) {
+        WaitForSingleObject(m_shards[i].OsThread, INFINITE);
+        CloseHandle(m_shards[i].OsThread);
+    }
+
+    for (int i = 0; i < m_numShards * m_numShards; ++i) {
+        delete m_rings[i];
+    }
+
+    delete[] m_rings;
+    delete[] m_shards;
+}
+
+//
+// Creates a user thread on the specified shard.
+//
+
+void Runtime::Spawn(int shard, UThread::Function function, UThread::Argument argument)
+{
+    assert(shard >= 0 && shard < m_numShards);
+    UThread::Create(*m_shards[shard].Scheduler, function, argument);
+}
+
+//
+// Sends the task to the target shard, with a future allocated on the home shard.
+//
+
+Future Runtime::SubmitTo(int shard, Task task, void *argument)
+{
+    assert(m_pCurrentShard != NULL && m_pCurrentShard->Owner == this);
+    assert(shard >= 0 && shard < m_numShards);
+
+    FutureState *state = (FutureState *) Allocate(sizeof(FutureState));
+    state->Waiter = &UThread::Current();
+    state->Result = NULL;
+    state->Done = false;
+
+    Message message;
+    message.Function = task;
+    message.Argument = argument;
+    message.State = state;
+    message.Home = m_pCurrentShard->Index;
+    message.Completion = false;
+
+    send(shard, message);
+    return Future(state);
+}
+
+//
+// Allocates memory in the current shard's heap.
+//
+
+void * Runtime::Allocate(size_t size)
+{
+    void *memory = HeapAlloc(m_pCurrentShard->Heap, 0, size);
+    if (memory == NULL) {
+        throw bad_alloc();
+    }
+    return memory;
+}
+
+//
+// Frees memory allocated in the current shard's heap.
+//
+
+void Runtime::Free(void *memory)
+{
+    HeapFree(m_pCurrentShard->Heap, 0, memory);
+}
+
+//
+// Pushes the message to the ring from the current shard to the target shard. 
+// The consumer drains it concurrently, so a full ring only lasts as long as 
+// the target's poller takes to run.
+//
+
+void Runtime::send(int target, const Message &message)
+{
+    //
+    // The ring has a single producer per shard, so the other user threads of 
+    // the shard must not run in the middle of a push.
+    //
+
+    PreemptionGuard guard;
+    Ring *ring = m_rings[m_pCurrentShard->Index * m_numShards + target];
+
+    while (!ring->TryPush(message)) {
+        UThread::Yield();
+    }
+
+    wake_poller(m_shards[target]);
+}
+
+//
+// Unparks the shard's poller if it sleeps and the shard is not stopping.
+//
+
+void Runtime::wake_poller(Shard &shard)
+{
+    //
+    // The interlocked increment orders the push before the read of PollerSleeping, 
+    // which the poller sets before checking the rings a last time. A stopping 
+    // poller withdraws the flag and then waits for Wakers to drop to zero.
+    //
+
+    InterlockedIncrement(&shard.Wakers);
+
+    if (!shard.Stopping && shard.PollerSleeping != 0 && 
+        InterlockedExchange(&shard.PollerSleeping, 0) != 0) {
+        shard.Poller->Unpark();
+    }
+
+    InterlockedDecrement(&shard.Wakers);
+}
+
+//
+// Drains the rings bound to the shard. Tasks are started on new user threads; 
+// completions store the result and unpark the thread waiting for it.
+//
+
+int Runtime::receive(Shard *shard)
+{
+    int count = 0;
+
+    for (int source = 0; source < m_numShards; ++source) {
+        Ring *ring = m_rings[source * m_numShards + shard->Index];
+        Message message;
+
+        while (ring->TryPop(message)) {
+            count += 1;
+
+            if (message.Completion) {
+                FutureState *state = message.State;
+
+                state->Result = message.Argument;
+                state->Done = true;
+                state->Waiter->Unpark();
+            } else {
+                Message *task = (Message *) Allocate(sizeof(Message));
+                *task = message;
+                UThread::Create(task_thread, task);
+            }
+        }
+    }
+
+    return count;
+}
+
+//
+// The body of a shard's operating system thread: pins itself, creates the 
+// shard's heap and scheduler and runs it until the runtime is destroyed.
+//
+
+unsigned long __stdcall Runtime::shard_thread(void *argument)
+{
+    Shard *shard = (Shard *) argument;
+    SYSTEM_INFO systemInfo;
+
+    GetSystemInfo(&systemInfo);
+    SetThreadAffinityMask(GetCurrentThread(), 
+                          (DWORD_PTR) 1 << (shard->Index % systemInfo.dwNumberOfProcessors));
+
+    shard->Heap = HeapCreate(HEAP_NO_SERIALIZE, 0, 0);
+    m_pCurrentShard = shard;
+
+    {
+        UScheduler scheduler;
+        IdlePolicy policy;
+
+        policy.StayAlive = true;
+        scheduler.SetIdlePolicy(policy);
+        shard->Scheduler = &scheduler;
+
+        UThread::Create(poller_thread, shard);
+        SetEvent(shard->StartedEvent);
+
+        scheduler.Run();
+    }
+
+    m_pCurrentShard = NULL;
+    HeapDestroy(shard->Heap);
+    return 0;
+}
+
+//
+// Drains the shard's rings, yielding to the threads it starts or resumes, and 
+// parks when they are all empty. It stops its scheduler once the runtime stops.
+//
+
+void Runtime::poller_thread(UThread::Argument argument)
+{
+    Shard *shard = (Shard *) argument;
+    Runtime *runtime = shard->Owner;
+
+    shard->Poller = &UThread::Current();
+
+    for (;;) {
+        if (runtime->receive(shard) != 0) {
+            UThread::Yield();
+            continue;
+        }
+
+        //
+        // Announce the intent to park, then look at the rings once more: a 
+        // producer either sees the flag and unparks the poller, or pushed 
+        // before the flag was set and its message is found here.
+        //
+
+        InterlockedExchange(&shard->PollerSleeping, 1);
+
+        if (shard->Stopping) {
+
+            //
+            // Withdraw the flag and wait for the producers that may be waking 
+            // the poller; an Unpark() already made is delivered before Exit().
+            //
+
+            InterlockedExchange(&shard->PollerSleeping, 0);
+            while (shard->Wakers != 0) {
+                UThread::Yield();
+            }
+
+            shard->Poller = NULL;
+            break;
+        }
+
+        if (runtime->receive(shard) != 0) {
+            InterlockedExchange(&shard->PollerSleeping, 0);
+            UThread::Yield();
+            continue;
+        }
+
+        UThread::Park();
+    }
+
+    UScheduler::Current().Stop();
+}
+
+//
+// Runs a task received from another shard and sends its result back home.
+//
+
+void Runtime::task_thread(UThread::Argument argument)
+{
+    Message message = *(Message *) argument;
+    Runtime *runtime = m_pCurrentShard->Owner;
+
+    Free(argument);
+
+    message.Argument = message.Function(message.Argument);
+    message.Completion = true;
+    runtime->send(message.Home, message);
+}
+
+//
+// Waits for the result if it was not taken, as the completion message still 
+// refers to the state.
+//
+
+Future::~Future()
+{
+    if (m_pState != NULL) {
+        Get();
+    }
+}
+
+//
+// Parks until the completion arrives on this shard and returns the result. 
+// A pending park permit, or a cancellation, may wake the thread earlier, but 
+// the state is in use until then, so it parks again.
+//
+
+void * Future::Get()
+{
+    FutureState *state = m_pState;
+
+    while (!state->Done) {
+        UThread::Park();
+    }
+
+    void *result = state->Result;
+
+    m_pState = NULL;
+    Runtime::Free(state);
+    return result;
+}
@@ -0,0 +1,265 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+#pragma once
+
+#include <cstdlib>
+
+#include "SpscRing.h"
+#include "UScheduler.h"
+#include "UThread.h"
+
+class Runtime;
+
+//
+// The state shared by a Future and the shard that completes it. It is allocated 
+// in the arena of the caller's home shard and only touched there: the result 
+// travels back in a message.
+//
+
+struct FutureState
+{
+    UThread *Waiter;
+    void *Result;
+    bool Done;
+};
+
+//
+// The result of a call to Runtime::SubmitTo(). It belongs to the user thread 
+// that made the call. Copying a Future transfers it, leaving the source empty.
+//
+
+class Future
+{
+    mutable FutureState *m_pState;
+
+    friend class Runtime;
+
+    explicit Future(FutureState *state)
+        : m_pState(state)
+    { }
+
+public:
+
+    Future(const Future &other)
+        : m_pState(other.m_pState)
+    {
+        other.m_pState = NULL;
+    }
+
+    //
+    // Waits for the result, if it was not taken yet, as the state is in use 
+    // until the task completes.
+    //
+
+    ~Future();
+
+    //
+    // Returns whether the task has completed. An empty Future, whose result was 
+    // taken or transferred, is always ready.
+    //
+
+    bool IsReady() const
+    {
+        return m_pState == NULL || m_pState->Done;
+    }
+
+    //
+    // Parks the calling thread, on its home shard, until the task completes and 
+    // returns its result. Can only be called once.
+    //
+
+    void * Get();
+
+private:
+
+    Future & operator =(const Future &);
+};
+
+//
+// A thread-per-core runtime. Each shard is an operating system thread pinned 
+// to its own processor, running its own scheduler and allocating from its own 
+// heap. Shards share nothing but a matrix of single-producer, single-consumer 
+// rings, one for each ordered pair of shards, through which they submit tasks 
+// to each other and send results back. Data partitioned by shard is only ever 
+// touched by its shard's user threads, so it needs no locking at all.
+//
+// A poller thread on each shard drains the rings bound to it. It parks when 
+// they are all empty, and producers unpark it after pushing a message.
+//
+// The load balancer must not run alongside a runtime, as it would move user 
+// threads away from their shards.
+//
+
+class Runtime
+{
+public:
+
+    //
+    // A task run on a shard by SubmitTo(). Its result is returned by Future::Get().
+    //
+
+    typedef void * (*Task)(void *argument);
+
+private:
+
+    //
+    // The capacity of each ring. A producer yields while the ring is full.
+    //
+
+    static const long m_ringCapacity = 256;
+
+    //
+    // A message between shards: either a task to run, with the future it 
+    // completes, or the completion of a future, with the task's result.
+    //
+
+    struct Message
+    {
+        Task Function;
+        void *Argument;
+        FutureState *State;
+        int Home;
+        bool Completion;
+    };
+
+    typedef SpscRing<Message, m_ringCapacity> Ring;
+
+    //
+    // The per-shard state. PollerSleeping is set while the poller is parked, 
+    // or about to, so that producers know they must unpark it. Wakers counts 
+    // the threads in wake_poller(), which a stopping poller waits for, so that 
+    // none of them refers to it once it exits.
+    //
+
+    struct Shard
+    {
+        Runtime *Owner;
+        int Index;
+        UScheduler *Scheduler;
+        void *Heap;
+        void *OsThread;
+        void *StartedEvent;
+        UThread *Poller;
+        volatile long PollerSleeping;
+        volatile long Wakers;
+        volatile bool Stopping;
+    };
+
+    int m_numShards;
+    Shard *m_shards;
+
+    //
+    // The rings, m_rings[from * m_numShards + to] carrying the messages from 
+    // shard from to shard to.
+    //
+
+    Ring **m_rings;
+
+    //
+    // The shard running on the calling operating system thread, if any.
+    //
+
+    static __declspec(thread) Shard *m_pCurrentShard;
+
+public:
+
+    //
+    // Starts the specified number of shards, pinning shard i to processor i 
+    // modulo the number of processors, and returns once all are running.
+    //
+
+    explicit Runtime(int numShards);
+
+    //
+    // Stops the shards and waits for their operating system threads to exit. 
+    // User threads still blocked on the shards are abandoned. No Spawn() or 
+    // SubmitTo() may run concurrently, and tasks still running then may not 
+    // deliver their results.
+    //
+
+    ~Runtime();
+
+    int GetShardCount() const
+    {
+        return m_numShards;
+    }
+
+    //
+    // Returns the index of the shard running on the calling operating system 
+    // thread, or -1 if it is not a shard.
+    //
+
+    static int CurrentShard()
+    {
+        return m_pCurrentShard != NULL ? m_pCurrentShard->Index : -1;
+    }
+
+    //
+    // Creates a user thread on the specified shard. Can be called from any 
+    // operating system thread, and is how work enters the runtime.
+    //
+
+    void Spawn(int shard, UThread::Function function, UThread::Argument argument);
+
+    //
+    // Runs the task on a new user thread of the specified shard and returns a 
+    // future for its result, which resumes the caller on its own shard. Must 
+    // be called from a user thread of one of the runtime's shards.
+    //
+
+    Future SubmitTo(int shard, Task task, void *argument);
+
+    //
+    // Allocate and free memory in the current shard's heap, which is not 
+    // synchronized: memory must be freed on the shard that allocated it.
+    //
+
+    static void * Allocate(size_t size);
+    static void Free(void *memory);
+
+private:
+
+    //
+    // Pushes a message to the ring from the current shard to the target shard, 
+    // yielding while it is full, and unparks the target's poller if it sleeps.
+    //
+
+    void send(int target, const Message &message);
+
+    //
+    // Drains the rings bound to the shard, returning the number of messages.
+    //
+
+    int receive(Shard *shard);
+
+    //
+    // Unparks the shard's poller if it sleeps and the shard is not stopping.
+    //
+
+    static void wake_poller(Shard &shard);
+
+    static unsigned long __stdcall shard_thread(void *argument);
+    static void poller_thread(UThread::Argument argument);
+    static void task_thread(UThread::Argument argument);
+
+    //
+    // Runtimes cannot be copied.
+    //
+
+    Runtime(const Runtime &);
+    Runtime & operator =(const Runtime &);
+};
@@ -0,0 +1,172 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+
+#pragma once
+
+#include <cstddef>
+
+//
+// Tells AddressSanitizer, ThreadSanitizer and Valgrind about the stacks of user 
+// threads and the switches between them, which they cannot see otherwise. Each 
+// is enabled when the build uses it: the sanitizers by their compiler flags, and 
+// Valgrind by defining UTHREAD_VALGRIND. Otherwise every hook is empty and the 
+// annotations take no space, so other builds are unaffected.
+//
+
+#if defined(__SANITIZE_ADDRESS__)
+#define UTHREAD_ASAN
+#endif
+
+#if defined(__SANITIZE_THREAD__)
+#define UTHREAD_TSAN
+#endif
+
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer) && !defined(UTHREAD_ASAN)
+#define UTHREAD_ASAN
+#endif
+#if __has_feature(thread_sanitizer) && !defined(UTHREAD_TSAN)
+#define UTHREAD_TSAN
+#endif
+#endif
+
+#ifdef UTHREAD_ASAN
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+#ifdef UTHREAD_TSAN
+#include <sanitizer/tsan_interface.h>
+#endif
+
+#ifdef UTHREAD_VALGRIND
+#include <valgrind/valgrind.h>
+#endif
+
+//
+// What the tools know about a user thread: for AddressSanitizer, its fake stack 
+// and stack bounds, and the thread it was switched in from; for ThreadSanitizer, 
+// its fiber; for Valgrind, the id of its registered stack.
+//
+
+struct FiberAnnotations
+{
+#ifdef UTHREAD_ASAN
+    void *FakeStack;
+    const void *StackBottom;
+    size_t StackSize;
+    FiberAnnotations *SwitchedFrom;
+#endif
+#ifdef UTHREAD_TSAN
+    void *Fiber;
+#endif
+#ifdef UTHREAD_VALGRIND
+    unsigned StackId;
+#endif
+};
+
+class Sanitizers
+{
+public:
+
+    //
+    // A user thread's stack, between bottom and bottom + size, was created.
+    //
+
+    static void stack_created(FiberAnnotations &fiber, void *bottom, size_t size)
+    {
+#ifdef UTHREAD_ASAN
+        fiber.FakeStack = NULL;
+        fiber.StackBottom = bottom;
+        fiber.StackSize = size;
+        fiber.SwitchedFrom = NULL;
+#endif
+#ifdef UTHREAD_TSAN
+        fiber.Fiber = __tsan_create_fiber(0);
+#endif
+#ifdef UTHREAD_VALGRIND
+        fiber.StackId = VALGRIND_STACK_REGISTER(bottom, (char *) bottom + size);
+#endif
+    }
+
+    //
+    // The thread proxying an operating system thread was created. Its stack is 
+    // the operating system thread's, whose bounds AddressSanitizer reports when 
+    // the thread first switches out.
+    //
+
+    static void main_created(FiberAnnotations &fiber)
+    {
+#ifdef UTHREAD_ASAN
+        fiber.FakeStack = NULL;
+        fiber.StackBottom = NULL;
+        fiber.StackSize = 0;
+        fiber.SwitchedFrom = NULL;
+#endif
+#ifdef UTHREAD_TSAN
+        fiber.Fiber = __tsan_get_current_fiber();
+#endif
+    }
+
+    //
+    // A user thread's stack is about to be freed. Not called for proxies.
+    //
+
+    static void stack_destroyed(FiberAnnotations &fiber)
+    {
+#ifdef UTHREAD_TSAN
+        __tsan_destroy_fiber(fiber.Fiber);
+#endif
+#ifdef UTHREAD_VALGRIND
+        VALGRIND_STACK_DEREGISTER(fiber.StackId);
+#endif
+    }
+
+    //
+    // Called right before switching stacks. When the outgoing thread exits, 
+    // AddressSanitizer releases its fake stack instead of saving it.
+    //
+
+    static void start_switch(FiberAnnotations &from, FiberAnnotations &to, bool exiting)
+    {
+#ifdef UTHREAD_ASAN
+        to.SwitchedFrom = exiting ? NULL : &from;
+        __sanitizer_start_switch_fiber(exiting ? NULL : &from.FakeStack, to.StackBottom, to.StackSize);
+#endif
+#ifdef UTHREAD_TSAN
+        __tsan_switch_to_fiber(to.Fiber, 0);
+#endif
+    }
+
+    //
+    // Called by the thread switched in, first thing on its stack.
+    //
+
+    static void finish_switch(FiberAnnotations &self)
+    {
+#ifdef UTHREAD_ASAN
+        FiberAnnotations *from = self.SwitchedFrom;
+
+        __sanitizer_finish_switch_fiber(self.FakeStack, 
+                                        from != NULL ? &from->StackBottom : NULL, 
+                                        from != NULL ? &from->StackSize : NULL);
+#endif
+    }
+
+private:
+
+    Sanitizers();
+};
@@ -15,7 +15,10 @@
 // 
 
 #include <cassert>
+#include "DeadlockDetector.h"
+#include "Probes.h"
 #include "Semaphore.h"
+#include "UScheduler.h"
 
 //
 // The Mutex destructor.
@@ -31,8 +34,9 @@ Semaphore::~Semaphore()
 // is blocked until a call to Post() adds a permit.
 //
 
-void Semaphore::Wait()
+bool Semaphore::Wait()
 {
+    PreemptionGuard guard;
     UThread &currentThread = UThread::Current();
 
     //
@@ -41,7 +45,15 @@ void Semaphore::Wait()
 
     if (m_permits > 0) {
         m_permits -= 1;
-        return;
+        return true;
+    }
+
+    //
+    // A cancelled thread does not block.
+    //
+
+    if (currentThread.IsCancelled()) {
+        return false;
     }
 
     //
@@ -49,34 +61,92 @@ void Semaphore::Wait()
     //
 
     m_waitList.push_back(&currentThread);
+    m_numWaiters += 1;
+    DeadlockDetector::waiting(&currentThread, this, "Semaphore", NULL);
+    UTHREAD_PROBE_SEM_BLOCK(currentThread.GetId(), this);
 
     //
-    // Park the current thread. The thread is unparked by a call to Post().
+    // Park the current thread. The thread is unparked by a call to Post(), which 
+    // removes it from the wait list. A pending park permit may wake the thread 
+    // earlier, so park again while the thread is still waiting. If the thread was 
+    // cancelled and is still waiting, it leaves the wait list by itself.
     //
 
-    currentThread.Park();
+    while (UThread::WaitList::linked(&currentThread)) {
+        if (!UThread::Park() && UThread::WaitList::linked(&currentThread)) {
+            m_waitList.remove(&currentThread);
+            m_numWaiters -= 1;
+            DeadlockDetector::done(&currentThread);
+            return false;
+        }
+    }
+
+    DeadlockDetector::done(&currentThread);
+    return true;
 }
 
 //
-// Adds one permit to the semaphore, eventually unblocking a waiting thread.
+// Tries to get one permit from the semaphore without blocking. Returns true if 
+// a permit was available, false otherwise.
+//
+
+bool Semaphore::TryWait()
+{
+    PreemptionGuard guard;
+
+    if (m_permits > 0) {
+        m_permits -= 1;
+        return true;
+    }
+
+    return false;
+}
+
+//
+// Adds one permit to the semaphore, eventually unblocking a waiting thread. 
+// Posting to a semaphore that holds the maximum number of permits is an error.
 //
 
 void Semaphore::Post()
 {
+    if (!TryPost()) {
+        assert(!"Semaphore::Post() exceeded the maximum number of permits");
+    }
+}
+
+//
+// Adds one permit to the semaphore, eventually unblocking a waiting thread. The 
+// permit is discarded if the semaphore already holds the maximum.
+//
+
+bool Semaphore::TryPost()
+{
+    PreemptionGuard guard;
     UThread &currentThread = UThread::Current();
 
     if (m_waitList.empty()) {
+        if (m_permits == m_maximum) {
+            return false;
+        }
         m_permits += 1;
-        return;
+        return true;
     }
 
     //
-    // Release a blocked thread. The permit is not added to m_permits, instead 
-    // being consumed by the blocked thread.
+    // Release a blocked thread, the first unless the scheduler is deterministic. 
+    // The permit is not added to m_permits, instead being consumed by the blocked 
+    // thread.
     //
 
     UThread *thread = m_waitList.front();
-    m_waitList.pop_front();
+    for (unsigned skip = UScheduler::Current().Choose(m_numWaiters); skip > 0; --skip) {
+        thread = m_waitList.next(thread);
+    }
+
+    m_waitList.remove(thread);
+    m_numWaiters -= 1;
+    UTHREAD_PROBE_SEM_WAKE(thread->GetId(), this);
 
     thread->Unpark();
+    return true;
 }
@@ -16,8 +16,8 @@
 
 #pragma once
 
+#include <climits>
 #include <cstdlib>
-#include <list>
 #include "UThread.h"
 
 using namespace std;
@@ -29,22 +29,32 @@ class Semaphore
     //
 
     int m_permits;
+
+    //
+    // The maximum number of permits.
+    //
+
+    int m_maximum;
         
     //
     // The wait list containing the blocked threads that are waiting on the semaphore.
     //
 
-    list<UThread *> m_waitList;
+    UThread::WaitList m_waitList;
+    unsigned m_numWaiters;
         
 public:
         
     //
-    // Creates a Semaphore instance.
+    // Creates a Semaphore instance with the specified number of permits, which 
+    // never grows beyond maximum.
     //
 
-    Semaphore()
-        : m_permits(0),
-          m_waitList()
+    explicit Semaphore(int permits = 0, int maximum = INT_MAX)
+        : m_permits(permits),
+          m_maximum(maximum),
+          m_waitList(),
+          m_numWaiters(0)
     { }
 
     //
@@ -55,14 +65,31 @@ public:
 
     //
     // Gets one permit from the semaphore. If no permits are available, the calling
-    // thread is blocked until a call to Post() adds a permit.
+    // thread is blocked until a call to Post() adds a permit. Returns false, without 
+    // a permit, if the thread is cancelled before it gets one.
+    //
+
+    bool Wait();
+
+    //
+    // Tries to get one permit from the semaphore without blocking. Returns true if 
+    // a permit was available, false otherwise.
     //
 
-    void Wait();
+    bool TryWait();
 
     //
-    // Adds one permit to the semaphore, eventually unblocking a waiting thread.
+    // Adds one permit to the semaphore, eventually unblocking a waiting thread. 
+    // The semaphore must not already hold the maximum number of permits.
     //
 
     void Post();
+
+    //
+    // Adds one permit to the semaphore, eventually unblocking a waiting thread. 
+    // Returns false, discarding the permit, if the semaphore already holds the 
+    // maximum number of permits.
+    //
+
+    bool TryPost();
 };
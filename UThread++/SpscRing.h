@@ -0,0 +1,107 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+#pragma once
+
+#include "CacheLine.h"
+
+//
+// A bounded single-producer, single-consumer ring buffer. The producer and the 
+// consumer each write their own position, in their own cache line, and keep a 
+// private copy of the other's, so they only read each other's line when the 
+// ring looks full or empty. No interlocked operations are needed: volatile 
+// accesses have acquire and release semantics in Visual C++, which is all the 
+// hand-over of an item requires. Capacity must be a power of two.
+//
+
+template <class T, long Capacity>
+class CACHE_ALIGNED SpscRing : public CacheAligned
+{
+    T m_items[Capacity];
+
+    //
+    // The consumer's position and its copy of the producer's.
+    //
+
+    CACHE_ALIGNED volatile long m_head;
+    long m_cachedTail;
+
+    //
+    // The producer's position and its copy of the consumer's.
+    //
+
+    CACHE_ALIGNED volatile long m_tail;
+    long m_cachedHead;
+
+public:
+
+    SpscRing()
+        : m_head(0),
+          m_cachedTail(0),
+          m_tail(0),
+          m_cachedHead(0)
+    { }
+
+    //
+    // Adds an item to the ring. Returns false if it is full. Only called by the producer.
+    //
+
+    bool TryPush(const T &item)
+    {
+        long tail = m_tail;
+
+        if (tail - m_cachedHead == Capacity) {
+            m_cachedHead = m_head;
+            if (tail - m_cachedHead == Capacity) {
+                return false;
+            }
+        }
+
+        m_items[tail & (Capacity - 1)] = item;
+        m_tail = tail + 1;
+        return true;
+    }
+
+    //
+    // Removes the oldest item from the ring. Returns false if it is empty. Only 
+    // called by the consumer.
+    //
+
+    bool TryPop(T &item)
+    {
+        long head = m_head;
+
+        if (head == m_cachedTail) {
+            m_cachedTail = m_tail;
+            if (head == m_cachedTail) {
+                return false;
+            }
+        }
+
+        item = m_items[head & (Capacity - 1)];
+        m_head = head + 1;
+        return true;
+    }
+
+private:
+
+    //
+    // Rings cannot be copied.
+    //
+
+    SpscRing(const SpscRing &);
+    SpscRing & operator =(const SpscRing &);
+};
@@ -16,72 +16,823 @@
 
 #pragma once
 
-#include <list>
+#include <cstdio>
+#include <vector>
+#include "CacheLine.h"
+#include "List.h"
+#include "Reclaimer.h"
+#include "UThread.h"
 
 using namespace std;
 
 class UThread;
+struct OffloadRequest;
 
 //
-// The singleton user threads scheduler.
+// How a scheduler preempts threads that run longer than a quantum without 
+// switching. With SafePointPreemption, such a thread yields at its next safe 
+// point; with AsyncPreemption, it is interrupted anywhere in the code of the 
+// executable, unless it disabled preemption, its full register state being 
+// saved on its stack. With AsyncPreemption, code that holds an operating system 
+// lock must disable preemption, e.g. with a PreemptionGuard.
 //
 
-class UScheduler
+enum PreemptionMode
+{
+    NoPreemption,
+    SafePointPreemption,
+    AsyncPreemption
+};
+
+//
+// Controls what a scheduler does when its ready queue is empty. The scheduler 
+// first busy-polls for new work for SpinMicroseconds, then relinquishes the 
+// processor to other operating system threads for YieldMicroseconds, and then 
+// blocks until it is woken. When StayAlive is false, the scheduler only waits 
+// for offloaded calls; otherwise, Run() returns only after Stop() is called.
+//
+
+struct IdlePolicy
+{
+    int SpinMicroseconds;
+    int YieldMicroseconds;
+    bool StayAlive;
+
+    IdlePolicy()
+        : SpinMicroseconds(0),
+          YieldMicroseconds(0),
+          StayAlive(false)
+    { }
+};
+
+//
+// The time a scheduler spent in each idle stage, in microseconds, and the number 
+// of times new work was found during each stage.
+//
+
+struct IdleStatistics
+{
+    unsigned __int64 SpinTime;
+    unsigned __int64 YieldTime;
+    unsigned __int64 BlockTime;
+    unsigned SpinWakeups;
+    unsigned YieldWakeups;
+    unsigned BlockWakeups;
+
+    IdleStatistics()
+        : SpinTime(0),
+          YieldTime(0),
+          BlockTime(0),
+          SpinWakeups(0),
+          YieldWakeups(0),
+          BlockWakeups(0)
+    { }
+};
+
+//
+// A one-shot timer of a scheduler. Once Due, in microseconds on the UScheduler::Now() 
+// clock, has passed, the scheduler calls Expired with the timer on its next switch. 
+// The callback runs outside of any user thread: it must not block or use floating 
+// point, and typically unparks threads. It may set the timer again.
+//
+
+struct SchedulerTimer
+{
+    ListNode Node;
+    __int64 Due;
+    void (*Expired)(SchedulerTimer *timer);
+    void *Context;
+
+    SchedulerTimer()
+        : Due(0),
+          Expired(NULL),
+          Context(NULL)
+    {
+        Node.Next = Node.Prev = NULL;
+    }
+};
+
+//
+// The stack usage of the threads that exited on a scheduler. Threads[i] counts 
+// the threads whose stack high-water mark was at most 512 << i bytes.
+//
+
+struct StackStatistics
+{
+    static const int NumBuckets = 8;
+
+    unsigned Threads[NumBuckets];
+    unsigned MaxHighWater;
+
+    StackStatistics()
+        : MaxHighWater(0)
+    {
+        for (int i = 0; i < NumBuckets; ++i) {
+            Threads[i] = 0;
+        }
+    }
+};
+
+//
+// A user threads scheduler. Each instance has its own ready queue and runs on 
+// the operating system thread that calls Run(), so several schedulers can run 
+// concurrently, one per operating system thread. An instance must only be 
+// accessed from the operating system thread that runs it, except through the 
+// members documented as callable from any operating system thread, which hand 
+// their work over through lock-free lists or locks.
+//
+
+class CACHE_ALIGNED UScheduler : public CacheAligned
 {
     //
-    // The number of existing user threads.
+    // The hot state, used by the scheduler's own operating system thread on every 
+    // context switch, comes first and fits in the first cache line.
     //
 
-    static int m_numThreads;
-
     //
     // The currently running thread.
     //
 
-    static UThread *m_pRunningThread;
+    UThread *m_pRunningThread;
 
     //
     // The list of schedulable user threads.
     // The next thread to run is retrieved from the head of the list.
     //
 
-    static list<UThread *> m_readyQueue;
+    List<UThread, &UThread::m_readyNode> m_readyQueue;
 
     //
-    // The user thread proxy of the main operating system thread. This thread 
-    // is switched back in when there are no more runnable user threads and the 
+    // The number of threads in m_readyQueue. Only written by the scheduler's own 
+    // operating system thread, and read by the load balancer.
+    //
+
+    volatile long m_readyCount;
+
+    //
+    // The user thread proxy of the main operating system thread. This thread 
+    // is switched back in when there are no more runnable user threads and the 
     // scheduler will exit.
     //
 
-    static UThread *m_pMainThread;
+    UThread *m_pMainThread;
+
+    //
+    // The thread that switched out in UThread::MigrateTo() and its destination. The 
+    // thread is handed over by context_switch(), once its context has been saved.
+    //
+
+    UThread *m_pMigratingThread;
+    UScheduler *m_pMigrationTarget;
+
+    //
+    // The id of the operating system thread running the scheduler, or 0.
+    //
+
+    volatile unsigned long m_ownerThreadId;
+
+    //
+    // Incremented on every switch, so the preemption timer can tell that the 
+    // running thread exceeded its quantum.
+    //
+
+    volatile unsigned m_switchCount;
+
+    //
+    // The time stamp counter ticks a thread can run before MaybeYield() checks 
+    // whether other threads are ready.
+    //
+
+    unsigned __int64 m_yieldBudget;
+
+    //
+    // The thread with VectorState whose floating point and SIMD state is in the 
+    // registers of the operating system thread, if any.
+    //
+
+    UThread *m_pVectorOwner;
+
+    //
+    // The scheduler's slot in the reclaimer, where it announces the epochs it 
+    // reaches, or NULL while it is not running, and its sealed batches of 
+    // retired objects, oldest first.
+    //
+
+    volatile long *m_pEpochSlot;
+    RetireBatch *m_pSealedBatches;
+
+    //
+    // Whether the scheduler is deterministic.
+    //
+
+    bool m_deterministic;
+
+    //
+    // The state written by other operating system threads starts a new cache line, 
+    // so that handing threads over does not invalidate the hot state.
+    //
+
+    //
+    // The number of existing user threads. Threads migrating between schedulers 
+    // update the counts of both, so it is updated with interlocked operations.
+    //
+
+    CACHE_ALIGNED volatile long m_numThreads;
+
+    //
+    // The stack of completed offload requests, linked through OffloadRequest::Next. 
+    // It is drained by find_next_thread(), which wakes the requesting threads.
+    //
+
+    OffloadRequest * volatile m_pRemoteWakeList;
+
+    //
+    // The number of operating system threads between pushing onto 
+    // m_pRemoteWakeList or m_pRemoteUnparkList and signaling m_remoteWakeEvent. 
+    // The destructor waits for it to drop to zero.
+    //
+
+    volatile long m_numRemoteWakers;
+
+    //
+    // The stack of ready user threads handed over by other operating system threads, 
+    // linked through UThread::m_pNextRemoteReady. It is drained by find_next_thread().
+    //
+
+    UThread * volatile m_pRemoteReadyList;
+
+    //
+    // The stack of user threads unparked from other operating system threads, 
+    // linked through UThread::m_pNextRemoteUnpark.
+    //
+
+    UThread * volatile m_pRemoteUnparkList;
+
+    //
+    // A request from the load balancer to move m_shedCount ready threads to 
+    // m_pShedTarget. Both are protected by the load balancer's lock.
+    //
+
+    UScheduler *m_pShedTarget;
+    volatile long m_shedCount;
+
+    //
+    // Set by Stop() to make a scheduler that stays alive return from Run().
+    //
+
+    volatile bool m_stopRequested;
+
+    //
+    // Set by the preemption timer when the running thread must yield at its next 
+    // safe point.
+    //
+
+    volatile bool m_preemptRequested;
+
+    //
+    // The cold state starts another cache line.
+    //
+
+    //
+    // The auto-reset event signaled when a request is pushed onto m_pRemoteWakeList.
+    //
+
+    CACHE_ALIGNED void *m_remoteWakeEvent;
+
+    //
+    // The armed timers, in expiration order.
+    //
+
+    List<SchedulerTimer, &SchedulerTimer::Node> m_timers;
+
+    //
+    // The batch that retired objects are added to, the last sealed batch and 
+    // the number of switches left before trying to free the sealed batches.
+    //
+
+    RetireBatch *m_pOpenBatch;
+    RetireBatch *m_pLastSealedBatch;
+    int m_reclaimCountdown;
+
+    //
+    // The number of user threads parked in Offload() waiting for a helper thread.
+    //
+
+    int m_numPendingOffloads;
+
+    //
+    // The number of exiting user threads parked until an unpark made from another 
+    // operating system thread is delivered.
+    //
+
+    int m_numPendingUnparks;
+
+    //
+    // The NUMA node of the processor running the scheduler, sampled by Run().
+    //
+
+    int m_numaNode;
+
+    //
+    // What to do when the ready queue is empty, and where the time went.
+    //
+
+    IdlePolicy m_idlePolicy;
+    IdleStatistics m_idleStatistics;
+
+    //
+    // The preemption settings.
+    //
+
+    PreemptionMode m_preemptionMode;
+    int m_quantumMilliseconds;
+
+    //
+    // The preemption timer thread, the event that stops it and a handle to the 
+    // operating system thread running the scheduler.
+    //
+
+    void *m_preemptionTimer;
+    void *m_preemptionStopEvent;
+    void *m_osThread;
+
+    //
+    // The stack usage of the exited threads, recorded only when tracking is enabled.
+    //
+
+    bool m_trackStackUsage;
+    StackStatistics m_stackStatistics;
+
+    //
+    // The deterministic mode state: the pseudo-random generator, the recorded 
+    // choices and, when replaying, the position of the next choice to repeat.
+    //
+
+    unsigned m_randomState;
+    vector<unsigned> m_trace;
+    size_t m_replayPosition;
+    size_t m_replayLength;
+
+    //
+    // Whether the scheduler detects deadlocks, its parked threads, the number of 
+    // wait-for cycles found and the number of threads still blocked when it last 
+    // drained.
+    //
+
+    bool m_detectDeadlocks;
+    List<UThread, &UThread::m_blockedNode> m_blockedList;
+    int m_numDeadlocks;
+    int m_numStuckThreads;
+
+    //
+    // All the user threads of the scheduler, except the main thread, and the lock 
+    // protecting the list, which is updated by other operating system threads when 
+    // threads are created remotely or migrate. The switch path never touches it.
+    //
+
+    List<UThread, &UThread::m_allNode> m_allThreads;
+    void *m_pAllThreadsLock;
+
+    //
+    // The stream of a pending Dump() made from another operating system thread, 
+    // which the scheduler serves on its own, and the event set once it is served.
+    //
+
+    FILE * volatile m_pDumpStream;
+    void *m_dumpDoneEvent;
+
+    //
+    // How long, in milliseconds, Dump() waits for the scheduler to serve it.
+    //
+
+    static const unsigned m_dumpTimeout = 1000;
+
+    //
+    // The scheduler bound to the calling operating system thread.
+    //
+
+    static __declspec(thread) UScheduler *m_pCurrent;
 public:
 
     //
-    // Initializes the scheduler. The operating system thread that calls the 
-    // function switches to a user thread and resumes execution only when all 
-    // user threads have exited.
+    // The type of the functions that can be offloaded to a helper thread.
+    //
+
+    typedef void * (*BlockingFunction)(void *argument);
+
+    //
+    // Creates a scheduler instance. If no scheduler is bound to the calling 
+    // operating system thread, the new instance becomes its current scheduler.
+    //
+
+    UScheduler();
+
+    //
+    // The UScheduler destructor.
+    //
+
+    ~UScheduler();
+
+    //
+    // Runs the scheduler. The operating system thread that calls the function 
+    // switches to a user thread and resumes execution only when all user 
+    // threads have exited. While running, the instance is the current scheduler 
+    // of the calling operating system thread.
+    //
+
+    void Run();
+
+    //
+    // Returns the NUMA node of the processor on which the scheduler last started 
+    // running, or -1 if it never ran.
+    //
+
+    int GetNumaNode() const
+    {
+        return m_numaNode;
+    }
+
+    //
+    // Sets what the scheduler does when its ready queue is empty.
+    //
+
+    void SetIdlePolicy(const IdlePolicy &policy)
+    {
+        m_idlePolicy = policy;
+    }
+
+    //
+    // Returns the time the scheduler spent in each idle stage.
+    //
+
+    IdleStatistics GetIdleStatistics() const
+    {
+        return m_idleStatistics;
+    }
+
+    //
+    // Makes a scheduler that stays alive return from Run() once its ready queue 
+    // is empty. Can be called from any operating system thread.
+    //
+
+    void Stop();
+
+    //
+    // Sets how the scheduler preempts threads that run for longer than 
+    // quantumMilliseconds without switching. Takes effect on the next Run().
+    //
+
+    void SetPreemption(PreemptionMode mode, int quantumMilliseconds)
+    {
+        m_preemptionMode = mode;
+        m_quantumMilliseconds = quantumMilliseconds;
+    }
+
+    //
+    // Sets how long, in microseconds, a thread runs before UThread::MaybeYield() 
+    // yields to the other ready threads. The default is one millisecond.
+    //
+
+    void SetYieldBudget(int microseconds);
+
+    //
+    // Enables recording the stack high-water mark of each thread when it exits.
+    //
+
+    void SetStackTracking(bool enabled)
+    {
+        m_trackStackUsage = enabled;
+    }
+
+    //
+    // Returns the stack usage of the threads that exited while tracking was enabled.
+    //
+
+    StackStatistics GetStackStatistics() const
+    {
+        return m_stackStatistics;
+    }
+
+    //
+    // Enables maintaining the wait-for graph of the threads blocked on mutexes, 
+    // reporting cycles when they form, and reporting the threads still blocked 
+    // when Run() returns. Reports go to stderr.
+    //
+
+    void SetDeadlockDetection(bool enabled)
+    {
+        m_detectDeadlocks = enabled;
+    }
+
+    //
+    // Prints every user thread of the scheduler, with its state, what it is blocked 
+    // on and its backtrace, like a jstack for user threads. Can be called from any 
+    // operating system thread. While the scheduler runs, the threads are only 
+    // walked by its own operating system thread, the next time it switches or polls 
+    // for work; if it does not within m_dumpTimeout, only a note is printed.
+    //
+
+    void Dump(FILE *stream = stderr);
+
+    //
+    // Returns the number of wait-for cycles found.
+    //
+
+    int GetDeadlockCount() const
+    {
+        return m_numDeadlocks;
+    }
+
+    //
+    // Returns the number of threads that were still blocked when Run() last returned.
+    //
+
+    int GetStuckThreadCount() const
+    {
+        return m_numStuckThreads;
+    }
+
+    //
+    // Makes every scheduling choice - the next thread to run, the thread woken by 
+    // Mutex::Release() and Semaphore::Post(), whether UThread::MaybeYield() yields - 
+    // pseudo-random, with the specified seed, and recorded in a trace. Meant for 
+    // testing with a single scheduler, no preemption and no offloads, whose timing 
+    // would make runs diverge.
     //
 
-    static void Run();
+    void SetDeterministic(unsigned seed);
+
+    //
+    // Makes the scheduler deterministic and repeat the choices in the trace, as 
+    // recorded by an earlier run, before continuing with the seeded generator. 
+    // If the run diverges, so that a recorded choice is out of range, the rest 
+    // of the trace is dropped and the generator takes over.
+    //
+
+    void SetReplay(const vector<unsigned> &trace, unsigned seed);
+
+    //
+    // Returns the choices made since SetDeterministic() or SetReplay().
+    //
+
+    const vector<unsigned> & GetTrace() const
+    {
+        return m_trace;
+    }
+
+    //
+    // Chooses one of n alternatives. Returns 0, the first one, unless the scheduler 
+    // is deterministic.
+    //
+
+    unsigned Choose(unsigned n)
+    {
+        return m_deterministic && n > 1 ? choose(n) : 0;
+    }
+
+    //
+    // Returns the scheduler bound to the calling operating system thread.
+    //
+
+    static UScheduler & Current();
+
+    //
+    // Runs the specified blocking function on an operating system helper thread and 
+    // returns its result. The current user thread is parked meanwhile, so the other 
+    // user threads keep running.
+    //
+
+    static void * Offload(BlockingFunction function, void *argument);
+
+    //
+    // Returns the time, in microseconds, on the clock used by timers.
+    //
+
+    static __int64 Now();
+
+    //
+    // Arms the timer, which must not be armed, to expire at the specified time. 
+    // Must be called on the operating system thread running the scheduler.
+    //
+
+    void SetTimer(SchedulerTimer *timer, __int64 due);
+
+    //
+    // Disarms the timer. Does nothing if it is not armed. Must be called on the 
+    // operating system thread running the scheduler.
+    //
+
+    void CancelTimer(SchedulerTimer *timer);
+
+    //
+    // Returns whether the timer is armed.
+    //
+
+    static bool IsTimerSet(SchedulerTimer *timer)
+    {
+        return List<SchedulerTimer, &SchedulerTimer::Node>::linked(timer);
+    }
 
 private:
 
     //
-    // Private constructor.
+    // A private copy construtor used to prohibit copies. It has no definition.
     //
 
-    UScheduler();
+    UScheduler(const UScheduler &);
+
+    //
+    // A private assign operator used to prohibit copies. It has no definition.
+    //
+
+    UScheduler & operator =(const UScheduler &);
+
+    //
+    // Returns and removes the first user thread in the ready queue. If the ready 
+    // queue is empty, waits for work according to the idle policy, returning the 
+    // main thread when there is nothing left to wait for.
+    //
+
+    UThread * find_next_thread();
+
+    //
+    // Returns true if the scheduler must wait for work instead of exiting when 
+    // its ready queue is empty.
+    //
+
+    bool must_wait() const
+    {
+        return m_numPendingOffloads > 0 || m_numPendingUnparks > 0 || !m_timers.empty() || 
+               (m_idlePolicy.StayAlive && !m_stopRequested);
+    }
+
+    //
+    // Calls the callbacks of the timers that expired.
+    //
+
+    void fire_timers();
+
+    //
+    // Returns how long, in milliseconds, the scheduler can block before its first 
+    // timer expires, or INFINITE if there are no timers.
+    //
+
+    unsigned timer_timeout();
+
+    //
+    // Waits for the ready queue to become non-empty, following the idle policy. 
+    // Returns false if there is nothing left to wait for.
+    //
+
+    bool wait_for_work();
+
+    //
+    // Hands the completed request over to the scheduler of the requesting thread. 
+    // Can be called from any operating system thread; neither the request nor the 
+    // thread is touched after the request is pushed.
+    //
+
+    static void remote_wake(OffloadRequest *request);
+
+    //
+    // Completes the requests in m_pRemoteWakeList and unparks their threads, in 
+    // the order they were pushed.
+    //
+
+    void drain_remote_wakes();
+
+    //
+    // Pushes the chain of ready threads from first to last, linked through 
+    // UThread::m_pNextRemoteReady, onto m_pRemoteReadyList. Can be called from 
+    // any operating system thread.
+    //
+
+    void remote_ready(UThread *first, UThread *last);
+
+    //
+    // Places the threads in m_pRemoteReadyList at the end of the ready queue, 
+    // in the order they were pushed.
+    //
+
+    void drain_remote_ready();
+
+    //
+    // Pushes the thread onto m_pRemoteUnparkList. Can be called from any operating 
+    // system thread.
+    //
+
+    void remote_unpark(UThread *thread);
+
+    //
+    // Unparks the threads in m_pRemoteUnparkList, in the order they were pushed, 
+    // forwarding the ones that meanwhile migrated to another scheduler.
+    //
+
+    void drain_remote_unparks();
+
+    //
+    // Drains the remote lists, when they are not empty.
+    //
+
+    void poll_remote();
+
+    //
+    // Prints the scheduler's threads. Must be called on the scheduler's own 
+    // operating system thread, or while the scheduler is not running.
+    //
+
+    void dump_threads(FILE *stream);
+
+    //
+    // Serves a pending Dump() made from another operating system thread.
+    //
+
+    void serve_dump();
 
     //
-    // Returns and removes the first user thread in the ready queue. 
-    // If the ready queue is empty, the main thread is returned.
+    // The deterministic path of Choose(), which replays or records the choice.
     //
 
-    static UThread * find_next_thread();
+    unsigned choose(unsigned n);
+
+    //
+    // Adds the threads to m_allThreads.
+    //
+
+    void register_threads(UThread *threads, int count);
+
+    //
+    // Removes the thread from m_allThreads.
+    //
+
+    void unregister_thread(UThread *thread);
+
+    //
+    // Makes the target scheduler own the thread, which must not be in any queue.
+    //
+
+    static void transfer_thread(UThread *thread, UScheduler *target);
+
+    //
+    // Saves the vector state of the thread owning the registers and loads the 
+    // next thread's.
+    //
+
+    void switch_vector_state(UThread *nextThread);
+
+    //
+    // Saves the vector state of the thread owning the registers, if any, leaving 
+    // the registers without an owner.
+    //
+
+    void release_vector_state();
+
+    //
+    // Hands the thread that switched out in UThread::MigrateTo() over to its 
+    // destination scheduler. Called by context_switch().
+    //
+
+    void finish_migration();
 
     //
     // UThread instances can access the USchedulers's private state.
     //
 
     friend class UThread;
+
+    //
+    // OffloadPool's helper threads wake the threads whose requests complete.
+    //
+
+    friend class OffloadPool;
+
+    //
+    // The load balancer inspects and moves the ready threads of running schedulers.
+    //
+
+    friend class LoadBalancer;
+
+    //
+    // The preemption timer watches the running thread.
+    //
+
+    friend class PreemptionTimer;
+
+    //
+    // The deadlock detector maintains the blocked list.
+    //
+
+    friend class DeadlockDetector;
+
+    //
+    // The reclaimer keeps track of the scheduler's epochs and retired objects.
+    //
+
+    friend class Reclaimer;
+
+    //
+    // Buffer pools tell whether buffers are released on their scheduler.
+    //
+
+    friend class BufferPool;
 };
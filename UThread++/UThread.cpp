@@ -17,299 +17,2208 @@
 #include <cassert>
 #include <cstdlib>
 #include <list>
+#include <new>
+#include <windows.h>
+#include <psapi.h>
+#include <dbghelp.h>
+
+//
+// WinBase.h defines Yield() as an empty macro.
+//
+
+#undef Yield
+
+#include "DeadlockDetector.h"
+#include "LoadBalancer.h"
+#include "OffloadPool.h"
+#include "PreemptionTimer.h"
+#include "Probes.h"
+#include "Reclaimer.h"
 #include "UScheduler.h"
 #include "UThread.h"
 
-using namespace std;
+using namespace std;
+
+#pragma comment(lib, "psapi.lib")
+#pragma comment(lib, "dbghelp.lib")
+
+//
+// An oversimplified unique ID generator seed. It is shared by the schedulers 
+// running on all operating system threads.
+//
+
+static volatile LONG m_threadIdSeed = 0;
+
+//
+// The lock protecting the parent and child links of all user threads.
+//
+
+static volatile LONG m_familyLock = 0;
+
+//
+// The scheduler bound to the calling operating system thread.
+//
+
+__declspec(thread) UScheduler * UScheduler::m_pCurrent = NULL;
+
+//
+// The time stamp counter value at which the running thread's yield budget expires.
+//
+
+__declspec(thread) unsigned __int64 UThread::m_yieldDeadline = 0;
+
+//
+// Returns the current time in microseconds, used to account for idle time.
+//
+
+static LONGLONG now_microseconds()
+{
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+
+    //
+    // Split the conversion to avoid overflowing on long uptimes.
+    //
+
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart / frequency.QuadPart * 1000000 + 
+           counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart;
+}
+
+//
+// Returns the number of time stamp counter ticks per millisecond, measured 
+// against the performance counter on first use.
+//
+
+static unsigned __int64 tsc_per_millisecond()
+{
+    static unsigned __int64 ticksPerMillisecond;
+
+    if (ticksPerMillisecond == 0) {
+        LARGE_INTEGER frequency, start, now;
+        unsigned __int64 tscStart;
+
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&start);
+        tscStart = __rdtsc();
+
+        do {
+            QueryPerformanceCounter(&now);
+        } while ((now.QuadPart - start.QuadPart) * 1000 < frequency.QuadPart);
+
+        ticksPerMillisecond = __rdtsc() - tscStart;
+    }
+
+    return ticksPerMillisecond;
+}
+
+//
+// Forward declaration of the helper functions.
+//
+
+//
+// Performs a context switch from currentThread (switch out) to nextThread (switch in).
+// __fastcall sets the calling convention such that currentThread is in ECX and  
+// nextThread in EDX.
+//
+
+void __fastcall context_switch(UThread *currentThread, UThread *nextThread);
+
+//
+// Frees the resources associated with currentThread and switches to nextThread.
+// __fastcall sets the calling convention such that currentThread is in ECX and  
+// nextThread in EDX.
+//
+
+void __fastcall internal_exit(UThread *currentThread, UThread *nextThread);
+
+//
+// Definition of the UScheduler and UThread member functions.
+//
+
+//
+// Creates a scheduler instance. If no scheduler is bound to the calling 
+// operating system thread, the new instance becomes its current scheduler.
+//
+
+UScheduler::UScheduler()
+    : m_numThreads(0),
+      m_pRunningThread(NULL),
+      m_readyQueue(),
+      m_readyCount(0),
+      m_pMainThread(NULL),
+      m_pRemoteWakeList(NULL),
+      m_numRemoteWakers(0),
+      m_remoteWakeEvent(CreateEvent(NULL, FALSE, FALSE, NULL)),
+      m_numPendingOffloads(0),
+      m_numPendingUnparks(0),
+      m_pRemoteReadyList(NULL),
+      m_pRemoteUnparkList(NULL),
+      m_pMigratingThread(NULL),
+      m_pMigrationTarget(NULL),
+      m_pShedTarget(NULL),
+      m_shedCount(0),
+      m_numaNode(-1),
+      m_idlePolicy(),
+      m_idleStatistics(),
+      m_stopRequested(false),
+      m_ownerThreadId(0),
+      m_preemptionMode(NoPreemption),
+      m_quantumMilliseconds(0),
+      m_switchCount(0),
+      m_preemptRequested(false),
+      m_preemptionTimer(NULL),
+      m_preemptionStopEvent(NULL),
+      m_osThread(NULL),
+      m_yieldBudget(tsc_per_millisecond()),
+      m_pVectorOwner(NULL),
+      m_pEpochSlot(NULL),
+      m_pSealedBatches(NULL),
+      m_pOpenBatch(NULL),
+      m_pLastSealedBatch(NULL),
+      m_reclaimCountdown(0),
+      m_trackStackUsage(false),
+      m_stackStatistics(),
+      m_deterministic(false),
+      m_randomState(0),
+      m_trace(),
+      m_replayPosition(0),
+      m_replayLength(0),
+      m_detectDeadlocks(false),
+      m_blockedList(),
+      m_numDeadlocks(0),
+      m_numStuckThreads(0),
+      m_allThreads(),
+      m_pAllThreadsLock(new CRITICAL_SECTION),
+      m_pDumpStream(NULL),
+      m_dumpDoneEvent(CreateEvent(NULL, FALSE, FALSE, NULL))
+{
+    InitializeCriticalSection((CRITICAL_SECTION *) m_pAllThreadsLock);
+
+    if (m_pCurrent == NULL) {
+        m_pCurrent = this;
+    }
+}
+
+//
+// The UScheduler destructor.
+//
+
+UScheduler::~UScheduler()
+{
+    assert(m_pRunningThread == NULL);
+    assert(m_readyQueue.empty());
+
+    if (m_pCurrent == this) {
+        m_pCurrent = NULL;
+    }
+
+    //
+    // A helper thread may still be about to signal the event of a request that 
+    // was already drained.
+    //
+
+    while (m_numRemoteWakers != 0) {
+        SwitchToThread();
+    }
+
+    CloseHandle(m_remoteWakeEvent);
+    CloseHandle(m_dumpDoneEvent);
+    DeleteCriticalSection((CRITICAL_SECTION *) m_pAllThreadsLock);
+    delete (CRITICAL_SECTION *) m_pAllThreadsLock;
+}
+
+//
+// Runs the scheduler. The operating system thread that calls the function 
+// switches to a user thread and resumes execution only when all user 
+// threads have exited. While running, the instance is the current scheduler 
+// of the calling operating system thread.
+//
+
+void UScheduler::Run()
+{
+    //
+    // An instance can only be run by one operating system thread at a time.
+    //
+
+    assert(m_pRunningThread == NULL);
+
+    if (m_pRemoteReadyList != NULL) {
+        drain_remote_ready();
+    }
+
+    if (m_readyQueue.empty() && !m_idlePolicy.StayAlive) {
+        return;
+    }
+
+    UScheduler *previousScheduler = m_pCurrent;
+    m_pCurrent = this;
+    m_ownerThreadId = GetCurrentThreadId();
+
+    UCHAR numaNode;
+    if (GetNumaProcessorNode((UCHAR) GetCurrentProcessorNumber(), &numaNode)) {
+        m_numaNode = numaNode;
+    }
+
+    //
+    // Create the proxy for the underyling operating system thread. This instance 
+    // will not allocate space for the thread's stack.
+    //
+
+    UThread mainThread(*this);
+    m_pMainThread = &mainThread;
+
+    //
+    // The main thread always preserves its vector state, which is in the registers.
+    //
+
+    m_pVectorOwner = &mainThread;
+
+    //
+    // Switch to a user thread. While running, the scheduler can exchange threads 
+    // with the other running schedulers.
+    //
+    
+    if (m_preemptionMode != NoPreemption) {
+        PreemptionTimer::start(this);
+    }
+
+    Reclaimer::register_scheduler(this);
+    LoadBalancer::register_scheduler(this);
+    UThread::switch_context(&mainThread, find_next_thread());
+
+    //
+    // The main thread is also switched in to complete a migration when no other 
+    // thread is ready, in which case the scheduler goes on waiting for work.
+    //
+
+    while (!m_readyQueue.empty() || must_wait()) {
+        UThread::switch_context(&mainThread, find_next_thread());
+    }
+
+    LoadBalancer::unregister_scheduler(this);
+
+    //
+    // Threads may have been handed over to this scheduler before it unregistered, 
+    // and unparks of threads that migrated away must still be forwarded.
+    //
+
+    while (m_pRemoteReadyList != NULL || m_pRemoteUnparkList != NULL) {
+        UThread::switch_context(&mainThread, find_next_thread());
+    }
+
+    Reclaimer::unregister_scheduler(this);
+
+    if (m_preemptionTimer != NULL) {
+        PreemptionTimer::stop(this);
+    }
+
+    //
+    // When we get here, there are no more runnable user threads (although there 
+    // might be threads blocked on synchronizers).
+    //
+
+    assert(m_readyQueue.empty());
+
+    if (m_detectDeadlocks) {
+        DeadlockDetector::report_stuck(this);
+    }
+
+    //
+    // Allow another call to UScheduler::Run().
+    //
+
+    m_pRunningThread = NULL;
+    m_stopRequested = false;
+    m_ownerThreadId = 0;
+    m_pCurrent = previousScheduler;
+}
+
+//
+// Makes a scheduler that stays alive return from Run() once its ready queue 
+// is empty. Can be called from any operating system thread.
+//
+
+void UScheduler::Stop()
+{
+    m_stopRequested = true;
+    SetEvent(m_remoteWakeEvent);
+}
+
+//
+// Sets how long, in microseconds, a thread runs before UThread::MaybeYield() 
+// yields to the other ready threads.
+//
+
+void UScheduler::SetYieldBudget(int microseconds)
+{
+    m_yieldBudget = tsc_per_millisecond() * microseconds / 1000;
+}
+
+//
+// Makes every scheduling choice pseudo-random, with the specified seed, and 
+// recorded in a trace.
+//
+
+void UScheduler::SetDeterministic(unsigned seed)
+{
+    SetReplay(vector<unsigned>(), seed);
+}
+
+//
+// Makes the scheduler deterministic and repeat the choices in the trace before 
+// continuing with the seeded generator.
+//
+
+void UScheduler::SetReplay(const vector<unsigned> &trace, unsigned seed)
+{
+    m_deterministic = true;
+    m_randomState = seed != 0 ? seed : 0x9E3779B9;
+    m_trace = trace;
+    m_replayPosition = 0;
+    m_replayLength = trace.size();
+}
+
+//
+// The deterministic path of Choose(). Replays the next recorded choice, if any, 
+// or else draws one from a xorshift generator and records it.
+//
+
+unsigned UScheduler::choose(unsigned n)
+{
+    if (m_replayPosition < m_replayLength) {
+        unsigned choice = m_trace[m_replayPosition];
+
+        if (choice < n) {
+            m_replayPosition += 1;
+            return choice;
+        }
+
+        //
+        // A choice out of range means the run diverged from the recorded one. 
+        // Stop replaying, keeping only the choices actually made.
+        //
+
+        m_trace.resize(m_replayPosition);
+        m_replayLength = m_replayPosition;
+    }
+
+    m_randomState ^= m_randomState << 13;
+    m_randomState ^= m_randomState >> 17;
+    m_randomState ^= m_randomState << 5;
+
+    unsigned choice = m_randomState % n;
+    m_trace.push_back(choice);
+    m_replayPosition = m_replayLength = m_trace.size();
+    return choice;
+}
+
+//
+// Returns the scheduler bound to the calling operating system thread.
+//
+
+UScheduler & UScheduler::Current()
+{
+    assert(m_pCurrent != NULL);
+    return *m_pCurrent;
+}
+
+//
+// Runs the specified blocking function on an operating system helper thread and 
+// returns its result. The current user thread is parked meanwhile, so the other 
+// user threads keep running.
+//
+
+void * UScheduler::Offload(BlockingFunction function, void *argument)
+{
+    PreemptionGuard guard;
+    OffloadRequest request;
+
+    request.Function = function;
+    request.Argument = argument;
+    request.Thread = &UThread::Current();
+    request.Scheduler = m_pCurrent;
+    request.Completed = false;
+
+    m_pCurrent->m_numPendingOffloads += 1;
+    OffloadPool::Submit(&request);
+
+    //
+    // Park until the scheduler completes the request. A pending park permit or a 
+    // cancellation may wake the thread earlier, so park again until then.
+    //
+
+    do {
+        UThread::Park();
+    } while (!request.Completed);
+
+    return request.Result;
+}
+
+//
+// Returns the time, in microseconds, on the clock used by timers.
+//
+
+__int64 UScheduler::Now()
+{
+    return now_microseconds();
+}
+
+//
+// Arms the timer. The list is kept in expiration order; it is searched from 
+// the end, as timers are mostly set to expire after those already armed.
+//
+
+void UScheduler::SetTimer(SchedulerTimer *timer, __int64 due)
+{
+    UThread *callerThread = UThread::disable_preemption();
+
+    assert(m_ownerThreadId == GetCurrentThreadId() && !IsTimerSet(timer));
+
+    SchedulerTimer *position = m_timers.back();
+    while (position != NULL && position->Due > due) {
+        position = m_timers.prev(position);
+    }
+
+    timer->Due = due;
+    m_timers.insert_after(position, timer);
+
+    UThread::restore_preemption(callerThread);
+}
+
+//
+// Disarms the timer.
+//
+
+void UScheduler::CancelTimer(SchedulerTimer *timer)
+{
+    UThread *callerThread = UThread::disable_preemption();
+
+    assert(m_ownerThreadId == GetCurrentThreadId());
+
+    if (IsTimerSet(timer)) {
+        m_timers.remove(timer);
+    }
+
+    UThread::restore_preemption(callerThread);
+}
+
+//
+// Calls the callbacks of the timers that expired, in expiration order. Each 
+// timer is disarmed before its callback runs, which can set it again.
+//
+
+void UScheduler::fire_timers()
+{
+    if (m_timers.empty()) {
+        return;
+    }
+
+    __int64 now = now_microseconds();
+
+    while (!m_timers.empty() && m_timers.front()->Due <= now) {
+        SchedulerTimer *timer = m_timers.pop_front();
+        timer->Expired(timer);
+    }
+}
+
+//
+// Returns how long the scheduler can block before its first timer expires, 
+// rounded up to whole milliseconds, or INFINITE if there are no timers.
+//
+
+unsigned UScheduler::timer_timeout()
+{
+    if (m_timers.empty()) {
+        return INFINITE;
+    }
+
+    __int64 remaining = m_timers.front()->Due - now_microseconds();
+    return remaining <= 0 ? 0 : (unsigned) ((remaining + 999) / 1000);
+}
+
+//
+// Returns and removes the first user thread in the ready queue. If the ready 
+// queue is empty, waits for work according to the idle policy, returning the 
+// main thread when there is nothing left to wait for.
+//
+
+UThread * UScheduler::find_next_thread() 
+{
+    UThread *nextThread;
+
+    //
+    // Catch stack overflows of the outgoing thread in debug builds.
+    //
+
+    assert(m_pRunningThread == NULL || m_pRunningThread->stack_intact());
+
+    if (m_shedCount != 0) {
+        LoadBalancer::shed_threads(this);
+    }
+
+    poll_remote();
+
+    if (!m_timers.empty()) {
+        fire_timers();
+    }
+
+    //
+    // Passing through here is a quiescent state for the reclaimer, which only 
+    // has work to do when the epoch changed or batches wait to be freed.
+    //
+
+    if (m_pEpochSlot != NULL && (*m_pEpochSlot != Reclaimer::m_globalEpoch || 
+                                 m_pSealedBatches != NULL || Reclaimer::m_pOrphans != NULL)) {
+        Reclaimer::quiescent(this);
+    }
+
+    //
+    // A migrating thread is only handed over by the switch, so the scheduler 
+    // must not block before it; the main thread is switched in instead and 
+    // Run() comes back here once the migration is done.
+    //
+
+    if (!m_readyQueue.empty() || (m_pMigratingThread == NULL && wait_for_work())) {
+        if (m_deterministic) {
+            nextThread = m_readyQueue.front();
+            for (unsigned skip = Choose(m_readyCount); skip > 0; --skip) {
+                nextThread = m_readyQueue.next(nextThread);
+            }
+            m_readyQueue.remove(nextThread);
+        } else {
+            nextThread = m_readyQueue.pop_front();
+        }
+        m_readyCount -= 1;
+    } else {
+        nextThread = m_pMainThread;
+    }
+
+    //
+    // The next thread starts a new quantum. The preemption request is only cleared 
+    // when set, so switches do not write to the cache line the timer writes to.
+    //
+
+    m_switchCount += 1;
+    if (m_preemptRequested) {
+        m_preemptRequested = false;
+    }
+    UThread::m_yieldDeadline = m_deterministic ? 0 : __rdtsc() + m_yieldBudget;
+
+    //
+    // Only switches to threads with VectorState swap the floating point and SIMD 
+    // registers, and only if they hold another thread's state.
+    //
+
+    if (nextThread->m_vectorState && nextThread != m_pVectorOwner) {
+        switch_vector_state(nextThread);
+    }
+
+    nextThread->m_state = UThread::Running;
+    return nextThread;
+}
+
+//
+// Waits for the ready queue to become non-empty, following the idle policy. 
+// Returns false if there is nothing left to wait for.
+//
+
+bool UScheduler::wait_for_work()
+{
+    LONGLONG stageStart = now_microseconds();
+    LONGLONG now = stageStart;
+    LONGLONG stageEnd;
+
+    //
+    // Busy-poll the remote lists, for the lowest wake-up latency.
+    //
+
+    stageEnd = stageStart + m_idlePolicy.SpinMicroseconds;
+    while (must_wait() && now < stageEnd) {
+        YieldProcessor();
+        poll_remote();
+        fire_timers();
+        now = now_microseconds();
+
+        if (!m_readyQueue.empty()) {
+            m_idleStatistics.SpinTime += now - stageStart;
+            m_idleStatistics.SpinWakeups += 1;
+            return true;
+        }
+    }
+
+    m_idleStatistics.SpinTime += now - stageStart;
+
+    //
+    // Let other operating system threads run on this processor.
+    //
+
+    stageStart = now;
+    stageEnd = stageStart + m_idlePolicy.YieldMicroseconds;
+    while (must_wait() && now < stageEnd) {
+        SwitchToThread();
+        poll_remote();
+        fire_timers();
+        now = now_microseconds();
+
+        if (!m_readyQueue.empty()) {
+            m_idleStatistics.YieldTime += now - stageStart;
+            m_idleStatistics.YieldWakeups += 1;
+            return true;
+        }
+    }
+
+    m_idleStatistics.YieldTime += now - stageStart;
+
+    //
+    // Block until another operating system thread pushes work or calls Stop(), 
+    // or until the first timer expires.
+    //
+
+    stageStart = now;
+    Reclaimer::offline(this);
+
+    while (must_wait()) {
+        WaitForSingleObject(m_remoteWakeEvent, timer_timeout());
+        poll_remote();
+        fire_timers();
+
+        if (!m_readyQueue.empty()) {
+            Reclaimer::online(this);
+            m_idleStatistics.BlockTime += now_microseconds() - stageStart;
+            m_idleStatistics.BlockWakeups += 1;
+            return true;
+        }
+    }
+
+    Reclaimer::online(this);
+    m_idleStatistics.BlockTime += now_microseconds() - stageStart;
+    return false;
+}
+
+//
+// Hands the completed request over to the scheduler of the requesting thread. 
+// Can be called from any operating system thread.
+//
+
+void UScheduler::remote_wake(OffloadRequest *request)
+{
+    //
+    // The request is not completed here: the requesting thread may be woken by 
+    // a park permit or a cancellation and would then return, exit and free its 
+    // stack while the request is still being pushed. The scheduler completes it 
+    // instead, so only the scheduler is touched after the push, and it is kept 
+    // alive by m_numRemoteWakers.
+    //
+
+    UScheduler *scheduler = request->Scheduler;
+    OffloadRequest *head;
+
+    InterlockedIncrement(&scheduler->m_numRemoteWakers);
+
+    do {
+        head = scheduler->m_pRemoteWakeList;
+        request->Next = head;
+    } while (InterlockedCompareExchangePointer((PVOID volatile *) &scheduler->m_pRemoteWakeList, 
+                                               request, head) != head);
+
+    SetEvent(scheduler->m_remoteWakeEvent);
+    InterlockedDecrement(&scheduler->m_numRemoteWakers);
+}
+
+//
+// Completes the requests in m_pRemoteWakeList and unparks their threads, in 
+// the order they were pushed.
+//
+
+void UScheduler::drain_remote_wakes()
+{
+    OffloadRequest *list = (OffloadRequest *) 
+        InterlockedExchangePointer((PVOID volatile *) &m_pRemoteWakeList, NULL);
+
+    //
+    // The list is LIFO; reverse it so that threads are unparked in completion order.
+    //
+
+    OffloadRequest *reversed = NULL;
+    while (list != NULL) {
+        OffloadRequest *next = list->Next;
+        list->Next = reversed;
+        reversed = list;
+        list = next;
+    }
+
+    //
+    // Read the link before completing the request, which frees it as soon as 
+    // the requesting thread runs.
+    //
+
+    while (reversed != NULL) {
+        OffloadRequest *request = reversed;
+        UThread *thread = request->Thread;
+        reversed = request->Next;
+        m_numPendingOffloads -= 1;
+        request->Completed = true;
+        thread->Unpark();
+    }
+}
+
+//
+// Pushes the chain of ready threads from first to last, linked through 
+// UThread::m_pNextRemoteReady, onto m_pRemoteReadyList. Can be called from 
+// any operating system thread.
+//
+
+void UScheduler::remote_ready(UThread *first, UThread *last)
+{
+    UThread *head;
+
+    do {
+        head = m_pRemoteReadyList;
+        last->m_pNextRemoteReady = head;
+    } while (InterlockedCompareExchangePointer((PVOID volatile *) &m_pRemoteReadyList, 
+                                               first, head) != head);
+
+    SetEvent(m_remoteWakeEvent);
+}
+
+//
+// Places the threads in m_pRemoteReadyList at the end of the ready queue, 
+// in the order they were pushed.
+//
+
+void UScheduler::drain_remote_ready()
+{
+    UThread *list = (UThread *) InterlockedExchangePointer((PVOID volatile *) &m_pRemoteReadyList, 
+                                                           NULL);
+    UThread *reversed = NULL;
+    while (list != NULL) {
+        UThread *next = list->m_pNextRemoteReady;
+        list->m_pNextRemoteReady = reversed;
+        reversed = list;
+        list = next;
+    }
+
+    while (reversed != NULL) {
+        UThread *thread = reversed;
+        reversed = thread->m_pNextRemoteReady;
+        assert(thread->m_pScheduler == this && thread->m_state == UThread::Ready);
+        m_readyQueue.push_back(thread);
+        m_readyCount += 1;
+    }
+}
+
+//
+// Drains both remote lists, when they are not empty.
+//
+
+void UScheduler::poll_remote()
+{
+    if (m_pRemoteWakeList != NULL) {
+        drain_remote_wakes();
+    }
+
+    if (m_pRemoteReadyList != NULL) {
+        drain_remote_ready();
+    }
+
+    if (m_pRemoteUnparkList != NULL) {
+        drain_remote_unparks();
+    }
+
+    if (m_pDumpStream != NULL) {
+        serve_dump();
+    }
+}
+
+//
+// Pushes the thread onto m_pRemoteUnparkList. Can be called from any operating 
+// system thread.
+//
+
+void UScheduler::remote_unpark(UThread *thread)
+{
+    UThread *head;
+
+    //
+    // Once pushed, the thread may be unparked and exit, and its scheduler may 
+    // stop and be destroyed, before the event is signaled.
+    //
+
+    InterlockedIncrement(&m_numRemoteWakers);
+
+    do {
+        head = m_pRemoteUnparkList;
+        thread->m_pNextRemoteUnpark = head;
+    } while (InterlockedCompareExchangePointer((PVOID volatile *) &m_pRemoteUnparkList, 
+                                               thread, head) != head);
+
+    SetEvent(m_remoteWakeEvent);
+    InterlockedDecrement(&m_numRemoteWakers);
+}
+
+//
+// Unparks the threads in m_pRemoteUnparkList, in the order they were pushed. 
+// A thread that migrated to another scheduler after being pushed is forwarded 
+// there, still marked as pending, so that it cannot exit before the unpark is 
+// delivered.
+//
+
+void UScheduler::drain_remote_unparks()
+{
+    UThread *list = (UThread *) InterlockedExchangePointer((PVOID volatile *) &m_pRemoteUnparkList, 
+                                                           NULL);
+    UThread *reversed = NULL;
+    while (list != NULL) {
+        UThread *next = list->m_pNextRemoteUnpark;
+        list->m_pNextRemoteUnpark = reversed;
+        reversed = list;
+        list = next;
+    }
+
+    while (reversed != NULL) {
+        UThread *thread = reversed;
+        reversed = thread->m_pNextRemoteUnpark;
+
+        if (thread->m_pScheduler != this) {
+            thread->m_pScheduler->remote_unpark(thread);
+        } else {
+            thread->m_unparkPending = 0;
+            thread->Unpark();
+        }
+    }
+}
+
+//
+// Hands the thread that switched out in UThread::MigrateTo() over to its 
+// destination scheduler. Called by context_switch(), on the stack of the 
+// thread being switched in.
+//
+
+void UScheduler::finish_migration()
+{
+    UThread *thread = m_pMigratingThread;
+    UScheduler *target = m_pMigrationTarget;
+
+    m_pMigratingThread = NULL;
+
+    transfer_thread(thread, target);
+    target->remote_ready(thread, thread);
+}
+
+//
+// Adds the threads to m_allThreads.
+//
+
+void UScheduler::register_threads(UThread *threads, int count)
+{
+    EnterCriticalSection((CRITICAL_SECTION *) m_pAllThreadsLock);
+    for (int i = 0; i < count; ++i) {
+        m_allThreads.push_back(&threads[i]);
+    }
+    LeaveCriticalSection((CRITICAL_SECTION *) m_pAllThreadsLock);
+}
+
+//
+// Removes the thread from m_allThreads.
+//
+
+void UScheduler::unregister_thread(UThread *thread)
+{
+    EnterCriticalSection((CRITICAL_SECTION *) m_pAllThreadsLock);
+    m_allThreads.remove(thread);
+    LeaveCriticalSection((CRITICAL_SECTION *) m_pAllThreadsLock);
+}
+
+//
+// Makes the target scheduler own the thread, which must not be in any queue.
+//
+
+void UScheduler::transfer_thread(UThread *thread, UScheduler *target)
+{
+    UScheduler *source = thread->m_pScheduler;
+
+    //
+    // The thread's vector state may be in the registers of the source's operating 
+    // system thread, on which this runs.
+    //
+
+    if (source->m_pVectorOwner == thread) {
+        source->release_vector_state();
+    }
+
+    source->unregister_thread(thread);
+    InterlockedDecrement(&source->m_numThreads);
+
+    thread->m_pScheduler = target;
+
+    InterlockedIncrement(&target->m_numThreads);
+    target->register_threads(thread, 1);
+}
+
+//
+// Saves the vector state of the thread owning the registers and loads the next 
+// thread's.
+//
+
+void UScheduler::switch_vector_state(UThread *nextThread)
+{
+    if (m_pVectorOwner != NULL) {
+        m_pVectorOwner->save_vector_state();
+    }
+
+    nextThread->load_vector_state();
+    m_pVectorOwner = nextThread;
+}
+
+//
+// Saves the vector state of the thread owning the registers, if any, leaving 
+// the registers without an owner.
+//
+
+void UScheduler::release_vector_state()
+{
+    if (m_pVectorOwner != NULL) {
+        m_pVectorOwner->save_vector_state();
+        m_pVectorOwner = NULL;
+    }
+}
+
+//
+// Prints every user thread of the scheduler, with its state, what it is blocked 
+// on and its backtrace.
+//
+
+void UScheduler::Dump(FILE *stream)
+{
+    if (m_ownerThreadId == 0 || m_ownerThreadId == GetCurrentThreadId()) {
+        dump_threads(stream);
+        return;
+    }
+
+    //
+    // The threads' stacks and states change under a running scheduler, so ask 
+    // its operating system thread to make the dump. Dumps made from other 
+    // operating system threads are served one at a time.
+    //
+
+    while (InterlockedCompareExchangePointer((PVOID volatile *) &m_pDumpStream, 
+                                             stream, NULL) != NULL) {
+        SwitchToThread();
+    }
+
+    SetEvent(m_remoteWakeEvent);
+
+    if (WaitForSingleObject(m_dumpDoneEvent, m_dumpTimeout) == WAIT_OBJECT_0) {
+        return;
+    }
+
+    //
+    // Withdraw the request, unless the scheduler already took it.
+    //
+
+    if (InterlockedCompareExchangePointer((PVOID volatile *) &m_pDumpStream, 
+                                          NULL, stream) == stream) {
+        fprintf(stream, "Scheduler %p: not dumped, its operating system thread is busy\n", this);
+    } else {
+        WaitForSingleObject(m_dumpDoneEvent, INFINITE);
+    }
+}
+
+//
+// Serves a pending Dump() made from another operating system thread.
+//
+
+void UScheduler::serve_dump()
+{
+    FILE *stream = (FILE *) InterlockedExchangePointer((PVOID volatile *) &m_pDumpStream, NULL);
+
+    if (stream != NULL) {
+        dump_threads(stream);
+        SetEvent(m_dumpDoneEvent);
+    }
+}
+
+//
+// Prints the scheduler's threads. Must be called on the scheduler's own 
+// operating system thread, or while the scheduler is not running.
+//
+
+void UScheduler::dump_threads(FILE *stream)
+{
+    //
+    // A preempted caller would let another user thread of this operating system 
+    // thread enter the critical section recursively.
+    //
+
+    UThread *callerThread = UThread::disable_preemption();
+    EnterCriticalSection((CRITICAL_SECTION *) m_pAllThreadsLock);
+
+    int count = 0;
+    for (UThread *thread = m_allThreads.front(); thread != NULL; thread = m_allThreads.next(thread)) {
+        count += 1;
+    }
+
+    fprintf(stream, "Scheduler %p: %d thread(s), %ld ready\n", this, count, m_readyCount);
+    for (UThread *thread = m_allThreads.front(); thread != NULL; thread = m_allThreads.next(thread)) {
+        thread->dump(stream);
+    }
+
+    LeaveCriticalSection((CRITICAL_SECTION *) m_pAllThreadsLock);
+    UThread::restore_preemption(callerThread);
+}
+
+//
+// Creates a UThread instance without allocating memory for the stack.
+//
+
+UThread::UThread(UScheduler &scheduler) 
+    : m_pScheduler(&scheduler),
+      m_state(Running),
+      m_permit(false),
+      m_unparkPending(0),
+      m_preemptionDisabled(0),
+      m_schedulerBound(false)
+{
+    InterlockedIncrement(&m_pScheduler->m_numThreads);
+    m_threadId = InterlockedIncrement(&m_threadIdSeed);
+    m_pStack = NULL;
+    m_pStackTop = NULL;
+    m_growable = false;
+    m_pBatch = NULL;
+    m_pBlockedOn = NULL;
+    m_blockedOnKind = NULL;
+    m_pBlockedOnMutex = NULL;
+    m_waitNode.Next = m_waitNode.Prev = NULL;
+    m_pParent = NULL;
+    m_cancelled = 0;
+    m_vectorState = true;
+    m_vectorSaved = false;
+    Sanitizers::main_created(m_fiber);
+
+    m_pVectorArea = _aligned_malloc(m_vectorAreaSize, 16);
+    if (m_pVectorArea == NULL) {
+        throw bad_alloc();
+    }
+}
+
+//
+// Creates a UThread instance.
+//
+
+UThread::UThread(UScheduler &scheduler, Function function, Argument argument, unsigned flags) 
+    : m_pScheduler(&scheduler),
+      m_pFunction(function),
+      m_argument(argument),
+      m_state(Parked),
+      m_permit(false),
+      m_unparkPending(0),
+      m_preemptionDisabled(0),
+      m_schedulerBound(false),
+      m_growable((flags & GrowableStack) != 0),
+      m_pBatch(NULL),
+      m_pBlockedOn(NULL),
+      m_blockedOnKind(NULL),
+      m_pBlockedOnMutex(NULL),
+      m_pParent(NULL),
+      m_children(),
+      m_cancelled(0),
+      m_vectorState((flags & VectorState) != 0),
+      m_pVectorArea(NULL),
+      m_vectorSaved(false)
+{
+    unsigned char *stackLimit;
+
+    if (m_vectorState) {
+        m_pVectorArea = _aligned_malloc(m_vectorAreaSize, 16);
+        if (m_pVectorArea == NULL) {
+            throw bad_alloc();
+        }
+    }
+
+    InterlockedIncrement(&m_pScheduler->m_numThreads);
+    m_threadId = InterlockedIncrement(&m_threadIdSeed);
+
+    if (m_growable) {
+
+        //
+        // Reserve the whole region, but commit only the topmost pages and the guard 
+        // page below them. With the TEB's DeallocationStack pointing at the region, 
+        // the kernel commits the next page and moves the guard page down whenever 
+        // the thread touches it, exactly as it does for operating system threads.
+        //
+
+        m_pStack = (unsigned char *) VirtualAlloc(NULL, m_growableStackReserve, MEM_RESERVE, PAGE_NOACCESS);
+        if (m_pStack != NULL) {
+            stackLimit = m_pStack + m_growableStackReserve - m_growableStackCommit;
+
+            if (VirtualAlloc(stackLimit, m_growableStackCommit, MEM_COMMIT, PAGE_READWRITE) == NULL ||
+                VirtualAlloc(stackLimit - m_pageSize, m_pageSize, MEM_COMMIT, 
+                             PAGE_READWRITE | PAGE_GUARD) == NULL) {
+                VirtualFree(m_pStack, 0, MEM_RELEASE);
+                m_pStack = NULL;
+            }
+        }
+
+        if (m_pStack == NULL) {
+            InterlockedDecrement(&m_pScheduler->m_numThreads);
+            _aligned_free(m_pVectorArea);
+            throw bad_alloc();
+        }
+
+        m_pStackTop = m_pStack + m_growableStackReserve;
+        stackLimit = m_pStackTop - m_growableStackCommit;
+        m_pLowWater = stackLimit;
+    } else {
+        m_pStack = new (nothrow) unsigned char[m_stackSize];
+        if (m_pStack == NULL) {
+            InterlockedDecrement(&m_pScheduler->m_numThreads);
+            _aligned_free(m_pVectorArea);
+            throw bad_alloc();
+        }
+
+        m_pStackTop = m_pStack + m_stackSize;
+        stackLimit = m_pStack;
+
+        //
+        // Fill the stack with a known pattern, so its high-water mark can be found, 
+        // and place the overflow canary at its lowest word.
+        //
+
+        for (unsigned *word = (unsigned *) m_pStack; word < (unsigned *) m_pStackTop; ++word) {
+            *word = m_stackPattern;
+        }
+        *(unsigned *) m_pStack = m_stackCanary;
+    }
+
+    m_waitNode.Next = m_waitNode.Prev = NULL;
+    Sanitizers::stack_created(m_fiber, m_pStack, m_pStackTop - m_pStack);
+
+    init_context(stackLimit);
+    m_pScheduler->register_threads(this, 1);
+    adopt(this, 1);
+}
+
+//
+// Creates a UThread instance of a batch, whose stack was already allocated and 
+// zero-filled. Zero serves as the stack's fill pattern, so only the lowest page, 
+// which holds the overflow canary, is touched before the thread uses the stack.
+//
+
+UThread::UThread(UScheduler &scheduler, Function function, Argument argument, 
+                 unsigned char *stack, Batch *batch) 
+    : m_pScheduler(&scheduler),
+      m_pStack(stack),
+      m_pStackTop(stack + m_stackSize),
+      m_pFunction(function),
+      m_argument(argument),
+      m_state(Ready),
+      m_permit(false),
+      m_unparkPending(0),
+      m_preemptionDisabled(0),
+      m_schedulerBound(false),
+      m_growable(false),
+      m_pBatch(batch),
+      m_pBlockedOn(NULL),
+      m_blockedOnKind(NULL),
+      m_pBlockedOnMutex(NULL),
+      m_pParent(NULL),
+      m_children(),
+      m_cancelled(0),
+      m_vectorState(false),
+      m_pVectorArea(NULL),
+      m_vectorSaved(false)
+{
+    InterlockedIncrement(&m_pScheduler->m_numThreads);
+    m_threadId = InterlockedIncrement(&m_threadIdSeed);
+    m_waitNode.Next = m_waitNode.Prev = NULL;
+    Sanitizers::stack_created(m_fiber, m_pStack, m_stackSize);
+
+    *(unsigned *) m_pStack = m_stackCanary;
+    init_context(m_pStack);
+}
+
+//
+// Maps the thread's initial context at the top of its stack.
+//
+
+void UThread::init_context(unsigned char *stackLimit)
+{
+    //
+    // Map a UThread::Context on the thread's stack.
+    // We'll use it to save the initial context of the thread.
+    //
+    // +--------------+
+    // |  0x00000000  |    <- Highest word of a thread's stack space
+    // +==============+       (needs to be set to 0 for Visual Studio to
+    // | Context::Ret | \     correctly present a thread's call stack).
+    // +--------------+  |
+    // | Context::EBP |  |
+    // +--------------+  |
+    // | Context::EBX |   >   UThread::Context mapped on the stack.
+    // +--------------+  |
+    // | Context::ESI |  |
+    // +--------------+  |
+    // | Context::EDI |  |
+    // +--------------+  |
+    // |  ::Exception |  |
+    // |  ::List      |  |
+    // +--------------+  |
+    // |  ::StackBase |  |
+    // +--------------+  |
+    // |  ::StackLimit|  |
+    // +--------------+  |
+    // | ::Dealloca-  |  |
+    // |  tionStack   | /  <- Stack pointer will be set to this address
+    // +==============+       at the next context switch to this thread.
+    // |              | \
+    // +--------------+  |
+    // |       :      |  |
+    //         :          >   Remaining stack space.
+    // |       :      |  |
+    // +--------------+  |
+    // |              | /  <- Lowest word of a thread's stack space
+    // +--------------+       (m_pStack always points to this location).
+    //
+            
+    m_pContext = new (m_pStackTop - sizeof(unsigned) - sizeof(Context)) 
+                        UThread::Context(m_pStackTop, stackLimit, m_pStack);
+}
+
+//
+// The UThread destructor.
+//
+
+UThread::~UThread()
+{
+    InterlockedDecrement(&m_pScheduler->m_numThreads);
+
+    if (m_pStack != NULL) {
+        m_pScheduler->unregister_thread(this);
+        orphan();
+    }
+
+    if (m_pStack != NULL && m_pScheduler->m_trackStackUsage) {
+        StackStatistics &statistics = m_pScheduler->m_stackStatistics;
+        int highWater = StackHighWater();
+        int bucket = 0;
+
+        while (bucket < StackStatistics::NumBuckets - 1 && highWater > (512 << bucket)) {
+            bucket += 1;
+        }
+
+        statistics.Threads[bucket] += 1;
+        if ((unsigned) highWater > statistics.MaxHighWater) {
+            statistics.MaxHighWater = highWater;
+        }
+    }
+
+    //
+    // Deletes the stack space. Note that m_pStack may be null.
+    //
+
+    if (m_pStack != NULL) {
+        Sanitizers::stack_destroyed(m_fiber);
+    }
+
+    if (m_growable) {
+        VirtualFree(m_pStack, 0, MEM_RELEASE);
+    } else if (m_pBatch == NULL) {
+        delete[] m_pStack;
+    }
+
+    //
+    // The registers may still hold the thread's vector state, which is discarded.
+    //
+
+    if (m_pScheduler->m_pVectorOwner == this) {
+        m_pScheduler->m_pVectorOwner = NULL;
+    }
+
+    _aligned_free(m_pVectorArea);
+}
+
+//
+// Saves the x87, MMX and SSE registers, with the control and status words, to 
+// the thread's FXSAVE area.
+//
+
+void UThread::save_vector_state()
+{
+    void *area = m_pVectorArea;
+
+    __asm {
+        mov     eax, area
+        fxsave  [eax]
+    }
+
+    m_vectorSaved = true;
+}
+
+//
+// Loads the x87, MMX and SSE registers from the thread's FXSAVE area. A thread 
+// that never saved its state starts with the default control words.
+//
+
+void UThread::load_vector_state()
+{
+    void *area = m_pVectorArea;
+    unsigned defaultMxcsr = 0x1F80;
+
+    if (m_vectorSaved) {
+        __asm {
+            mov     eax, area
+            fxrstor [eax]
+        }
+    } else {
+        __asm {
+            fninit
+            ldmxcsr defaultMxcsr
+        }
+    }
+}
+
+//
+// Helper function called by assembly code to proxy the application of delete. 
+// Threads of a batch are destroyed in place, releasing the batch's memory 
+// block along with the last of them. The threads of a batch may be running 
+// on different schedulers, so the count is decremented atomically.
+//
+
+void UThread::self_destroy()
+{
+    Batch *batch = m_pBatch;
+
+    if (batch == NULL) {
+        delete this;
+        return;
+    }
+
+    this->~UThread();
+    if (InterlockedDecrement(&batch->Remaining) == 0) {
+        VirtualFree(batch->Block, 0, MEM_RELEASE);
+    }
+}
+
+//
+// Prints the thread's state, what it is blocked on and its backtrace. A thread 
+// that is not running saved its context on its own stack, so the backtrace 
+// starts at the context's return address and follows the saved EBP chain, 
+// which requires the code to keep frame pointers (/Oy-). The walk stays within 
+// the thread's stack, so a corrupted chain ends the backtrace early.
+//
+
+void UThread::dump(FILE *stream) const
+{
+    static const int maxFrames = 32;
+    static const char *stateNames[] = { "running", "ready", "parked" };
+
+    fprintf(stream, "  UThread %d (%p): %s", m_threadId, this, stateNames[m_state]);
+    if (m_pBlockedOn != NULL) {
+        fprintf(stream, ", blocked on %s %p", m_blockedOnKind, m_pBlockedOn);
+    }
+    fprintf(stream, "\n");
+
+    //
+    // A thread that is switching out already changed its state, but its context 
+    // is only saved once the switch is made, so it is still walked as running.
+    //
+
+    if (m_state == Running || m_pScheduler->m_pRunningThread == this) {
+        if (UScheduler::m_pCurrent != m_pScheduler || m_pScheduler->m_pRunningThread != this) {
+            fprintf(stream, "    (running on another operating system thread)\n");
+            return;
+        }
+
+        void *frames[maxFrames];
+        int depth = CaptureStackBackTrace(0, maxFrames, frames, NULL);
+        for (int i = 0; i < depth; ++i) {
+            print_frame(stream, frames[i]);
+        }
+        return;
+    }
+
+    void *pc = (void *) m_pContext->Ret;
+    unsigned *frame = (unsigned *) m_pContext->EBP;
+
+    for (int i = 0; i < maxFrames && pc != NULL; ++i) {
+        print_frame(stream, pc);
+
+        if ((unsigned char *) frame < m_pStack || (unsigned char *) (frame + 2) > m_pStackTop) {
+            break;
+        }
+
+        unsigned *next = (unsigned *) frame[0];
+        pc = (void *) frame[1];
+        if (next <= frame) {
+            break;
+        }
+        frame = next;
+    }
+}
+
+//
+// Prints a backtrace frame as module!symbol+offset when DbgHelp finds the symbol, 
+// or as the bare address otherwise. DbgHelp is single-threaded, so its calls are 
+// serialized, and the symbols are loaded on the first use.
+//
+
+static volatile LONG m_symbolLock = 0;
+static bool m_symbolsLoaded = false;
+
+void UThread::print_frame(FILE *stream, void *address)
+{
+    union {
+        SYMBOL_INFO Info;
+        char Buffer[sizeof(SYMBOL_INFO) + MAX_SYM_NAME];
+    } symbol;
+    DWORD64 displacement = 0;
+
+    while (InterlockedExchange(&m_symbolLock, 1) != 0) {
+        SwitchToThread();
+    }
+
+    if (!m_symbolsLoaded) {
+        SymSetOptions(SymGetOptions() | SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS);
+        SymInitialize(GetCurrentProcess(), NULL, TRUE);
+        m_symbolsLoaded = true;
+    }
+
+    symbol.Info.SizeOfStruct = sizeof(SYMBOL_INFO);
+    symbol.Info.MaxNameLen = MAX_SYM_NAME;
+
+    if (SymFromAddr(GetCurrentProcess(), (DWORD64) (DWORD_PTR) address, &displacement, &symbol.Info)) {
+        fprintf(stream, "    at %p %s+0x%I64x\n", address, symbol.Info.Name, displacement);
+    } else {
+        fprintf(stream, "    at %p\n", address);
+    }
+
+    InterlockedExchange(&m_symbolLock, 0);
+}
+
+//
+// Creates a user thread to run the specified function. The thread is placed 
+// at the end of the current scheduler's ready queue.
+//
+
+void UThread::Create(Function function, Argument argument, unsigned flags)
+{
+    Create(UScheduler::Current(), function, argument, flags);
+}
+
+//
+// Creates a user thread to run the specified function. The thread is placed 
+// at the end of the specified scheduler's ready queue. Unless the scheduler 
+// is running on the calling operating system thread, the thread is handed 
+// over through the scheduler's remote list, which Run() drains.
+//
+
+void UThread::Create(UScheduler &scheduler, Function function, Argument argument, unsigned flags)
+{
+    UThread *callerThread = disable_preemption();
+    UThread *thread = new UThread(scheduler, function, argument, flags);
+
+    UTHREAD_PROBE_SPAWN(thread->m_threadId, callerThread != NULL ? callerThread->m_threadId : 0);
+
+    if (scheduler.m_ownerThreadId == GetCurrentThreadId()) {
+        thread->Unpark();
+    } else {
+        thread->m_state = Ready;
+        scheduler.remote_ready(thread, thread);
+    }
+
+    restore_preemption(callerThread);
+}
+
+//
+// Creates count user threads running the specified function, the i-th one with 
+// arguments[i]. The threads are appended to the current scheduler's ready queue.
+//
+
+void UThread::CreateBatch(Function function, Argument arguments[], int count)
+{
+    CreateBatch(UScheduler::Current(), function, arguments, count);
+}
+
+//
+// Creates count user threads running the specified function, the i-th one with 
+// arguments[i]. A single mapping holds the UThread instances, followed by the 
+// batch header and, from the next page boundary on, the stacks:
+//
+// +---------------+---------------+-------+-----------+-----------+-------+
+// | UThread 0 ... | UThread n - 1 | Batch | stack 0   | stack 1   |  ...  |
+// +---------------+---------------+-------+-----------+-----------+-------+
+//
+// The threads are linked beforehand and appended to the ready queue with a 
+// single splice, or pushed to the remote list as a single chain.
+//
+
+void UThread::CreateBatch(UScheduler &scheduler, Function function, Argument arguments[], int count)
+{
+    if (count <= 0) {
+        return;
+    }
+
+    if ((size_t) count > ((size_t) -1 - sizeof(Batch) - m_pageSize) / (sizeof(UThread) + m_stackSize)) {
+        throw bad_alloc();
+    }
+
+    size_t headerSize = (count * sizeof(UThread) + sizeof(Batch) + m_pageSize - 1) & ~(m_pageSize - 1);
+    unsigned char *block = (unsigned char *) VirtualAlloc(NULL, headerSize + (size_t) count * m_stackSize, 
+                                                          MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (block == NULL) {
+        throw bad_alloc();
+    }
+
+    UThread *callerThread = disable_preemption();
+    UThread *threads = (UThread *) block;
+    Batch *batch = (Batch *) (threads + count);
+    unsigned char *stacks = block + headerSize;
+
+    batch->Block = block;
+    batch->Remaining = count;
+
+    List<UThread, &UThread::m_readyNode> ready;
+    UThread *chain = NULL;
+
+    for (int i = 0; i < count; ++i) {
+        UThread *thread = new (&threads[i]) UThread(scheduler, function, arguments[i], 
+                                                    stacks + i * m_stackSize, batch);
+
+        UTHREAD_PROBE_SPAWN(thread->m_threadId, callerThread != NULL ? callerThread->m_threadId : 0);
+
+        //
+        // The remote list is drained in reverse, so chain the threads backwards.
+        //
+
+        ready.push_back(thread);
+        thread->m_pNextRemoteReady = chain;
+        chain = thread;
+    }
+
+    scheduler.register_threads(threads, count);
+    adopt(threads, count);
+
+    if (scheduler.m_ownerThreadId == GetCurrentThreadId()) {
+        scheduler.m_readyQueue.splice_back(ready);
+        scheduler.m_readyCount += count;
+    } else {
+        scheduler.remote_ready(chain, &threads[0]);
+    }
+
+    restore_preemption(callerThread);
+}
+
+//
+// Relinquishes the processor to the first thread in the ready queue. 
+// If there are no ready threads, the function returns immediately.
+//
+
+void UThread::Yield()
+{
+    UScheduler *scheduler = UScheduler::m_pCurrent;
+    UThread *currentThread = scheduler->m_pRunningThread;
+
+    currentThread->m_preemptionDisabled += 1;
+    scheduler->poll_remote();
+
+    if (!scheduler->m_readyQueue.empty()) {
+        
+        //
+        // Place the current thread at the end of the ready queue, 
+        // so it can resume execution later on.
+        //
+
+        currentThread->m_state = Ready;
+        currentThread->m_schedulerBound = currentThread->m_preemptionDisabled > 1;
+        scheduler->m_readyQueue.push_back(currentThread);
+        scheduler->m_readyCount += 1;
+
+        //
+        // Remove the first thread in the ready queue and switch it in.
+        //
+        
+        switch_context(currentThread, scheduler->find_next_thread());
+    }
+
+    currentThread->m_preemptionDisabled -= 1;
+}
+
+//
+// Terminates the execution of the currently running thread. All associated 
+// resources will be freed after a context switch to the next ready thread. If 
+// there are no threads in the ready queue, then the main thread is switched in 
+// and the scheduler will exit.
+//
+
+__declspec(noreturn) void UThread::Exit()
+{
+    UScheduler *scheduler = UScheduler::m_pCurrent;
+    UThread *currentThread = scheduler->m_pRunningThread;
+
+    currentThread->m_preemptionDisabled += 1;
+
+    //
+    // An unpark from another operating system thread still refers to the thread 
+    // until it is delivered, so park until then. The scheduler waits for such 
+    // unparks as it does for offloads, and the thread cannot migrate meanwhile.
+    //
+
+    if (currentThread->m_unparkPending != 0) {
+        scheduler->m_numPendingUnparks += 1;
+        while (currentThread->m_unparkPending != 0) {
+            Park();
+        }
+        scheduler->m_numPendingUnparks -= 1;
+    }
+
+    UTHREAD_PROBE_EXIT(currentThread->m_threadId);
+
+    UThread *nextThread = scheduler->find_next_thread();
+
+    UTHREAD_PROBE_SWITCH(currentThread->m_threadId, nextThread->m_threadId);
+    Sanitizers::start_switch(currentThread->m_fiber, nextThread->m_fiber, true);
+    internal_exit(currentThread, nextThread);
+    assert(!"supposed to be here!");
+}
+
+//
+// Returns the UThread instance representing the currently executing thread.
+//
+
+UThread & UThread::Current() 
+{
+    UScheduler *scheduler = UScheduler::m_pCurrent;
+    assert(scheduler != NULL && scheduler->m_pRunningThread != NULL);
+    return *scheduler->m_pRunningThread;
+}
 
 //
-// An oversimplified unique ID generator seed.
+// Halts the execution of the current user thread until Unpark() is called on it.
+// If the thread's permit is available, it is consumed and the function returns 
+// immediately.
 //
 
-static int m_threadIdSeed = 0;
+bool UThread::Park()
+{
+    UScheduler *scheduler = UScheduler::m_pCurrent;
+    UThread *currentThread = scheduler->m_pRunningThread;
+
+    assert(currentThread != NULL);
+
+    if (currentThread->m_permit) {
+
+        //
+        // An Unpark() arrived before this call. Consume the permit and keep running.
+        //
+
+        currentThread->m_permit = false;
+        return currentThread->m_cancelled == 0;
+    }
+
+    currentThread->m_preemptionDisabled += 1;
+
+    if (currentThread->m_growable) {
+        currentThread->shrink_stack();
+    }
+
+    if (scheduler->m_detectDeadlocks) {
+        DeadlockDetector::parking(currentThread);
+    }
+
+    //
+    // Park() itself disabled preemption once; a deeper nesting means the caller 
+    // is a blocking operation that resumes using the scheduler's state.
+    //
+
+    currentThread->m_schedulerBound = currentThread->m_preemptionDisabled > 1 || 
+                                      scheduler->m_detectDeadlocks;
+    currentThread->m_state = Parked;
+    UTHREAD_PROBE_PARK(currentThread->m_threadId);
+    switch_context(currentThread, scheduler->find_next_thread());
+
+    if (scheduler->m_detectDeadlocks) {
+        DeadlockDetector::resumed(currentThread);
+    }
+
+    currentThread->m_preemptionDisabled -= 1;
+    return currentThread->m_cancelled == 0;
+}
 
 //
-// The number of existing user threads.
+// The callback of the timer set by Sleep(), which wakes the sleeping thread.
 //
 
-int UScheduler::m_numThreads = 0;
+static void wake_sleeper(SchedulerTimer *timer)
+{
+    ((UThread *) timer->Context)->Unpark();
+}
 
 //
-// The currently running thread.
+// Parks the current user thread until its timer expires. Preemption stays disabled, 
+// so the thread cannot be moved to another scheduler while its timer is armed. A 
+// pending park permit may wake the thread earlier, so it parks again until then.
 //
 
-UThread * UScheduler::m_pRunningThread = NULL;
+bool UThread::Sleep(int milliseconds)
+{
+    PreemptionGuard guard;
+    UScheduler &scheduler = UScheduler::Current();
+    SchedulerTimer timer;
+
+    if (Current().IsCancelled()) {
+        return false;
+    }
+
+    timer.Expired = wake_sleeper;
+    timer.Context = &Current();
+    scheduler.SetTimer(&timer, UScheduler::Now() + (__int64) milliseconds * 1000);
+
+    while (UScheduler::IsTimerSet(&timer)) {
+        if (!Park()) {
+            scheduler.CancelTimer(&timer);
+            return false;
+        }
+    }
+
+    return true;
+}
 
 //
-// The list of schedulable user threads.
-// The next thread to run is retrieved from the head of the list.
+// Places the UThread instance in the ready queue if it is parked, making the user 
+// thread eligible to run. Otherwise, makes the thread's permit available, so that 
+// its next call to Park() returns immediately. Permits do not accumulate.
 //
 
-list<UThread *> UScheduler::m_readyQueue;
+void UThread::Unpark()
+{
+    if (m_pScheduler->m_ownerThreadId != GetCurrentThreadId()) {
+        if (InterlockedExchange(&m_unparkPending, 1) == 0) {
+            m_pScheduler->remote_unpark(this);
+        }
+        return;
+    }
+
+    if (m_state != Parked) {
+
+        //
+        // The thread is either running or already in the ready queue.
+        //
+
+        m_permit = true;
+        return;
+    }
+
+    UThread *callerThread = disable_preemption();
+
+    m_state = Ready;
+    m_pScheduler->m_readyQueue.push_back(this);
+    m_pScheduler->m_readyCount += 1;
+    UTHREAD_PROBE_UNPARK(m_threadId);
+
+    restore_preemption(callerThread);
+}
 
 //
-// The user thread proxy of the main operating system thread. This thread 
-// is switched back in when there are no more runnable user threads and the 
-// scheduler will exit.
+// Acquires the lock protecting the parent and child links. It is a spin lock 
+// held with preemption disabled, for a few list operations or for the walk of 
+// a cancelled subtree. Returns the calling user thread, if any.
 //
 
-UThread * UScheduler::m_pMainThread;
+UThread * UThread::lock_family()
+{
+    UThread *callerThread = disable_preemption();
+
+    while (InterlockedExchange(&m_familyLock, 1) != 0) {
+        SwitchToThread();
+    }
+
+    return callerThread;
+}
 
 //
-// Forward declaration of the helper functions.
+// Releases the lock protecting the parent and child links.
 //
 
+void UThread::unlock_family(UThread *callerThread)
+{
+    InterlockedExchange(&m_familyLock, 0);
+    restore_preemption(callerThread);
+}
+
 //
-// Performs a context switch from currentThread (switch out) to nextThread (switch in).
-// __fastcall sets the calling convention such that currentThread is in ECX and  
-// nextThread in EDX.
+// Cancels the thread and its descendants. The subtree is walked in preorder 
+// without recursion, skipping the subtrees of threads that were already 
+// cancelled, as their children were cancelled with them or when created. 
+// Each newly cancelled thread, except the caller, is unparked so it can 
+// observe the cancellation; a thread that is not parked keeps the permit, 
+// and its next Park() returns at once.
 //
 
-void __fastcall context_switch(UThread *currentThread, UThread *nextThread);
+void UThread::Cancel()
+{
+    UThread *callerThread = lock_family();
+    UThread *thread = this;
+
+    for (;;) {
+        if (InterlockedExchange(&thread->m_cancelled, 1) == 0) {
+            if (thread != callerThread) {
+                thread->Unpark();
+            }
+
+            if (!thread->m_children.empty()) {
+                thread = thread->m_children.front();
+                continue;
+            }
+        }
+
+        while (thread != this && thread->m_pParent->m_children.next(thread) == NULL) {
+            thread = thread->m_pParent;
+        }
+
+        if (thread == this) {
+            break;
+        }
+
+        thread = thread->m_pParent->m_children.next(thread);
+    }
+
+    unlock_family(callerThread);
+}
 
 //
-// Frees the resources associated with currentThread and switches to nextThread.
-// __fastcall sets the calling convention such that currentThread is in ECX and  
-// nextThread in EDX.
+// Links the threads as children of the calling user thread, if there is one.
 //
 
-void __fastcall internal_exit(UThread *currentThread, UThread *nextThread);
+void UThread::adopt(UThread *threads, int count)
+{
+    UThread *callerThread = lock_family();
+
+    //
+    // The main thread has no stack and is destroyed when Run() returns, so it 
+    // never becomes a parent.
+    //
+
+    if (callerThread != NULL && callerThread->m_pStack != NULL) {
+        for (int i = 0; i < count; ++i) {
+            threads[i].m_pParent = callerThread;
+            threads[i].m_cancelled = callerThread->m_cancelled;
+            callerThread->m_children.push_back(&threads[i]);
+        }
+    }
+
+    unlock_family(callerThread);
+}
 
 //
-// Definition of the UScheduler and UThread member functions.
+// Hands the thread's children over to its parent, or leaves them without one, 
+// and unlinks the thread from its parent's list of children.
 //
 
+void UThread::orphan()
+{
+    UThread *callerThread = lock_family();
+
+    while (!m_children.empty()) {
+        UThread *child = m_children.pop_front();
+
+        child->m_pParent = m_pParent;
+        if (m_pParent != NULL) {
+            m_pParent->m_children.push_back(child);
+        }
+    }
+
+    if (m_pParent != NULL) {
+        m_pParent->m_children.remove(this);
+        m_pParent = NULL;
+    }
+
+    unlock_family(callerThread);
+}
+
 //
-// Runs the scheduler. The operating system thread that calls the function 
-// switches to a user thread and resumes execution only when all user threads 
-// have exited.
+// Moves the current user thread to the specified scheduler, which may be running 
+// on another operating system thread. The thread resumes execution there, at the 
+// end of the scheduler's ready queue. If the scheduler is not running, the thread 
+// only resumes once it is.
 //
 
-void UScheduler::Run()
+void UThread::MigrateTo(UScheduler &scheduler)
 {
-    //
-    // There can be only one scheduler instance running.
-    //
-
-    assert(m_pRunningThread == NULL);
+    UScheduler *currentScheduler = UScheduler::m_pCurrent;
+    UThread *currentThread = currentScheduler->m_pRunningThread;
 
-    if (m_readyQueue.empty()) {
+    if (&scheduler == currentScheduler) {
         return;
     }
 
     //
-    // Create the proxy for the underyling operating system thread. This instance 
-    // will not allocate space for the thread's stack.
+    // The thread cannot be handed over before its context is saved, so 
+    // context_switch() completes the migration on behalf of the next thread.
     //
 
-    UThread mainThread;
-    m_pMainThread = &mainThread;
+    currentThread->m_preemptionDisabled += 1;
+    currentThread->m_state = Ready;
+    currentThread->m_schedulerBound = false;
+    currentScheduler->m_pMigratingThread = currentThread;
+    currentScheduler->m_pMigrationTarget = &scheduler;
+    switch_context(currentThread, currentScheduler->find_next_thread());
+    currentThread->m_preemptionDisabled -= 1;
 
     //
-    // Switch to a user thread.
+    // Resumed by the destination scheduler, possibly on another operating system thread.
     //
-    
-    context_switch(&mainThread, find_next_thread());
+}
 
-    //
-    // When we get here, there are no more runnable user threads (although there 
-    // might be threads blocked on synchronizers).
-    //
+//
+// Prevents the current user thread from being preempted until the matching call 
+// to EnablePreemption(). Calls can be nested.
+//
 
-    assert(m_readyQueue.empty());
+void UThread::DisablePreemption()
+{
+    disable_preemption();
+}
 
-    //
-    // Allow another call to UScheduler::Run().
-    //
+//
+// Undoes a call to DisablePreemption(). When preemption becomes enabled and the 
+// thread exceeded its quantum meanwhile, the thread yields.
+//
 
-    m_pRunningThread = NULL;
+void UThread::EnablePreemption()
+{
+    UThread *currentThread = UScheduler::m_pCurrent != NULL 
+                           ? UScheduler::m_pCurrent->m_pRunningThread 
+                           : NULL;
+
+    if (currentThread != NULL) {
+        assert(currentThread->m_preemptionDisabled > 0);
+
+        if ((currentThread->m_preemptionDisabled -= 1) == 0) {
+            SafePoint();
+        }
+    }
 }
 
 //
-// Returns and removes the first user thread in the ready queue. 
-// If the ready queue is empty, the main thread is returned.
+// Yields if the scheduler requested the current user thread to be preempted.
 //
 
-UThread * UScheduler::find_next_thread() 
+void UThread::SafePoint()
 {
-    UThread *nextThread;
+    UScheduler *scheduler = UScheduler::m_pCurrent;
 
-    if (!UScheduler::m_readyQueue.empty()) {
-        nextThread = UScheduler::m_readyQueue.front();
-        UScheduler::m_readyQueue.pop_front();
-    } else {
-        nextThread = UScheduler::m_pMainThread;
+    if (scheduler->m_preemptRequested && scheduler->m_pRunningThread != scheduler->m_pMainThread) {
+        Yield();
     }
+}
 
-    return nextThread;
+//
+// Disables the preemption of the calling user thread, if there is one, and 
+// returns it. Unlike DisablePreemption(), it can be used by the scheduler 
+// outside of any user thread.
+//
+
+UThread * UThread::disable_preemption()
+{
+    UThread *currentThread = UScheduler::m_pCurrent != NULL 
+                           ? UScheduler::m_pCurrent->m_pRunningThread 
+                           : NULL;
+
+    if (currentThread != NULL) {
+        currentThread->m_preemptionDisabled += 1;
+    }
+
+    return currentThread;
 }
 
 //
-// Creates a UThread instance without allocating memory for the stack.
+// Undoes a call to disable_preemption() without yielding.
 //
 
-UThread::UThread() 
+void UThread::restore_preemption(UThread *thread)
 {
-    UScheduler::m_numThreads += 1;
-    m_threadId = ++m_threadIdSeed;
-    m_pStack = NULL;
+    if (thread != NULL) {
+        thread->m_preemptionDisabled -= 1;
+    }
 }
 
 //
-// Creates a UThread instance.
+// Decommits the growable stack of the current thread below the page in use, 
+// placing the guard page right under it. The page below the one in use stays 
+// committed, as VirtualFree() and the context switch still need stack space.
 //
 
-UThread::UThread(Function function, Argument argument) 
-    : m_pFunction(function),
-      m_argument(argument)
+void UThread::shrink_stack()
 {
-    UScheduler::m_numThreads += 1;
-    m_threadId = ++m_threadIdSeed;
+    unsigned char *stackLimit = (unsigned char *) __readfsdword(8);
+    unsigned char *newStackLimit = (unsigned char *) ((unsigned) &stackLimit & ~(m_pageSize - 1)) - m_pageSize;
 
-    m_pStack = new unsigned char[m_stackSize];
+    if (newStackLimit <= stackLimit) {
+        return;
+    }
 
-    //
-    // Initialize the stack to zeros for emotional confort.
-    //
+    if (stackLimit < m_pLowWater) {
+        m_pLowWater = stackLimit;
+    }
 
-    memset(m_pStack, 0, m_stackSize);
-            
-    //
-    // Map a UThread::Context on the thread's stack.
-    // We'll use it to save the initial context of the thread.
     //
-    // +--------------+
-    // |  0x00000000  |    <- Highest word of a thread's stack space
-    // +==============+       (needs to be set to 0 for Visual Studio to
-    // | Context::Ret | \     correctly present a thread's call stack).
-    // +--------------+  |
-    // | Context::EBP |  |
-    // +--------------+  |
-    // | Context::EBX |   >   UThread::Context mapped on the stack.
-    // +--------------+  |
-    // | Context::ESI |  |
-    // +--------------+  |
-    // | Context::EDI | /  <- Stack pointer will be set to this address
-    // +==============+       at the next context switch to this thread.
-    // |              | \
-    // +--------------+  |
-    // |       :      |  |
-    //         :          >   Remaining stack space.
-    // |       :      |  |
-    // +--------------+  |
-    // |              | /  <- Lowest word of a thread's stack space
-    // +--------------+       (m_pStack always points to this location).
+    // Arm the new guard page first, then release the old guard page and every 
+    // page down to the new one. If either step fails, the stack is left as it 
+    // was, so that it keeps growing through the old guard page.
     //
-            
-    m_pContext = new (m_pStack + m_stackSize - sizeof(unsigned) -
-                      sizeof(Context)) UThread::Context;	
+
+    DWORD oldProtection;
+    if (!VirtualProtect(newStackLimit - m_pageSize, m_pageSize, PAGE_READWRITE | PAGE_GUARD, 
+                        &oldProtection)) {
+        return;
+    }
+
+    if (!VirtualFree(stackLimit - m_pageSize, newStackLimit - stackLimit, MEM_DECOMMIT)) {
+        VirtualProtect(newStackLimit - m_pageSize, m_pageSize, PAGE_READWRITE, &oldProtection);
+        return;
+    }
+
+    __writefsdword(8, (DWORD) newStackLimit);
 }
 
 //
-// The UThread destructor.
+// The slow path of MaybeYield(), taken once the yield budget expired. When no other 
+// thread is ready, the budget is renewed instead, so the ready queue is only looked 
+// at once per budget.
 //
 
-UThread::~UThread()
+void UThread::maybe_yield()
 {
-    UScheduler::m_numThreads -= 1;
+    UScheduler *scheduler = UScheduler::m_pCurrent;
+
+    if (scheduler == NULL || scheduler->m_pRunningThread == scheduler->m_pMainThread) {
+        return;
+    }
 
     //
-    // Deletes the stack space. Note that m_pStack may be null.
+    // A deterministic scheduler keeps the budget expired and flips a coin instead.
     //
 
-    delete[] m_pStack;
-}
+    if (scheduler->m_deterministic) {
+        if (scheduler->Choose(2) != 0) {
+            Yield();
+        }
+        return;
+    }
 
-//
-// Creates a user thread to run the specified function. 
-// The thread is placed at the end of the ready queue.
-//
+    unsigned switchCount = scheduler->m_switchCount;
+    Yield();
 
-void UThread::Create(Function function, Argument argument)
-{
-    (new UThread(function, argument))->Unpark();
+    //
+    // If there was a switch, find_next_thread() already started a new budget.
+    //
+
+    if (scheduler->m_switchCount == switchCount) {
+        m_yieldDeadline = __rdtsc() + scheduler->m_yieldBudget;
+    }
 }
 
 //
-// Relinquishes the processor to the first thread in the ready queue. 
-// If there are no ready threads, the function returns immediately.
+// Returns the maximum number of bytes of its stack the thread used so far, 
+// found by looking for the deepest word that no longer holds the fill pattern. 
+// For growable stacks, it is the most memory ever committed to the stack.
 //
 
-void UThread::Yield()
+int UThread::StackHighWater() const
 {
-    if (!UScheduler::m_readyQueue.empty()) {
-        
-        //
-        // Place the current thread at the end of the ready queue, 
-        // so it can resume execution later on.
-        //
+    if (m_pStack == NULL) {
+        return 0;
+    }
 
-        UScheduler::m_readyQueue.push_back(UScheduler::m_pRunningThread);
+    if (m_growable) {
+        UScheduler *scheduler = UScheduler::m_pCurrent;
+        unsigned char *stackLimit = scheduler != NULL && scheduler->m_pRunningThread == this 
+                                  ? (unsigned char *) __readfsdword(8) 
+                                  : (unsigned char *) m_pContext->StackLimit;
 
-        //
-        // Remove the first thread in the ready queue and switch it in.
-        //
-        
-        UThread *nextThread = UScheduler::m_readyQueue.front();
-        UScheduler::m_readyQueue.pop_front();
-        context_switch(UScheduler::m_pRunningThread, nextThread);
+        return (int) (m_pStackTop - (stackLimit < m_pLowWater ? stackLimit : m_pLowWater));
     }
-}
 
-//
-// Terminates the execution of the currently running thread. All associated 
-// resources will be freed after a context switch to the next ready thread. If 
-// there are no threads in the ready queue, then the main thread is switched in 
-// and the scheduler will exit.
-//
+    unsigned *word = (unsigned *) m_pStack + 1;
+    unsigned *top = (unsigned *) m_pStackTop;
+    unsigned pattern = m_pBatch != NULL ? 0 : m_stackPattern;
 
-__declspec(noreturn) void UThread::Exit()
-{
-    internal_exit(UScheduler::m_pRunningThread, UScheduler::find_next_thread());
-    assert(!"supposed to be here!");
+    while (word < top && *word == pattern) {
+        ++word;
+    }
+
+    return (int) ((unsigned char *) top - (unsigned char *) word);
 }
 
 //
-// Returns the UThread instance representing the currently executing thread.
+// Returns the NUMA node where the top of the thread's stack resides, or -1 if
+// the stack page is not resident. Used as a placement hint when balancing load.
 //
 
-UThread & UThread::Current() 
+int UThread::GetStackNode() const
 {
-    assert(UScheduler::m_pRunningThread != NULL);
-    return *UScheduler::m_pRunningThread;
+    PSAPI_WORKING_SET_EX_INFORMATION info;
+
+    if (m_pStack == NULL) {
+        return -1;
+    }
+
+    info.VirtualAddress = m_pStackTop - sizeof(unsigned);
+    if (!QueryWorkingSetEx(GetCurrentProcess(), &info, sizeof(info)) || !info.VirtualAttributes.Valid) {
+        return -1;
+    }
+
+    return (int) info.VirtualAttributes.Node;
 }
 
 //
-// Halts the execution of the current user thread.
+// The function that a user thread begins by executing, through which 
+// the associated function is called.
 //
 
-void UThread::Park()
+void UThread::trampoline()
 {
-    assert(UScheduler::m_pRunningThread != NULL);
-    context_switch(UScheduler::m_pRunningThread, UScheduler::find_next_thread());
+    UThread *currentThread = UScheduler::m_pCurrent->m_pRunningThread;
+
+    Sanitizers::finish_switch(currentThread->m_fiber);
+    currentThread->m_pFunction(currentThread->m_argument);
+    Exit();
 }
 
 //
-// Places the UThread instance in the ready queue, making the user thread eligible to run.
+// Switches from currentThread to nextThread. The sanitizers are told before the 
+// switch, and currentThread tells them it is back once it is switched in again.
 //
 
-void UThread::Unpark()
+void UThread::switch_context(UThread *currentThread, UThread *nextThread)
 {
-    UScheduler::m_readyQueue.push_back(this);
+    UTHREAD_PROBE_SWITCH(currentThread->m_threadId, nextThread->m_threadId);
+    Sanitizers::start_switch(currentThread->m_fiber, nextThread->m_fiber, false);
+    context_switch(currentThread, nextThread);
+    Sanitizers::finish_switch(currentThread->m_fiber);
 }
 
 //
-// The function that a user thread begins by executing, through which 
-// the associated function is called.
+// The switch routines are placed between two markers, in sections that the 
+// linker merges into .text in name order, so that the preemption timer can tell 
+// whether a thread was interrupted inside them. The markers have different 
+// bodies, so that identical COMDAT folding does not merge them.
 //
 
-void UThread::trampoline()
+#pragma code_seg(".text$uts_a")
+
+__declspec(naked) void switch_code_begin()
 {
-    UThread *currentThread = UScheduler::m_pRunningThread;
-    currentThread->m_pFunction(currentThread->m_argument);
-    Exit();
+    __asm int 3
 }
 
+#pragma code_seg(".text$uts_b")
+
 //
 // Performs a context switch from currentThread (switch out) to nextThread (switch in).
 // __fastcall sets the calling convention such that currentThread is in ECX and  
@@ -331,6 +2240,17 @@ __declspec(naked) void __fastcall context_switch(UThread *currentThread, UThread
         push    esi
         push    edi
 
+        //
+        // Save the SEH chain and the stack bounds from the NT_TIB, and the 
+        // TEB's DeallocationStack (at fs:[0E0Ch] on x86), which the kernel 
+        // checks before growing a stack.
+        //
+
+        push    dword ptr fs:[0]
+        push    dword ptr fs:[4]
+        push    dword ptr fs:[8]
+        push    dword ptr fs:[0E0Ch]
+
         //
         // Save ESP in currentThread->m_pContext.
         //
@@ -338,10 +2258,11 @@ __declspec(naked) void __fastcall context_switch(UThread *currentThread, UThread
         mov     dword ptr [ecx + UThread::m_pContext], esp
 
         //
-        // Set nextThread as the running thread.
+        // Set nextThread as the running thread of its scheduler.
         //
 
-        mov     UScheduler::m_pRunningThread, edx		
+        mov     eax, dword ptr [edx + UThread::m_pScheduler]
+        mov     dword ptr [eax + UScheduler::m_pRunningThread], edx
 
         //
         // Load nextThread's context, starting by switching to its stack,  
@@ -349,7 +2270,22 @@ __declspec(naked) void __fastcall context_switch(UThread *currentThread, UThread
         //
 
         mov     esp, dword ptr [edx + UThread::m_pContext]
-        
+
+        //
+        // If currentThread is migrating to another scheduler, hand it over now 
+        // that its context is saved.
+        //
+
+        cmp     dword ptr [eax + UScheduler::m_pMigratingThread], 0
+        je      switch_in
+        mov     ecx, eax
+        call    UScheduler::finish_migration
+
+    switch_in:
+        pop     dword ptr fs:[0E0Ch]
+        pop     dword ptr fs:[8]
+        pop     dword ptr fs:[4]
+        pop     dword ptr fs:[0]
         pop     edi
         pop     esi
         pop     ebx
@@ -375,10 +2311,11 @@ __declspec(naked) void __fastcall internal_exit(UThread *currentThread, UThread
     __asm {
 
         //
-        // Set nextThread as the running thread.
+        // Set nextThread as the running thread of its scheduler.
         //
 
-        mov     UScheduler::m_pRunningThread, edx
+        mov     eax, dword ptr [edx + UThread::m_pScheduler]
+        mov     dword ptr [eax + UScheduler::m_pRunningThread], edx
 
         //
         // Load nextThread's stack pointer before calling UThread::self_destroy(): 
@@ -388,6 +2325,16 @@ __declspec(naked) void __fastcall internal_exit(UThread *currentThread, UThread
 
         mov     esp, dword ptr [edx + UThread::m_pContext]
 
+        //
+        // Restore nextThread's SEH chain and stack bounds, so that the stack being 
+        // freed is no longer described by the NT_TIB.
+        //
+
+        pop     dword ptr fs:[0E0Ch]
+        pop     dword ptr fs:[8]
+        pop     dword ptr fs:[4]
+        pop     dword ptr fs:[0]
+
         call    UThread::self_destroy
 
         //
@@ -402,3 +2349,15 @@ __declspec(naked) void __fastcall internal_exit(UThread *currentThread, UThread
         ret
     }
 }
+
+#pragma code_seg(".text$uts_c")
+
+__declspec(naked) void switch_code_end()
+{
+    __asm {
+        int 3
+        int 3
+    }
+}
+
+#pragma code_seg()
@@ -16,44 +16,87 @@
 
 #pragma once
 
+#include <cstdio>
+#include <intrin.h>
+
+#include "CacheLine.h"
+#include "List.h"
+#include "Sanitizers.h"
+
+class Mutex;
 class UScheduler;
 
 //
 // The representation of a user thread.
 //
 
-class UThread 
+class CACHE_ALIGNED UThread : public CacheAligned
 {
 public:
 
     typedef void *Argument;
     typedef void (*Function)(Argument);
 
+    //
+    // The flags that select how a thread is created.
+    //
+
+    enum CreationFlags
+    {
+        //
+        // The thread's stack starts with two committed pages and grows on demand 
+        // within a reserved region, shrinking back when the thread parks.
+        //
+
+        GrowableStack = 1,
+
+        //
+        // The thread uses the x87, MMX or SSE registers, including the MXCSR and 
+        // x87 control words, and gets them preserved across switches. The state 
+        // is swapped lazily: switches to threads without this flag leave it in 
+        // the registers, so such threads must not use floating point or SIMD.
+        //
+
+        VectorState = 2
+    };
+
 private:
-    
-    //
-    // The data structure representing the layout of a thread's execution 
-    // context when saved in the thread's stack.
+    
+    //
+    // The data structure representing the layout of a thread's execution 
+    // context when saved in the thread's stack. Besides the callee-saved 
+    // registers, it holds the thread's view of the NT_TIB fields (the SEH chain 
+    // and the stack bounds) and of the TEB's DeallocationStack, so a thread can 
+    // be resumed on any operating system thread and its stack can grow.
     //
 
     struct Context
     {
+        void *DeallocationStack;
+        void *StackLimit;
+        void *StackBase;
+        void *ExceptionList;
         unsigned EDI;
         unsigned ESI;
         unsigned EBX;
         unsigned EBP;
         void (*Ret)();
 
-        //
-        // Set the thread's initial context by initializing the values of EDI, EBX, ESI 
-        // and EBP (must be zero for Visual Studio to correctly present a thread's call stack)
-        // and by hooking the return address. Upon the first context switch to this thread, 
-        // after popping the dummy values of the "saved" registers, a ret instruction will 
-        // place InternalStart's address on the processor's IP.
+        //
+        // Set the thread's initial context by initializing the values of EDI, EBX, ESI 
+        // and EBP (must be zero for Visual Studio to correctly present a thread's call stack)
+        // and by hooking the return address. Upon the first context switch to this thread, 
+        // after popping the dummy values of the "saved" registers, a ret instruction will 
+        // place InternalStart's address on the processor's IP. The SEH chain starts empty 
+        // and the stack bounds are those of the thread's stack.
         //
 
-        Context() 
-            : EBX(0x11111111),
+        Context(void *stackBase, void *stackLimit, void *deallocationStack) 
+            : DeallocationStack(deallocationStack),
+              StackLimit(stackLimit),
+              StackBase(stackBase),
+              ExceptionList((void *) 0xFFFFFFFF),
+              EBX(0x11111111),
               ESI(0x22222222),
               EDI(0x33333333),
               EBP(0x00000000),
@@ -68,16 +111,27 @@ private:
     static const int m_stackSize = 16 * 4096;
 
     //
-    // The thread id.
+    // The size of the region reserved for a growable stack, of which only the 
+    // topmost m_growableStackCommit bytes are committed initially.
     //
 
-    int m_threadId;
+    static const int m_growableStackReserve = 256 * 4096;
+    static const int m_growableStackCommit = 2 * 4096;
+    static const int m_pageSize = 4096;
 
     //
-    // The memory block used as the thread's stack.
+    // The pattern that fills unused stack space and the canary placed in the 
+    // lowest word of the stack, which is only overwritten by a stack overflow.
     //
 
-    unsigned char *m_pStack;
+    static const unsigned m_stackPattern = 0xCCCCCCCC;
+    static const unsigned m_stackCanary = 0x5AFEC0DE;
+
+    //
+    // The hot state, touched on every context switch, comes first. Instances are 
+    // cache-line aligned and these fields fit in one line, so a switch touches 
+    // a single line of each of the threads involved.
+    //
 
     //
     // A pointer to the thread's context stored in its stack.
@@ -85,6 +139,92 @@ private:
 
     Context *m_pContext;
 
+    //
+    // The scheduler that runs the thread.
+    //
+
+    UScheduler *m_pScheduler;
+
+    //
+    // The scheduling state of the thread.
+    //
+
+    enum State
+    {
+        Running,
+        Ready,
+        Parked
+    };
+
+    State m_state;
+
+    //
+    // The park permit. It is set by Unpark() when the thread is not parked and
+    // consumed by the next call to Park(), which then returns immediately.
+    //
+
+    bool m_permit;
+
+    //
+    // Whether the thread was created with VectorState.
+    //
+
+    bool m_vectorState;
+
+    //
+    // Whether the thread last switched out inside an operation that uses its 
+    // scheduler's state when it resumes, such as a blocking call made with 
+    // preemption disabled or a Park() seen by the deadlock detector. The load 
+    // balancer does not move such a thread while it is ready.
+    //
+
+    bool m_schedulerBound;
+
+    //
+    // The nesting depth of DisablePreemption() calls. The thread can only be 
+    // preempted asynchronously while it is zero.
+    //
+
+    volatile int m_preemptionDisabled;
+
+    //
+    // The link used while the thread is in its scheduler's ready queue.
+    //
+
+    ListNode m_readyNode;
+
+    //
+    // Set when the thread or one of its ancestors is cancelled.
+    //
+
+    volatile long m_cancelled;
+
+    //
+    // The link used while the thread is in UScheduler::m_pRemoteReadyList.
+    //
+
+    UThread *m_pNextRemoteReady;
+
+    //
+    // The link used while the thread is in UScheduler::m_pRemoteUnparkList, and 
+    // whether it is there. A thread is pushed only once however many operating 
+    // system threads unpark it meanwhile.
+    //
+
+    UThread *m_pNextRemoteUnpark;
+    volatile long m_unparkPending;
+
+    //
+    // The cold state, used when threads are created, exit or block, starts a new 
+    // cache line.
+    //
+
+    //
+    // The thread id.
+    //
+
+    CACHE_ALIGNED int m_threadId;
+
     //
     // The thread's starting function and argument.
     //
@@ -92,18 +232,151 @@ private:
     Function m_pFunction;
     Argument m_argument;
 
+    //
+    // The memory block used as the thread's stack.
+    //
+
+    unsigned char *m_pStack;
+
+    //
+    // The address just above the thread's stack.
+    //
+
+    unsigned char *m_pStackTop;
+
+    //
+    // Whether the stack is growable and, if so, the lowest stack limit it had 
+    // before being shrunk.
+    //
+
+    bool m_growable;
+    unsigned char *m_pLowWater;
+
+    //
+    // The link in the scheduler's list of all its threads.
+    //
+
+    ListNode m_allNode;
+
+    //
+    // The link used while the thread is in the wait list of a Mutex or a Semaphore. 
+    // It is cleared when the thread leaves the list, so a woken thread tells in 
+    // constant time whether it was released or has to unlink itself.
+    //
+
+    ListNode m_waitNode;
+
+    //
+    // The thread that created this one, the link in its list of children and the 
+    // threads this one created that are still alive. They are protected by a 
+    // process-wide lock and only touched when threads are created, exit or are 
+    // cancelled.
+    //
+
+    UThread *m_pParent;
+    ListNode m_childNode;
+    List<UThread, &UThread::m_childNode> m_children;
+
+    //
+    // The header of the memory block shared by the threads created by a call to 
+    // CreateBatch(). The block is released when the last of them is destroyed.
+    //
+
+    struct Batch
+    {
+        void *Block;
+        volatile long Remaining;
+    };
+
+    //
+    // The batch the thread belongs to, or NULL if it was created on its own.
+    //
+
+    Batch *m_pBatch;
+
+    //
+    // The FXSAVE area holding the thread's floating point and SIMD state while 
+    // another thread's is in the registers, and whether it holds any state yet. 
+    // Only allocated for threads with VectorState.
+    //
+
+    static const int m_vectorAreaSize = 512;
+
+    void *m_pVectorArea;
+    bool m_vectorSaved;
+
+    //
+    // What the sanitizers and Valgrind know about the thread's stack. Empty unless 
+    // the build uses them.
+    //
+
+    FiberAnnotations m_fiber;
+
+    //
+    // What the thread is blocked on, recorded while its scheduler detects deadlocks: 
+    // the object and its kind, the mutex whose owner the thread waits for, the link 
+    // in the scheduler's blocked list and the stack captured when the thread blocked.
+    //
+
+    static const int m_maxBlockedStackDepth = 16;
+
+    const void *m_pBlockedOn;
+    const char *m_blockedOnKind;
+    Mutex *m_pBlockedOnMutex;
+    ListNode m_blockedNode;
+    void *m_blockedStack[m_maxBlockedStackDepth];
+    int m_blockedStackDepth;
+
+    //
+    // The time stamp counter value at which the running thread's yield budget 
+    // expires. It is per operating system thread, as is the current scheduler, 
+    // so MaybeYield() needs no indirection to read it.
+    //
+
+    static __declspec(thread) unsigned __int64 m_yieldDeadline;
+
 public:
         
-    //
-    // Creates a user thread to run the specified function. 
-    // The new thread is placed at the end of the ready queue.
     //
+    // Creates a user thread to run the specified function. The new thread is 
+    // placed at the end of the current scheduler's ready queue. The flags are a 
+    // combination of CreationFlags values.
+    //
+
+    static void Create(Function function, Argument argument, unsigned flags = 0);
+
+    //
+    // Creates a user thread to run the specified function. The new thread is 
+    // placed at the end of the specified scheduler's ready queue. Can be called 
+    // from any operating system thread.
+    //
+
+    static void Create(UScheduler &scheduler, Function function, Argument argument, 
+                       unsigned flags = 0);
+
+    //
+    // Creates count user threads running the specified function, the i-th one with 
+    // arguments[i]. The threads and their stacks are carved from a single allocation 
+    // and are appended to the current scheduler's ready queue in one operation. 
+    // The allocation commits count stacks of m_stackSize bytes up front, about 
+    // 64 MB per thousand threads, so in a 32-bit process a batch is limited to a 
+    // few thousand threads; bad_alloc is thrown if it cannot be allocated.
+    //
+
+    static void CreateBatch(Function function, Argument arguments[], int count);
 
-    static void Create(Function function, Argument argument);
-        
-    //
-    // Relinquishes the processor to the first user thread in the ready queue. 
-    // If there are no ready threads, the function returns immediately.
+    //
+    // Creates count user threads running the specified function, the i-th one with 
+    // arguments[i], and appends them to the specified scheduler's ready queue in 
+    // one operation. Can be called from any operating system thread.
+    //
+
+    static void CreateBatch(UScheduler &scheduler, Function function, Argument arguments[], 
+                            int count);
+        
+    //
+    // Relinquishes the processor to the first user thread in the ready queue. 
+    // If there are no ready threads, the function returns immediately.
     //
         
     static void Yield();
@@ -124,17 +397,114 @@ public:
     static UThread & Current();
 
     //
-    // Halts the execution of the current user thread.
+    // Halts the execution of the current user thread until Unpark() is called on it.
+    // If the thread's permit is available, it is consumed and the function returns 
+    // immediately. Returns false if the thread has been cancelled, in which case 
+    // the Unpark() may have come from Cancel().
+    //
+
+    static bool Park();
+
+    //
+    // Parks the current user thread for the specified time, letting the others run. 
+    // The thread is woken by its scheduler's timers. Returns false, possibly early, 
+    // if the thread has been cancelled.
     //
 
-    static void Park();
+    static bool Sleep(int milliseconds);
 
     //
-    // Places the UThread instance in the ready queue, making the user thread eligible to run.
+    // Cancels the thread and the threads it created, transitively, including those 
+    // created after this call. Blocked threads are woken, and blocking operations 
+    // of cancelled threads return false without blocking. Can be called from any 
+    // operating system thread.
+    //
+
+    void Cancel();
+
+    //
+    // Returns whether the thread has been cancelled.
+    //
+
+    bool IsCancelled() const
+    {
+        return m_cancelled != 0;
+    }
+
+    //
+    // The type of the wait lists of Mutex and Semaphore, linked through the 
+    // threads themselves.
+    //
+
+    typedef List<UThread, &UThread::m_waitNode> WaitList;
+
+    //
+    // Places the UThread instance in the ready queue if it is parked, making the user 
+    // thread eligible to run. Otherwise, makes the thread's permit available, so that 
+    // its next call to Park() returns immediately. Permits do not accumulate. Can be 
+    // called from any operating system thread; when it is not the one running the 
+    // thread's scheduler, the unpark is handed over to that scheduler.
     //
 
     void Unpark();
 
+    //
+    // Moves the current user thread to the specified scheduler, which may be running 
+    // on another operating system thread. The thread resumes execution there, at the 
+    // end of the scheduler's ready queue. If the scheduler is not running, the thread 
+    // only resumes once it is.
+    //
+
+    static void MigrateTo(UScheduler &scheduler);
+
+    //
+    // Returns the NUMA node where the top of the thread's stack resides, or -1 if
+    // the stack page is not resident. Used as a placement hint when balancing load.
+    //
+
+    int GetStackNode() const;
+
+    //
+    // Returns the maximum number of bytes of its stack the thread used so far, 
+    // found by looking for the deepest word that no longer holds the fill pattern. 
+    // For growable stacks, it is the most memory ever committed to the stack.
+    //
+
+    int StackHighWater() const;
+
+    //
+    // Prevents the current user thread from being preempted until the matching call 
+    // to EnablePreemption(). Calls can be nested.
+    //
+
+    static void DisablePreemption();
+
+    //
+    // Undoes a call to DisablePreemption(). When preemption becomes enabled and the 
+    // thread exceeded its quantum meanwhile, the thread yields.
+    //
+
+    static void EnablePreemption();
+
+    //
+    // Yields if the scheduler requested the current user thread to be preempted.
+    //
+
+    static void SafePoint();
+
+    //
+    // Yields if the current user thread used up its yield budget and other threads 
+    // are ready. Until the budget expires, the call costs a single compare, so it can 
+    // be placed in tight loops where Yield() would switch on every iteration.
+    //
+
+    static void MaybeYield()
+    {
+        if (__rdtsc() >= m_yieldDeadline) {
+            maybe_yield();
+        }
+    }
+
     //
     // Returns the thread's id.
     //
@@ -150,13 +520,21 @@ private:
     // Creates a UThread instance without allocating memory for the stack.
     //
 
-    UThread();
+    UThread(UScheduler &scheduler);
         
     //
     // Creates a UThread instance.
     //
 
-    UThread(Function function, Argument argument);
+    UThread(UScheduler &scheduler, Function function, Argument argument, unsigned flags);
+
+    //
+    // Creates a UThread instance of a batch, whose stack was already allocated and 
+    // zero-filled.
+    //
+
+    UThread(UScheduler &scheduler, Function function, Argument argument, 
+            unsigned char *stack, Batch *batch);
 
     //
     // A private copy construtor used to prohibit copies. It has no definition.
@@ -184,17 +562,151 @@ private:
     static void trampoline();
 
     //
-    // Helper function called by assembly code to proxy the application of delete.
+    // Switches from currentThread to nextThread, telling the sanitizers about the 
+    // change of stacks.
+    //
+
+    static void switch_context(UThread *currentThread, UThread *nextThread);
+
+    //
+    // Maps the thread's initial context at the top of its stack.
+    //
+
+    void init_context(unsigned char *stackLimit);
+
+    //
+    // Disables the preemption of the calling user thread, if there is one, and 
+    // returns it. Unlike DisablePreemption(), it can be used by the scheduler 
+    // outside of any user thread.
+    //
+
+    static UThread * disable_preemption();
+
+    //
+    // Undoes a call to disable_preemption() without yielding.
     //
 
-    void self_destroy()
+    static void restore_preemption(UThread *thread);
+
+    //
+    // Decommits the growable stack of the current thread below the page in use, 
+    // placing the guard page right under it.
+    //
+
+    void shrink_stack();
+
+    //
+    // The slow path of MaybeYield(), taken once the yield budget expired.
+    //
+
+    static void maybe_yield();
+
+    //
+    // Returns false if the thread's stack canary was overwritten.
+    //
+
+    bool stack_intact() const
     {
-        delete this;
+        return m_pStack == NULL || m_growable || *(unsigned *) m_pStack == m_stackCanary;
     }
 
+    //
+    // Helper function called by assembly code to proxy the application of delete. 
+    // Threads of a batch are destroyed in place, releasing the batch's memory 
+    // block along with the last of them.
+    //
+
+    void self_destroy();
+
+    //
+    // Prints the thread's state, what it is blocked on and its backtrace, walking 
+    // the frame pointer chain from its saved context. The thread must not be 
+    // running on another operating system thread.
+    //
+
+    void dump(FILE *stream) const;
+
+    //
+    // Prints a backtrace frame, with its symbol when DbgHelp finds one.
+    //
+
+    static void print_frame(FILE *stream, void *address);
+
+    //
+    // Links the threads as children of the calling user thread, if there is one. 
+    // Children of a cancelled thread start out cancelled.
+    //
+
+    static void adopt(UThread *threads, int count);
+
+    //
+    // Acquire and release the lock protecting the parent and child links.
+    //
+
+    static UThread * lock_family();
+    static void unlock_family(UThread *callerThread);
+
+    //
+    // Hands the thread's children over to its parent and unlinks it from the 
+    // parent's list of children.
+    //
+
+    void orphan();
+
+    //
+    // Save the floating point and SIMD registers to the thread's FXSAVE area, 
+    // and load them from it, or reset them to their defaults if it holds no 
+    // state yet.
+    //
+
+    void save_vector_state();
+    void load_vector_state();
+
     //
     // UScheduler can access the private state of an UThread instance.
     //
 
     friend class UScheduler;
+
+    //
+    // The preemption timer inspects and interrupts the running thread.
+    //
+
+    friend class PreemptionTimer;
+
+    //
+    // The load balancer hands ready threads over to other schedulers.
+    //
+
+    friend class LoadBalancer;
+
+    //
+    // The deadlock detector records what the thread is blocked on.
+    //
+
+    friend class DeadlockDetector;
+};
+
+//
+// Disables the preemption of the current user thread while in scope.
+//
+
+class PreemptionGuard
+{
+public:
+
+    PreemptionGuard()
+    {
+        UThread::DisablePreemption();
+    }
+
+    ~PreemptionGuard()
+    {
+        UThread::EnablePreemption();
+    }
+
+private:
+
+    PreemptionGuard(const PreemptionGuard &);
+    PreemptionGuard & operator =(const PreemptionGuard &);
 };
@@ -0,0 +1,280 @@
+///////////////////////////////////////////////////////////
+//
+// CCISEL 
+// 2007-2010
+//
+// UThread library:
+//     User threads supporting cooperative multithreading.
+//     The current version of the library provides:
+//        - Threads
+//        - Mutexes
+//        - Semaphores
+//
+// Authors: Carlos Martins, Joao Trindade, Duarte Nunes
+// 
+// 
+
+#pragma once
+
+#include <intrin.h>
+#include "CacheLine.h"
+#include "EventCount.h"
+
+//
+// A Chase-Lev work-stealing deque of T pointers. Only the owning thread pushes 
+// and pops, at the bottom; any other thread, on any operating system thread, 
+// steals from the top. The deque grows as needed. Arrays that were replaced are 
+// kept until the deque is destroyed, as thieves may still be reading them.
+//
+
+template <class T>
+class WorkStealingDeque
+{
+    struct Array
+    {
+        long Mask;
+        T **Items;
+        Array *Previous;
+    };
+
+    //
+    // The top is written by thieves and the bottom by the owner, so they are 
+    // kept in different cache lines.
+    //
+
+    char m_pad0[CACHE_LINE_SIZE];
+    volatile long m_top;
+    char m_pad1[CACHE_LINE_SIZE - sizeof(long)];
+    volatile long m_bottom;
+    Array * volatile m_pArray;
+    char m_pad2[CACHE_LINE_SIZE - sizeof(long) - sizeof(Array *)];
+
+public:
+
+    //
+    // Creates a deque with room for the specified number of items, which must 
+    // be a power of two, before it needs to grow.
+    //
+
+    explicit WorkStealingDeque(long capacity = 256)
+        : m_top(0),
+          m_bottom(0),
+          m_pArray(new_array(capacity, NULL))
+    { }
+
+    ~WorkStealingDeque()
+    {
+        Array *array = m_pArray;
+        while (array != NULL) {
+            Array *previous = array->Previous;
+            delete[] array->Items;
+            delete array;
+            array = previous;
+        }
+    }
+
+    //
+    // Pushes an item at the bottom. Only called by the owner.
+    //
+
+    void Push(T *item)
+    {
+        long bottom = m_bottom;
+        long top = m_top;
+        Array *array = m_pArray;
+
+        if (bottom - top > array->Mask) {
+            array = grow(array, top, bottom);
+        }
+
+        array->Items[bottom & array->Mask] = item;
+
+        //
+        // Volatile stores are not reordered, so thieves see the item before 
+        // the new bottom.
+        //
+
+        m_bottom = bottom + 1;
+    }
+
+    //
+    // Pops the item at the bottom, returning NULL if the deque is empty. Only 
+    // called by the owner.
+    //
+
+    T * Pop()
+    {
+        long bottom = m_bottom - 1;
+        Array *array = m_pArray;
+
+        //
+        // The store to the bottom must be visible before the top is read, which 
+        // takes a full fence.
+        //
+
+        _InterlockedExchange(&m_bottom, bottom);
+        long top = m_top;
+
+        if (top > bottom) {
+            m_bottom = top;
+            return NULL;
+        }
+
+        T *item = array->Items[bottom & array->Mask];
+        if (top == bottom) {
+
+            //
+            // The last item: race the thieves for it.
+            //
+
+            if (_InterlockedCompareExchange(&m_top, top + 1, top) != top) {
+                item = NULL;
+            }
+            m_bottom = top + 1;
+        }
+
+        return item;
+    }
+
+    //
+    // Steals the item at the top. Returns NULL if the deque is empty or if another 
+    // thread took the item first, in which case the caller may retry.
+    //
+
+    T * Steal()
+    {
+        long top = m_top;
+        long bottom = m_bottom;
+
+        if (top >= bottom) {
+            return NULL;
+        }
+
+        Array *array = m_pArray;
+        T *item = array->Items[top & array->Mask];
+
+        if (_InterlockedCompareExchange(&m_top, top + 1, top) != top) {
+            return NULL;
+        }
+
+        return item;
+    }
+
+    //
+    // Returns true if the deque seemed empty when called.
+    //
+
+    bool Empty() const
+    {
+        return m_top >= m_bottom;
+    }
+
+private:
+
+    static Array * new_array(long capacity, Array *previous)
+    {
+        Array *array = new Array;
+        array->Mask = capacity - 1;
+        array->Items = new T *[capacity];
+        array->Previous = previous;
+        return array;
+    }
+
+    //
+    // Replaces the array with one twice as large holding the same items.
+    //
+
+    Array * grow(Array *array, long top, long bottom)
+    {
+        Array *larger = new_array(2 * (array->Mask + 1), array);
+
+        for (long i = top; i < bottom; ++i) {
+            larger->Items[i & larger->Mask] = array->Items[i & array->Mask];
+        }
+
+        m_pArray = larger;
+        return larger;
+    }
+
+    WorkStealingDeque(const WorkStealingDeque &);
+    WorkStealingDeque & operator =(const WorkStealingDeque &);
+};
+
+//
+// A work-stealing deque whose thieves can park until the owner pushes an item. 
+// Stealing only enters the scheduler when the deque is empty.
+//
+
+template <class T>
+class BlockingWorkStealingDeque
+{
+    WorkStealingDeque<T> m_deque;
+    EventCount m_itemAvailable;
+
+public:
+
+    explicit BlockingWorkStealingDeque(long capacity = 256)
+        : m_deque(capacity)
+    { }
+
+    //
+    // Pushes an item at the bottom, waking a parked thief. Only called by the owner.
+    //
+
+    void Push(T *item)
+    {
+        m_deque.Push(item);
+        m_itemAvailable.NotifyOne();
+    }
+
+    //
+    // Pops the item at the bottom, returning NULL if the deque is empty. Only 
+    // called by the owner.
+    //
+
+    T * Pop()
+    {
+        return m_deque.Pop();
+    }
+
+    //
+    // Steals the item at the top, returning NULL if there is none or on contention.
+    //
+
+    T * TrySteal()
+    {
+        return m_deque.Steal();
+    }
+
+    //
+    // Steals the item at the top, parking the current user thread while the 
+    // deque is empty.
+    //
+
+    T * Steal()
+    {
+        for (;;) {
+            T *item = m_deque.Steal();
+            if (item != NULL) {
+                return item;
+            }
+
+            if (!m_deque.Empty()) {
+                continue;
+            }
+
+            long key = m_itemAvailable.PrepareWait();
+
+            item = m_deque.Steal();
+            if (item != NULL || !m_deque.Empty()) {
+                m_itemAvailable.CancelWait();
+                if (item != NULL) {
+                    return item;
+                }
+                continue;
+            }
+
+            m_itemAvailable.Wait(key);
+        }
+    }
+};